@@ -0,0 +1,536 @@
+/**
+ * @file   bench.c
+ * @brief  Load generator for the ictredis LKM. Each thread opens the device once and runs a mix
+ * of GET, PUSH, EDIT and DELETE requests through the ioctl() interface on a shared keyspace,
+ * picking keys uniformly or with a Zipfian skew. Every request is timed, and each run reports
+ * its throughput and the p50/p99/p999 latency, overall and per operation, as a table and
+ * optionally as one JSON object per line for scripts that track regressions.
+ *
+ * Usage: ictredis_bench [-t threads[,threads...]] [-n ops_per_thread] [-m mix] [-k keys]
+ *                       [-v value_size[-max_size]] [-d uniform|zipf] [-z theta] [-o file]
+ *                       [-D device | -I]
+ *
+ * The mix is a list of operations and their weights, "get=90,edit=10" by default. The keys are
+ * stored before each run, so GET and EDIT find them unless DELETE removed them. A GET, EDIT or
+ * DELETE that finds no key and a PUSH that finds one are counted as misses, not errors.
+ * With several thread counts the runs show how throughput grows with the number of threads.
+ * -I runs the same requests in process, on a store of libictredis linked into the benchmark,
+ * which shows what the engine costs without the system calls around it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "ictRedis.h"
+#include "ictRedis_lib.h"
+
+#define DEVICE_PATH "/dev/ictredis"
+#define MAX_RUNS 32                     ///< Most thread counts given to -t
+#define NR_BENCH_OPS 4                  ///< GET, PUSH, EDIT, DELETE
+#define SUB_BUCKET_BITS 5               ///< Each power of two of latency is split in 32 buckets
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define NR_BUCKETS (64 * SUB_BUCKETS)   ///< Enough for any u64 of nanoseconds
+#define INPROC_MAX_MEMORY (64UL * 1024 * 1024) ///< The memory budget of the in-process store, the module's default
+
+static const char *op_names[NR_BENCH_OPS] = {"get", "push", "edit", "delete"};
+static const unsigned long op_ioctls[NR_BENCH_OPS] = {
+        ICTREDIS_IOC_GET, ICTREDIS_IOC_SET, ICTREDIS_IOC_EDIT, ICTREDIS_IOC_DEL,
+};
+
+/// Latencies of one operation, log-linear buckets with at most about 3% error
+struct histogram_t {
+    uint64_t count;
+    uint64_t misses;
+    uint64_t buckets[NR_BUCKETS];
+};
+
+/// What every run does, from the command line
+struct config_t {
+    const char *device;
+    ictredis_t *store;                  ///< The in-process store with -I, NULL to use the device
+    long ops;                           ///< Requests of each thread
+    unsigned int weights[NR_BENCH_OPS];
+    unsigned int total_weight;
+    unsigned long keys;
+    unsigned int value_min;
+    unsigned int value_max;
+    int zipf;                           ///< Zipfian key popularity instead of uniform
+    double theta;                       ///< The Zipf skew, 0 < theta < 1, 0.99 like YCSB
+    double zeta_n;                      ///< Precomputed for the Zipf generator
+    double zeta_2;
+    double eta;
+};
+
+struct worker_t {
+    pthread_t thread;
+    int id;
+    const struct config_t *config;
+    pthread_barrier_t *start;           ///< Lets every thread begin at once
+    struct histogram_t histograms[NR_BENCH_OPS];
+    int failed;                         ///< errno of the request that failed, ending the thread
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*, one state per thread so picking keys never shares a cache line
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// uniform in [0, 1)
+static double next_double(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double zeta(unsigned long n, double theta) {
+    double sum = 0;
+    unsigned long i;
+
+    for (i = 1; i <= n; i++) {
+        sum += 1 / pow((double) i, theta);
+    }
+    return sum;
+}
+
+// Gray et al., "Quickly generating billion-record synthetic databases", as used by YCSB
+static void zipf_init(struct config_t *config) {
+    config->zeta_n = zeta(config->keys, config->theta);
+    config->zeta_2 = zeta(2, config->theta);
+    config->eta = (1 - pow(2.0 / config->keys, 1 - config->theta)) / (1 - config->zeta_2 / config->zeta_n);
+}
+
+// The index of the next key. Zipfian ranks are scattered over the keyspace by a hash, so the
+// popular keys do not all sit next to each other and land on different shards.
+static unsigned long next_key(const struct config_t *config, uint64_t *state) {
+    double u, uz;
+    unsigned long rank;
+
+    if (!config->zipf) {
+        return next_random(state) % config->keys;
+    }
+    u = next_double(state);
+    uz = u * config->zeta_n;
+    if (uz < 1) {
+        rank = 0;
+    } else if (uz < 1 + pow(0.5, config->theta)) {
+        rank = 1;
+    } else {
+        rank = (unsigned long) (config->keys * pow(config->eta * u - config->eta + 1, 1 / (1 - config->theta)));
+    }
+    return (rank * 0x9E3779B97F4A7C15ULL) % config->keys;
+}
+
+static int next_op(const struct config_t *config, uint64_t *state) {
+    unsigned int pick = next_random(state) % config->total_weight;
+    int op;
+
+    for (op = 0; pick >= config->weights[op]; op++) {
+        pick -= config->weights[op];
+    }
+    return op;
+}
+
+static unsigned int next_value_len(const struct config_t *config, uint64_t *state) {
+    return config->value_min + next_random(state) % (config->value_max - config->value_min + 1);
+}
+
+static int bucket_of(uint64_t ns) {
+    int bits = 64 - __builtin_clzll(ns | 1);
+
+    if (bits <= SUB_BUCKET_BITS) {
+        return (int) ns;                // small values get a bucket each
+    }
+    return (bits - SUB_BUCKET_BITS) * SUB_BUCKETS + (int) ((ns >> (bits - SUB_BUCKET_BITS - 1)) & (SUB_BUCKETS - 1));
+}
+
+// the largest latency a bucket holds
+static uint64_t bucket_top(int bucket) {
+    int shift = bucket / SUB_BUCKETS - 1;
+
+    if (bucket < 2 * SUB_BUCKETS) {
+        return (uint64_t) bucket;       // exact below 64 ns
+    }
+    return ((uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void histogram_add(struct histogram_t *into, const struct histogram_t *from) {
+    int i;
+
+    into->count += from->count;
+    into->misses += from->misses;
+    for (i = 0; i < NR_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+// the latency that a fraction of the requests stayed within, 0 for none
+static uint64_t percentile(const struct histogram_t *h, double fraction) {
+    uint64_t rank = (uint64_t) ceil(h->count * fraction), seen = 0;
+    int i;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    for (i = 0; i < NR_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return bucket_top(i);
+        }
+    }
+    return bucket_top(NR_BUCKETS - 1);
+}
+
+static void fill_key(char *key, size_t size, unsigned long index, struct ictredis_cmd *cmd) {
+    cmd->key_len = snprintf(key, size, "bench:%010lu", index);
+}
+
+// Run one request on the device or the in-process store, 0 or the errno it failed with. GET
+// reads into the value_len bytes at value.
+static int bench_op(const struct config_t *config, int fd, int op, struct ictredis_cmd *cmd) {
+    const char *key = (const char *) (uintptr_t) cmd->key;
+    char *value = (char *) (uintptr_t) cmd->value;
+    long ret;
+
+    if (config->store == NULL) {
+        return ioctl(fd, op_ioctls[op], cmd) < 0 ? errno : 0;
+    }
+    switch (op) {
+        case 0:
+            ret = ictredis_get(config->store, key, cmd->key_len, value, cmd->value_len);
+            break;
+        case 1:
+            ret = ictredis_push(config->store, key, cmd->key_len, value, cmd->value_len, cmd->ttl_ms);
+            break;
+        case 2:
+            ret = ictredis_edit(config->store, key, cmd->key_len, value, cmd->value_len, cmd->ttl_ms);
+            break;
+        default:
+            ret = ictredis_delete(config->store, key, cmd->key_len);
+            break;
+    }
+    return ret < 0 ? (int) -ret : 0;
+}
+
+static void *worker(void *arg) {
+    struct worker_t *w = (struct worker_t *) arg;
+    const struct config_t *config = w->config;
+    uint64_t state = 0x9E3779B97F4A7C15ULL * (w->id + 1), start;
+    struct ictredis_cmd cmd;
+    char key[32], *value = malloc(config->value_max > 0 ? config->value_max : 1);
+    int fd = config->store == NULL ? open(config->device, O_RDWR) : -1, op, ret;
+    long i;
+
+    pthread_barrier_wait(w->start);
+    if ((fd < 0 && config->store == NULL) || value == NULL) {
+        w->failed = value == NULL ? ENOMEM : errno;
+        free(value);
+        return NULL;
+    }
+    memset(value, 'v', config->value_max);
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.key = (unsigned long) key;
+    cmd.value = (unsigned long) value;
+    for (i = 0; i < config->ops; i++) {
+        op = next_op(config, &state);
+        fill_key(key, sizeof(key), next_key(config, &state), &cmd);
+        cmd.value_len = op == 0 ? config->value_max : next_value_len(config, &state);
+        start = now_ns();
+        ret = bench_op(config, fd, op, &cmd);
+        if (ret != 0) {
+            if (ret != ENOENT && ret != EEXIST) {
+                w->failed = ret;
+                break;
+            }
+            w->histograms[op].misses++;
+        }
+        w->histograms[op].buckets[bucket_of(now_ns() - start)]++;
+        w->histograms[op].count++;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(value);
+    return NULL;
+}
+
+// store every key, so each run starts from the same full keyspace
+static int preload(const struct config_t *config) {
+    struct ictredis_cmd cmd;
+    char key[32], *value = malloc(config->value_max > 0 ? config->value_max : 1);
+    uint64_t state = 1;
+    unsigned long i;
+    int fd = config->store == NULL ? open(config->device, O_RDWR) : -1, ret;
+
+    if ((fd < 0 && config->store == NULL) || value == NULL) {
+        perror("Failed to open the device");
+        free(value);
+        return -1;
+    }
+    memset(value, 'v', config->value_max);
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.key = (unsigned long) key;
+    cmd.value = (unsigned long) value;
+    for (i = 0; i < config->keys; i++) {
+        fill_key(key, sizeof(key), i, &cmd);
+        cmd.value_len = next_value_len(config, &state);
+        ret = bench_op(config, fd, 1, &cmd);
+        if (ret == EEXIST) {
+            ret = bench_op(config, fd, 2, &cmd);
+        }
+        if (ret != 0) {
+            fprintf(stderr, "Failed to store the keys: %s\n", strerror(ret));
+            if (fd >= 0) {
+                close(fd);
+            }
+            free(value);
+            return -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(value);
+    return 0;
+}
+
+static void print_row(int threads, const char *name, const struct histogram_t *h, double elapsed) {
+    printf("%8d %-7s %12.0f %10llu %10llu %10llu %10llu\n", threads, name, h->count / elapsed,
+           (unsigned long long) percentile(h, 0.5), (unsigned long long) percentile(h, 0.99),
+           (unsigned long long) percentile(h, 0.999), (unsigned long long) h->misses);
+}
+
+static void print_json_latency(FILE *out, const struct histogram_t *h) {
+    fprintf(out, "\"count\":%llu,\"misses\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu",
+            (unsigned long long) h->count, (unsigned long long) h->misses,
+            (unsigned long long) percentile(h, 0.5), (unsigned long long) percentile(h, 0.99),
+            (unsigned long long) percentile(h, 0.999));
+}
+
+// one line of JSON per run, with the configuration, so runs of different builds can be compared
+static void print_json(FILE *out, const struct config_t *config, int threads, const struct histogram_t *total,
+                       const struct histogram_t *per_op, double elapsed) {
+    int op;
+
+    fprintf(out, "{\"target\":\"%s\",\"threads\":%d,\"ops_per_thread\":%ld,\"keys\":%lu,\"value_min\":%u,\"value_max\":%u,"
+                 "\"distribution\":\"%s\",\"theta\":%.3f,\"mix\":{",
+            config->store != NULL ? "inproc" : "device", threads, config->ops, config->keys, config->value_min, config->value_max,
+            config->zipf ? "zipf" : "uniform", config->zipf ? config->theta : 0.0);
+    for (op = 0; op < NR_BENCH_OPS; op++) {
+        fprintf(out, "%s\"%s\":%u", op ? "," : "", op_names[op], config->weights[op]);
+    }
+    fprintf(out, "},\"seconds\":%.6f,\"ops_per_sec\":%.0f,", elapsed, total->count / elapsed);
+    print_json_latency(out, total);
+    for (op = 0; op < NR_BENCH_OPS; op++) {
+        if (config->weights[op] != 0) {
+            fprintf(out, ",\"%s\":{\"ops_per_sec\":%.0f,", op_names[op], per_op[op].count / elapsed);
+            print_json_latency(out, &per_op[op]);
+            fputc('}', out);
+        }
+    }
+    fputs("}\n", out);
+    fflush(out);
+}
+
+// run threads workers, print their results, returns -1 on failure
+static int run(const struct config_t *config, int threads, FILE *json) {
+    struct worker_t *workers = calloc(threads, sizeof(struct worker_t));
+    struct histogram_t *per_op = calloc(NR_BENCH_OPS + 1, sizeof(struct histogram_t));
+    struct histogram_t *total = per_op + NR_BENCH_OPS;
+    pthread_barrier_t start;
+    double begin, elapsed;
+    int i, op, failed = 0;
+
+    if (workers == NULL || per_op == NULL) {
+        free(workers);
+        free(per_op);
+        return -1;
+    }
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].config = config;
+        workers[i].start = &start;
+        pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+    }
+    pthread_barrier_wait(&start);
+    begin = now();
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].failed) {
+            failed = workers[i].failed;
+        }
+        for (op = 0; op < NR_BENCH_OPS; op++) {
+            histogram_add(&per_op[op], &workers[i].histograms[op]);
+            histogram_add(total, &workers[i].histograms[op]);
+        }
+    }
+    elapsed = now() - begin;
+    pthread_barrier_destroy(&start);
+    free(workers);
+    if (failed) {
+        fprintf(stderr, "%d threads: %s\n", threads, strerror(failed));
+        free(per_op);
+        return -1;
+    }
+    print_row(threads, "all", total, elapsed);
+    for (op = 0; op < NR_BENCH_OPS; op++) {
+        if (config->weights[op] != 0) {
+            print_row(threads, op_names[op], &per_op[op], elapsed);
+        }
+    }
+    if (json != NULL) {
+        print_json(json, config, threads, total, per_op, elapsed);
+    }
+    free(per_op);
+    return 0;
+}
+
+// "get=90,edit=10", operations left out get no weight
+static int parse_mix(struct config_t *config, char *mix) {
+    char *part, *weight;
+    int op;
+
+    memset(config->weights, 0, sizeof(config->weights));
+    config->total_weight = 0;
+    while ((part = strsep(&mix, ",")) != NULL) {
+        weight = strchr(part, '=');
+        if (weight == NULL) {
+            return -1;
+        }
+        *weight++ = '\0';
+        for (op = 0; op < NR_BENCH_OPS && strcmp(part, op_names[op]) != 0; op++) {
+        }
+        if (op == NR_BENCH_OPS) {
+            return -1;
+        }
+        config->weights[op] = (unsigned int) atoi(weight);
+        config->total_weight += config->weights[op];
+    }
+    return config->total_weight > 0 ? 0 : -1;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-t threads[,threads...]] [-n ops_per_thread] [-m get=90,edit=10] [-k keys]\n"
+                    "       [-v value_size[-max_size]] [-d uniform|zipf] [-z theta] [-o file] [-D device | -I]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    struct config_t config = {
+            .device = DEVICE_PATH, .ops = 200000, .keys = 100000, .value_min = 64, .value_max = 64, .theta = 0.99,
+    };
+    char default_mix[] = "get=90,edit=10", *threads_list = NULL, *part;
+    int threads[MAX_RUNS], runs = 0, opt, i, inproc = 0;
+    FILE *json = NULL;
+
+    parse_mix(&config, default_mix);
+    while ((opt = getopt(argc, argv, "t:n:m:k:v:d:z:o:D:I")) != -1) {
+        switch (opt) {
+            case 't':
+                threads_list = optarg;
+                break;
+            case 'n':
+                config.ops = atol(optarg);
+                break;
+            case 'm':
+                if (parse_mix(&config, optarg) < 0) {
+                    fprintf(stderr, "bad mix: use get=N,push=N,edit=N,delete=N\n");
+                    return 1;
+                }
+                break;
+            case 'k':
+                config.keys = strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                if (sscanf(optarg, "%u-%u", &config.value_min, &config.value_max) != 2) {
+                    config.value_max = config.value_min;
+                }
+                break;
+            case 'd':
+                config.zipf = strcmp(optarg, "zipf") == 0;
+                if (!config.zipf && strcmp(optarg, "uniform") != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'z':
+                config.theta = atof(optarg);
+                break;
+            case 'o':
+                json = strcmp(optarg, "-") == 0 ? stdout : fopen(optarg, "a");
+                if (json == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                config.device = optarg;
+                break;
+            case 'I':
+                inproc = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    while (threads_list != NULL && (part = strsep(&threads_list, ",")) != NULL && runs < MAX_RUNS) {
+        threads[runs++] = atoi(part);
+    }
+    if (runs == 0) {
+        threads[runs++] = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    for (i = 0; i < runs; i++) {
+        if (threads[i] < 1) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.ops < 1 || config.keys < 2 || config.value_min > config.value_max ||
+        (config.zipf && (config.theta <= 0 || config.theta >= 1))) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (config.zipf) {
+        zipf_init(&config);
+    }
+    if (inproc) {
+        config.store = ictredis_open(INPROC_MAX_MEMORY);
+        if (config.store == NULL) {
+            perror("Failed to create the in-process store");
+            return 1;
+        }
+    }
+
+    printf("%8s %-7s %12s %10s %10s %10s %10s\n", "threads", "op", "ops/s", "p50_ns", "p99_ns", "p999_ns", "misses");
+    for (i = 0; i < runs; i++) {
+        if (preload(&config) < 0 || run(&config, threads[i], json) < 0) {
+            return 1;
+        }
+    }
+    if (json != NULL && json != stdout) {
+        fclose(json);
+    }
+    ictredis_close(config.store);
+    return 0;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file   client_test.cpp
+ * @brief  Tests of ictredis::Client, run by ctest: every synchronous call, and asynchronous calls
+ * of several threads at once through rings small enough that they take many submissions, with
+ * GET results that don't fit the space the ring gives them and values bigger than the whole
+ * data area.
+ *
+ * Usage: ictredis_client_test [-D device]
+ *
+ * The client needs the loaded module, without the device the test is skipped, not failed.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ictRedis_client.h"
+#include "ictRedis_test.h"
+
+#define RING_ENTRIES 16                     ///< Small rings, so the calls take many submissions
+#define RING_DATA_SIZE 2048                 ///< Less than max_value_len, a value may be bigger
+#define GET_SIZE 64                         ///< Room of an asynchronous GET, longer values are read again
+#define THREADS 4
+#define CALLS 2000                          ///< Keys each thread stores, reads and deletes asynchronously
+
+// The value of key n, up to GET_SIZE bytes long or, for long ones, longer and one in a hundred
+// longer than the whole data area
+static std::string value_of(int thread, int n, bool long_value) {
+    size_t len = (size_t) (n % (GET_SIZE / 2));
+
+    if (long_value) {
+        len = n % 100 == 0 ? RING_DATA_SIZE + 1 : GET_SIZE + (size_t) (n % 500);
+    }
+    return std::string(len, (char) ('a' + thread)) + std::to_string(n);
+}
+
+static void test_sync(ictredis::Client &c) {
+    std::string k = std::string(prefix) + "sync", n = std::string(prefix) + "n", value;
+    uint64_t version, new_version;
+    int64_t result;
+
+    CHECK(c.push(k, "1") == 0);
+    CHECK(c.push(k, "2") == -EEXIST);
+    CHECK(c.get(k, value) == 0 && value == "1");
+    CHECK(c.edit(k, "22") == 0);
+    CHECK(c.get(k, value) == 0 && value == "22");
+    CHECK(c.set(k, std::string(1000, 'x')) == 0);
+    CHECK(c.get(k, value) == 0 && value == std::string(1000, 'x'));
+    CHECK(c.del(k) == 0);
+    CHECK(c.del(k) == -ENOENT);
+    CHECK(c.get(k, value) == -ENOENT && value.empty());
+    CHECK(c.edit(k, "3") == -ENOENT);
+    CHECK(c.set(k, "4") == 0);              // stored whether the key exists or not
+    CHECK(c.get(k, value) == 0 && value == "4");
+    CHECK(c.del(k) == 0);
+
+    CHECK(c.incrby(n.data(), n.size(), 5, result) == 0 && result == 5);
+    CHECK(c.incrby(n.data(), n.size(), -7, result) == 0 && result == -2);
+    CHECK(c.gets(n.data(), n.size(), value, version) == 0 && value == "-2");
+    CHECK(c.cas(n.data(), n.size(), "9", 1, version, new_version) == 0 && new_version > version);
+    CHECK(c.cas(n.data(), n.size(), "8", 1, version, new_version) == -ESTALE);
+    CHECK(c.get(n, value) == 0 && value == "9");
+    CHECK(c.del(n) == 0);
+}
+
+// Each thread stores, reads, replaces and deletes keys of its own asynchronously. The calls of
+// a thread run in order, so every result is known before it comes. A value too long for its GET
+// in the ring is read again after the rest of the submission ran, so long values are only
+// written once before they are read, and only deleted once the reads are done.
+static void async_thread(ictredis::Client *c, int thread) {
+    std::vector<std::future<ictredis::Result>> futures, deletes;
+    std::string k, long_k;
+    ictredis::Result r;
+    size_t next = 0;
+    int i;
+
+    for (i = 0; i < CALLS; i++) {
+        k = std::string(prefix) + "async:" + std::to_string(thread) + ":" + std::to_string(i);
+        long_k = std::string(prefix) + "long:" + std::to_string(thread) + ":" + std::to_string(i);
+        futures.push_back(c->push_async(k, value_of(thread, i, false)));
+        futures.push_back(c->get_async(k));
+        futures.push_back(c->edit_async(k, "e"));
+        futures.push_back(c->set_async(k, value_of(thread, i + 1, false)));
+        futures.push_back(c->get_async(k));
+        futures.push_back(c->del_async(k));
+        futures.push_back(c->get_async(k));
+        futures.push_back(c->set_async(long_k, value_of(thread, i, true)));
+        futures.push_back(c->get_async(long_k));
+    }
+    for (i = 0; i < CALLS; i++) {
+        CHECK(futures[next++].get().status == 0);
+        r = futures[next++].get();
+        CHECK(r.status == 0 && r.value == value_of(thread, i, false));
+        CHECK(futures[next++].get().status == 0);
+        CHECK(futures[next++].get().status == 0);
+        r = futures[next++].get();
+        CHECK(r.status == 0 && r.value == value_of(thread, i + 1, false));
+        CHECK(futures[next++].get().status == 0);
+        CHECK(futures[next++].get().status == -ENOENT);
+        CHECK(futures[next++].get().status == 0);
+        r = futures[next++].get();
+        CHECK(r.status == 0 && r.value == value_of(thread, i, true));
+    }
+    for (i = 0; i < CALLS; i++) {
+        long_k = std::string(prefix) + "long:" + std::to_string(thread) + ":" + std::to_string(i);
+        deletes.push_back(c->del_async(long_k));
+    }
+    for (std::future<ictredis::Result> &f : deletes) {
+        CHECK(f.get().status == 0);
+    }
+}
+
+static void test_async(ictredis::Client &c) {
+    std::vector<std::thread> threads;
+    int i;
+
+    for (i = 0; i < THREADS; i++) {
+        threads.emplace_back(async_thread, &c, i);
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
+
+int main(int argc, char **argv) {
+    ictredis::ClientOptions options;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "D:")) != -1) {
+        if (opt != 'D') {
+            fprintf(stderr, "Usage: %s [-D device]\n", argv[0]);
+            return 2;
+        }
+        options.device = optarg;
+    }
+    fd = test_open_device(options.device);
+    if (fd < 0) {
+        return SKIPPED;
+    }
+    close(fd);
+    test_prefix("client_test");
+    options.connections = 2;
+    options.ringEntries = RING_ENTRIES;
+    options.ringDataSize = RING_DATA_SIZE;
+    options.getSize = GET_SIZE;
+
+    {
+        ictredis::Client c(options);
+        test_sync(c);
+        test_async(c);
+    }
+    printf("%s: %s\n", options.device, failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -13,64 +13,445 @@
 #include <linux/sched.h>
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/atomic.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/overflow.h>
+#include <linux/moduleparam.h>
+#include <linux/sysfs.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/cache.h>
+#include <linux/crc32c.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/topology.h>
+#include <linux/rbtree.h>
+#include <linux/bitmap.h>
+#include <linux/hashtable.h>
+#include <linux/lz4.h>
+
+#include "ictRedis.h"
+
+#define CREATE_TRACE_POINTS
+#include "ictRedis_trace.h"
+
+// The store engine, shared with libictredis. It is built as part of this file rather than as an
+// object of its own, so the module keeps its name and the engine functions stay static.
+#include "ictRedis_store.c"
 
 #define  DEVICE_NAME "ictredis"
 #define  CLASS_NAME  "ict"
-#define MAX_ELEMENT 50
+#define REQUEST_OVERHEAD 32      ///< Room for the mode and the separators around the key and value in a request
+#define BATCH_CHUNK (64 * 1024)  ///< A batch is copied in and run this many bytes at a time
+#define BATCH_OUTPUT_LIMIT (16 * 1024 * 1024) ///< Most batch results an open file may have waiting to be read
+#define BATCH_RESULT_HEADER 64   ///< Room for the "status|version|length|" in front of a batch result
+#define RING_MAX_ENTRIES 32768   ///< Largest submission or completion ring
+#define SWEEP_INTERVAL HZ        ///< How often the expiry sweep runs
+#define MINORS_PER_DATABASE 3    ///< Each database has its store, its snapshot and its log device
+#define MAX_DATABASES (256 / MINORS_PER_DATABASE) ///< register_chrdev() reserves 256 minors
+#define SNAPSHOT_MINOR 1         ///< Minor of /dev/ictredis-snapshot, counted from the first minor of its database
+#define SNAPSHOT_CHUNK (64 * 1024) ///< A snapshot is dumped this many bytes at a time
+#define SNAPSHOT_LOAD_BATCH 1024 ///< Elements a load stores per hold of a shard lock
+#define LOG_MINOR 2              ///< Minor of /dev/ictredis-log, counted from the first minor of its database
+#define LOG_READ_CHUNK (64 * 1024) ///< Most change records a read of the log returns at once
+#define SCAN_CHUNK (64 * 1024)   ///< Most bytes of scan entries a read returns at once
+#define TXN_MAX ICTREDIS_CHAIN_MAX ///< Most keys of an MGET or MSET, commands of a transaction or entries of a chain
+#define WATCH_BUFFER (16 * 1024) ///< Bytes of change events an open file holds until they are read
+#define WATCH_LOST_LINE 32       ///< Room always left in the events for the line counting those dropped
+#define WATCH_MAX 1024           ///< Most keys one open file watches
+#define WATCH_HASH_BITS 10       ///< The table of watched keys has (1 << WATCH_HASH_BITS) buckets
+#define WATCH_LOST 255           ///< op of the event line standing for events dropped while the buffer was full
+
+typedef struct database_t Database;
+
+/// Submission and completion rings mapped into a process, see struct ictredis_ring_params
+struct ring_t {
+    void *mem;                   ///< vmalloc_user() area shared with the process
+    size_t size;
+    struct ictredis_ring *hdr;
+    struct ictredis_sqe *sqes;
+    struct ictredis_cqe *cqes;
+    char *data;
+    u32 sqEntries;
+    u32 cqEntries;
+    u32 dataSize;
+    u32 sqHead;                  ///< The module's own copies of the indexes it advances, the
+    u32 cqTail;                  ///< process can't make it skip or repeat entries
+    bool chainFailed;            ///< The entries at sqHead are the rest of a chain too long to run
+};
+
+typedef struct ring_t Ring;
+
+/// The state of one open /dev/ictredis-snapshot, either dumping the store or loading a snapshot
+struct snapshot_t {
+    struct mutex lock;           ///< Serializes threads sharing the file
+    Database *db;                ///< The database dumped or loaded into
+    char *buf;                   ///< Dump: records waiting to be read. Load: bytes not parsed yet
+    size_t size;
+    size_t len;
+    size_t pos;
+    bool started;                ///< The header was written or checked
+    bool finished;               ///< The trailer was written or checked
+    bool failed;                 ///< The snapshot being loaded was bad, nothing more is taken
+    u32 crc;                     ///< crc32c of the stream so far
+    u64 count;                   ///< Records so far
+    unsigned int shard;          ///< Dump: the shard and bucket to dump next
+    unsigned long bucket;
+    struct {
+        struct hlist_head list;  ///< Load: elements waiting for the trailer, chained through node[0]
+        unsigned long count;
+    } *staged;                   ///< One per shard
+};
+
+typedef struct snapshot_t Snapshot;
+
+/// The change records of one CPU. head and tail are byte offsets that only grow, the record
+/// at offset off is at buf[off & (logSize - 1)]. The matching indexes count the records.
+struct log_ring_t {
+    spinlock_t lock;             ///< Taken by writers on this CPU and by readers copying out
+    char *buf;                   ///< logSize bytes
+    u64 head;                    ///< Where the next record goes
+    u64 tail;                    ///< The oldest record still in the ring
+    u64 headIndex;
+    u64 tailIndex;
+};
+
+typedef struct log_ring_t LogRing;
+
+/// The state of one open /dev/ictredis-log: how far it has read the ring of every CPU
+struct log_reader_t {
+    struct mutex lock;           ///< Serializes threads sharing the file
+    Database *db;                ///< The database whose changes are read
+    u64 *pos;                    ///< Per possible CPU, the offset of the next record to read
+    u64 *index;                  ///< and its index
+    unsigned int cpu;            ///< The CPU the next read starts with
+    char *buf;                   ///< Records on their way to the user
+    size_t size;
+};
+
+typedef struct log_reader_t LogReader;
+
+/// One independent keyspace behind its own devices, with its own shards and locks, memory
+/// budget, statistics and change log, so the load on one database does not slow the others
+struct database_t {
+    unsigned int index;          ///< Its devices start at minor index * MINORS_PER_DATABASE
+    char name[16];               ///< The name of its store device, "ictredis" or "ictredisN"
+    Store store;                 ///< Its keys, shard locks, memory budget and statistics
+    atomic_t opens;              ///< Files open on its store device
+    LogRing __percpu *logRings;  ///< The change log, one ring per CPU
+    atomic64_t logSeq;           ///< The seq of the last change logged
+    atomic_t logReaders;         ///< Changes are only logged while its log is open
+    wait_queue_head_t logWait;   ///< Readers waiting for changes
+    struct device *device;       ///< /dev/ictredis or /dev/ictredisN
+    struct device *snapshotDevice;
+    struct device *logDevice;
+    struct dentry *debugfsDir;   ///< Where its stats and latency files are
+};
 
-enum mode_write_e {
-    PUSH = 0, GET = 1, EDIT = 2, DELETE = 3
+/// The keys one open file watches and the changes to them it has not read yet
+struct watcher_t {
+    spinlock_t lock;             ///< Serializes the writers queueing events with the reader over the events
+    wait_queue_head_t wait;      ///< Readers and pollers waiting for an event
+    struct list_head watches;    ///< The Watch entries of the file, changed under watchMutex
+    unsigned int nrWatches;
+    char *events;                ///< WATCH_BUFFER bytes of "op|key_len|key\n" lines, allocated by the first WATCH
+    char *out;                   ///< WATCH_BUFFER more bytes, events on their way to the user
+    size_t len;                  ///< Bytes of events waiting
+    u64 lost;                    ///< Events dropped because the buffer was full, not reported yet
 };
 
-typedef enum mode_write_e ModeWrite;
+typedef struct watcher_t Watcher;
+
+/// One key watched by one open file
+struct watch_t {
+    struct hlist_node node;      ///< In watchTable, under the hash of the key
+    struct list_head link;       ///< In the watches of its Watcher
+    struct rcu_head rcu;         ///< Writers may still be looking at a removed watch
+    Watcher *watcher;
+    Database *db;                ///< The database the key is watched in
+    u32 hash;
+    u32 key_len;
+    char key[];
+};
 
-struct element_t {
-    char key[50];
-    char value[50];
+typedef struct watch_t Watch;
+
+/// The state of one open file: the last request written to it, picked up by the next read
+struct request_t {
+    struct mutex lock;           ///< Serializes threads sharing the file over the fields below
+    Database *db;                ///< The database of the device the file was opened on
+    ModeWrite modeWrite;
+    size_t requestKeyLen;
+    char *requestKey;            ///< max_key_len + 1 bytes
+    char *key;                   ///< max_key_len bytes, ioctl() copies the key of a command here
+    char *value;                 ///< max_value_len + 1 bytes, GET copies the value here on its way to the user
+    char *outBuffer;             ///< Results of batched commands, the next read() returns them from outPos
+    size_t outSize;
+    size_t outLen;
+    size_t outPos;
+    Ring *ring;                  ///< Submission and completion rings shared with the process, if set up
+    char *scanPrefix;            ///< max_key_len bytes, the prefix of the keys a SCAN returns
+    size_t scanPrefixLen;
+    char *scanCursor;            ///< max_key_len bytes, the last key the scan returned
+    size_t scanCursorLen;
+    bool scanHasCursor;          ///< Whether the scan continues after scanCursor or starts at the prefix
+    bool scanValues;             ///< Whether the scan returns values along with the keys
+    bool scanDone;
+    TxnCmd *txn;                 ///< TXN_MAX commands, allocated by the first MULTI or MSET
+    unsigned int txnLen;
+    bool inMulti;                ///< PUSH, EDIT and DELETE are queued until EXEC
+    bool txnFailed;              ///< A command could not be queued, EXEC cancels them all
+    Watcher watch;               ///< Read while modeWrite is WATCH
+    RangeCache range;            ///< The compressed value read a range at a time, its buffer allocated
+                                 ///< by the first range read that does not start at 0
 };
 
+typedef struct request_t Request;
+
+/// The next keys of one shard, gathered for one read of a scan
+struct scan_part_t {
+    char *buf;                   ///< [key_len][value_len][key][value] entries in key order
+    size_t len;
+    size_t pos;                  ///< The next entry to merge
+    bool truncated;              ///< The shard has more keys than fit, collected again once these are merged
+    bool deferred;               ///< The only entry is a key whose value did not fit, read when it is merged
+};
 
-typedef struct element_t Element;
+typedef struct scan_part_t ScanPart;
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("lusa");
 MODULE_DESCRIPTION("A simple redis implement using char device");
 MODULE_VERSION("0.1");
 
+static unsigned long max_memory = 64UL * 1024 * 1024;
+module_param(max_memory, ulong, 0444);
+MODULE_PARM_DESC(max_memory, "Bytes the stored elements of each database may take before the least recently used "
+                             "are evicted, 0 for no limit (default 64 MiB). Each database's max_memory sysfs "
+                             "attribute changes its own");
+
+static unsigned int nr_databases = 1;
+module_param(nr_databases, uint, 0444);
+MODULE_PARM_DESC(nr_databases, "Number of independent databases, /dev/ictredis0 to /dev/ictredisN-1, "
+                               "or just /dev/ictredis if 1 (default 1)");
+
+static unsigned long log_buffer_size = 256 * 1024;
+module_param(log_buffer_size, ulong, 0444);
+MODULE_PARM_DESC(log_buffer_size, "Bytes of the change log ring buffer of each CPU, rounded up to a power of two, "
+                                  "0 to disable /dev/ictredis-log (default 256 KiB)");
+
+static unsigned int ring_max_data = 4 * 1024 * 1024;
+module_param(ring_max_data, uint, 0444);
+MODULE_PARM_DESC(ring_max_data, "Largest data area of the rings of an open file, which stays allocated until "
+                                "it is closed (default 4 MiB)");
 
 static int majorNumber;                  ///< Stores the device number -- determined automatically
 
-static Element array[MAX_ELEMENT];
-static int max_index;
-static char requestKey[100];
+static Database *databases;              ///< nr_databases databases
+static DEFINE_HASHTABLE(watchTable, WATCH_HASH_BITS); ///< Every watched key, writers look them up under RCU
+static DEFINE_MUTEX(watchMutex);         ///< Serializes changes to watchTable
+
+/// Changes are only matched against the watched keys while there are some
+static DEFINE_STATIC_KEY_FALSE(watch_enabled);
 
-static int numberOpens = 0;              ///< Counts the number of times the device is opened
 static struct class *ictredisClass = NULL; ///< The device-driver class struct pointer
-static struct device *ictredisDevice = NULL; ///< The device-driver device struct pointer
-static ModeWrite modeWrite;
+static size_t logSize;                   ///< Bytes of each ring, a power of two
+
+/// Changes are only logged while a log is open
+static DEFINE_STATIC_KEY_FALSE(log_enabled);
+static struct dentry *debugfsDir;        ///< /sys/kernel/debug/ictredis
+
+static const char *const done_names[NR_OPS] = {"pushes", "get_hits", "edits", "deletes"};
+static const char *const failed_names[NR_OPS] = {"push_exists", "get_misses", "edit_misses", "delete_misses"};
+static const char *const op_names[NR_OPS] = {"push", "get", "edit", "delete"};
 
 // The prototype functions for the character driver -- must come before the struct definition
 static int dev_open(struct inode *, struct file *);
 
 static int dev_release(struct inode *, struct file *);
 
+static int snapshot_open(struct inode *, struct file *);
+
+static ssize_t snapshot_read(struct file *, char *, size_t, loff_t *);
+
+static ssize_t snapshot_write(struct file *, const char *, size_t, loff_t *);
+
+static int snapshot_release(struct inode *, struct file *);
+
+static void snapshot_commit(Snapshot *snap);
+
+static void snapshot_discard(Snapshot *snap);
+
+static int log_open(struct inode *, struct file *);
+
+static ssize_t log_read(struct file *, char *, size_t, loff_t *);
+
+static __poll_t log_poll(struct file *, poll_table *);
+
+static int log_release(struct inode *, struct file *);
+
+static void log_append(Database *db, ModeWrite op, const char *key, size_t key_len, const char *value, size_t value_len,
+                       u32 ttl_ms);
+
+static bool log_wanted(Database *db);
+
+static int log_rings_init(Database *db);
+
+static void log_rings_destroy(Database *db);
+
+static ssize_t scan_read(Request *request, char __user *buffer, size_t len);
+
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
 
-static Element create_element(char *string);
+static __poll_t dev_poll(struct file *, poll_table *);
+
+static long dev_ioctl(struct file *, unsigned int, unsigned long);
+
+static int dev_mmap(struct file *, struct vm_area_struct *);
+
+static ssize_t write_one(Request *request, char *string, size_t len);
+
+static bool batch_mode(const char *string);
+
+static ssize_t write_batch(Request *request, char *buf, size_t len, bool last);
+
+static int batch_mget(Request *request, char *line);
+
+static void batch_mset(Request *request, char *line);
+
+static void batch_exec(Request *request);
+
+static void batch_incr(Request *request, int modeWrite, char *line);
+
+static void batch_cas(Request *request, char *line);
+
+static int batch_gets(Request *request, char *line);
+
+static int batch_getrange(Request *request, char *line);
+
+static long ioctl_getrange(Request *request, struct ictredis_range __user *urange);
+
+static RangeCache *request_range_cache(Request *request);
+
+static long ioctl_incr(Request *request, struct ictredis_incr __user *uincr);
+
+static long ioctl_cas(Request *request, unsigned int cmd, struct ictredis_cas __user *ucas);
+
+static int txn_alloc(Request *request);
+
+static int txn_begin(Request *request);
+
+static int txn_queue(Request *request, int op, char *line);
+
+static void txn_clear(Request *request);
+
+static int watch_add(Request *request, char *line);
+
+static bool watch_clear(Request *request);
+
+static void watch_notify(Database *db, ModeWrite op, const char *key, size_t key_len);
+
+static bool watch_pending(Watcher *w);
+
+static ssize_t watch_read(Request *request, char __user *buffer, size_t len);
+
+static long ring_setup(Request *request, struct ictredis_ring_params __user *uparams);
+
+static long ring_enter(Request *request);
+
+static void ring_free(Ring *ring);
+
+static Element *create_element(Store *store, char *string);
+
+static Element *element_from_user(Store *store, const char __user *key, size_t key_len, const char __user *value,
+                                  size_t value_len);
 
 static int my_atoi(char *string);
 
 static int isNumericChar(char x);
 
-static int findKey(char *key);
+static void sweep_expired(struct work_struct *work);
+
+static void stats_init(void);
 
-/// A macro that is used to declare a new mutex that is visible in this file
-/// results in a semaphore variable ICTRedis_mutex with value 1 (unlocked)
-/// DEFINE_MUTEX_LOCKED() results in a variable with value 0 (locked)
-static DEFINE_MUTEX(ICTRedis_mutex);
+static void stats_destroy(void);
 
+/// Removes expired elements nobody looks up, a few buckets at a time
+static DECLARE_DELAYED_WORK(sweep_work, sweep_expired);
+
+
+/** @brief Memory accounting of each database exported in /sys/class/ict/<device>/, read without
+ *  the locks so the numbers may be a moment old
+ */
+static ssize_t elements_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    Database *db = dev_get_drvdata(dev);
+    unsigned int elements;
+    unsigned long memory;
+    shards_totals(&db->store, &elements, &memory);
+    return sysfs_emit(buf, "%u\n", elements);
+}
+
+static ssize_t memory_bytes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    Database *db = dev_get_drvdata(dev);
+    unsigned int elements;
+    unsigned long memory;
+    shards_totals(&db->store, &elements, &memory);
+    return sysfs_emit(buf, "%lu\n", memory);
+}
+
+static ssize_t bytes_per_key_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    Database *db = dev_get_drvdata(dev);
+    unsigned int elements;
+    unsigned long memory;
+    shards_totals(&db->store, &elements, &memory);
+    return sysfs_emit(buf, "%lu\n", elements ? memory / elements : 0);
+}
+
+// the memory budget of the database, changing it takes effect with the next write to each shard
+static ssize_t max_memory_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    Database *db = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(db->store.maxMemory));
+}
+
+static ssize_t max_memory_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    Database *db = dev_get_drvdata(dev);
+    unsigned long limit;
+    int ret = kstrtoul(buf, 0, &limit);
+    if (ret < 0) {
+        return ret;
+    }
+    WRITE_ONCE(db->store.maxMemory, limit);
+    return count;
+}
+
+static DEVICE_ATTR_RO(elements);
+static DEVICE_ATTR_RO(memory_bytes);
+static DEVICE_ATTR_RO(bytes_per_key);
+static DEVICE_ATTR_RW(max_memory);
+
+static struct attribute *ictredis_attrs[] = {
+        &dev_attr_elements.attr,
+        &dev_attr_memory_bytes.attr,
+        &dev_attr_bytes_per_key.attr,
+        &dev_attr_max_memory.attr,
+        NULL,
+};
+ATTRIBUTE_GROUPS(ictredis);
 
 /** @brief Devices are represented as file structure in the kernel. The file_operations structure from
  *  /linux/fs.h lists the callback functions that you wish to associated with your file operations
@@ -81,9 +462,99 @@ static struct file_operations fops =
                 .open = dev_open,
                 .read = dev_read,
                 .write = dev_write,
+                .poll = dev_poll,
+                .unlocked_ioctl = dev_ioctl,
+                .compat_ioctl = compat_ptr_ioctl,
+                .mmap = dev_mmap,
                 .release = dev_release,
         };
 
+/// Installed by dev_open() for the snapshot minor
+static const struct file_operations snapshot_fops =
+        {
+                .owner = THIS_MODULE,
+                .read = snapshot_read,
+                .write = snapshot_write,
+                .release = snapshot_release,
+                .llseek = no_llseek,
+        };
+
+/// Installed by dev_open() for the log minor
+static const struct file_operations log_fops =
+        {
+                .owner = THIS_MODULE,
+                .read = log_read,
+                .poll = log_poll,
+                .release = log_release,
+                .llseek = no_llseek,
+        };
+
+
+// Set up the store, log rings and statistics of database index, named after its device
+static int database_init(Database *db, unsigned int index) {
+    int ret;
+
+    db->index = index;
+    if (nr_databases == 1) {
+        strscpy(db->name, DEVICE_NAME, sizeof(db->name));
+    } else {
+        snprintf(db->name, sizeof(db->name), DEVICE_NAME "%u", index);
+    }
+    atomic_set(&db->opens, 0);
+    ret = store_init(&db->store, max_memory);
+    if (ret == 0) {
+        ret = log_rings_init(db);
+    }
+    return ret;
+}
+
+// Free what database_init() set up, which may have stopped half way
+static void database_destroy(Database *db) {
+    store_destroy(&db->store);              // free every stored element
+    log_rings_destroy(db);
+}
+
+// Create /dev/<name>, /dev/<name>-snapshot and /dev/<name>-log on the minors of the database
+static int database_devices_create(Database *db) {
+    unsigned int minor = db->index * MINORS_PER_DATABASE;
+
+    db->device = device_create_with_groups(ictredisClass, NULL, MKDEV(majorNumber, minor), db,
+                                           ictredis_groups, "%s", db->name);
+    if (IS_ERR(db->device)) {
+        return PTR_ERR(db->device);
+    }
+    db->snapshotDevice = device_create(ictredisClass, NULL, MKDEV(majorNumber, minor + SNAPSHOT_MINOR), db,
+                                       "%s-snapshot", db->name);
+    if (IS_ERR(db->snapshotDevice)) {
+        device_destroy(ictredisClass, MKDEV(majorNumber, minor));
+        return PTR_ERR(db->snapshotDevice);
+    }
+    db->logDevice = device_create(ictredisClass, NULL, MKDEV(majorNumber, minor + LOG_MINOR), db,
+                                  "%s-log", db->name);
+    if (IS_ERR(db->logDevice)) {
+        device_destroy(ictredisClass, MKDEV(majorNumber, minor + SNAPSHOT_MINOR));
+        device_destroy(ictredisClass, MKDEV(majorNumber, minor));
+        return PTR_ERR(db->logDevice);
+    }
+    return 0;
+}
+
+static void database_devices_destroy(Database *db) {
+    unsigned int minor = db->index * MINORS_PER_DATABASE;
+
+    device_destroy(ictredisClass, MKDEV(majorNumber, minor + LOG_MINOR));
+    device_destroy(ictredisClass, MKDEV(majorNumber, minor + SNAPSHOT_MINOR));
+    device_destroy(ictredisClass, MKDEV(majorNumber, minor));
+}
+
+// Free the first count databases and the array
+static void databases_destroy(unsigned int count) {
+    while (count-- > 0) {
+        database_destroy(&databases[count]);
+    }
+    kfree(databases);
+    databases = NULL;
+}
 
 /** @brief The LKM initialization function
  *  The static keyword restricts the visibility of the function to within this C file. The __init
@@ -94,12 +565,39 @@ static struct file_operations fops =
 static int __init
 
 ICTRedis_init(void) {
-    mutex_init(&ICTRedis_mutex);       /// Initialize the mutex lock dynamically at runtime
+    unsigned int i;
+    int ret;
+
     printk(KERN_INFO "ICTRedis: Initializing the ICTRedis LKM\n");
 
+    if (nr_databases == 0 || nr_databases > MAX_DATABASES) {
+        printk(KERN_ALERT "ICTRedis: nr_databases must be between 1 and %d\n", MAX_DATABASES);
+        return -EINVAL;
+    }
+    logSize = log_buffer_size ? roundup_pow_of_two(max_t(unsigned long, log_buffer_size, PAGE_SIZE)) : 0;
+    if (engine_init() < 0) {
+        return -ENOMEM;
+    }
+    databases = (Database *) kcalloc(nr_databases, sizeof(Database), GFP_KERNEL);
+    if (databases == NULL) {
+        engine_destroy();
+        printk(KERN_ALERT "ICTRedis failed to allocate the databases\n");
+        return -ENOMEM;
+    }
+    for (i = 0; i < nr_databases; i++) {
+        if (database_init(&databases[i], i) < 0) {
+            databases_destroy(i + 1);
+            engine_destroy();
+            printk(KERN_ALERT "ICTRedis failed to allocate database %u\n", i);
+            return -ENOMEM;
+        }
+    }
+
     // Try to dynamically allocate a major number for the device -- more difficult but worth it
     majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
     if (majorNumber < 0) {
+        databases_destroy(nr_databases);
+        engine_destroy();
         printk(KERN_ALERT "ICTRedis failed to register a major number\n");
         return majorNumber;
     }
@@ -109,20 +607,30 @@ ICTRedis_init(void) {
     ictredisClass = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(ictredisClass)) {                // Check for error and clean up if there is
         unregister_chrdev(majorNumber, DEVICE_NAME);
+        databases_destroy(nr_databases);
+        engine_destroy();
         printk(KERN_ALERT "Failed to register device class\n");
         return PTR_ERR(ictredisClass);          // Correct way to return an error on a pointer
     }
     printk(KERN_INFO "ICTRedis: device class registered correctly\n");
 
-    // Register the device driver
-    ictredisDevice = device_create(ictredisClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-    if (IS_ERR(ictredisDevice)) {               // Clean up if there is an error
-        class_destroy(ictredisClass);           // Repeated code but the alternative is goto statements
-        unregister_chrdev(majorNumber, DEVICE_NAME);
-        printk(KERN_ALERT "Failed to create the device\n");
-        return PTR_ERR(ictredisDevice);
+    // Register the devices of every database
+    for (i = 0; i < nr_databases; i++) {
+        ret = database_devices_create(&databases[i]);
+        if (ret < 0) {
+            while (i-- > 0) {
+                database_devices_destroy(&databases[i]);
+            }
+            class_destroy(ictredisClass);
+            unregister_chrdev(majorNumber, DEVICE_NAME);
+            databases_destroy(nr_databases);
+            engine_destroy();
+            printk(KERN_ALERT "Failed to create the devices\n");
+            return ret;
+        }
     }
-    max_index = -1;
+    stats_init();                               // debugfs is optional, failing to create it is not an error
+    schedule_delayed_work(&sweep_work, SWEEP_INTERVAL);
     printk(KERN_INFO "ICTRedis: device class created correctly\n"); // Made it! device was initialized
     return 0;
 }
@@ -134,28 +642,76 @@ ICTRedis_init(void) {
 static void __exit
 
 ICTRedis_exit(void) {
-    mutex_destroy(&ICTRedis_mutex);        /// destroy the dynamically-allocated mutex
-    device_destroy(ictredisClass, MKDEV(majorNumber, 0));     // remove the device
+    unsigned int i;
+
+    stats_destroy();                       /// remove the debugfs files first, they read the table
+    cancel_delayed_work_sync(&sweep_work); /// stop the expiry sweep, it does not rearm once cancelled
+    for (i = 0; i < nr_databases; i++) {
+        database_devices_destroy(&databases[i]);              // remove the devices
+    }
     class_unregister(ictredisClass);                          // unregister the device class
     class_destroy(ictredisClass);                             // remove the device class
     unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
+    databases_destroy(nr_databases);                         // free every stored element
+    engine_destroy();                                        // and the caches they came from
     printk(KERN_INFO "ICTRedis: Goodbye from the LKM!\n");
 }
 
 /** @brief The device open function that is called each time the device is opened
- *  This will only increment the numberOpens counter in this case.
+ *  It allocates the per-file request state and increments the opens counter of the database.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_open(struct inode *inodep, struct file *filep) {
-    if (!mutex_trylock(&ICTRedis_mutex)) {    /// Try to acquire the mutex (i.e., put the lock on/down)
-        /// returns 1 if successful and 0 if there is contention
-        printk(KERN_ALERT "ICTRedis: Device in use by another process");
-        return -EBUSY;
+    Database *db;
+    Request *request;
+
+    if (iminor(inodep) / MINORS_PER_DATABASE >= nr_databases) {
+        return -ENODEV;                 // a node made by hand for a database that was not created
+    }
+    db = &databases[iminor(inodep) / MINORS_PER_DATABASE];
+    if (iminor(inodep) % MINORS_PER_DATABASE == SNAPSHOT_MINOR) {
+        replace_fops(filep, &snapshot_fops);
+        return snapshot_open(inodep, filep);
+    }
+    if (iminor(inodep) % MINORS_PER_DATABASE == LOG_MINOR) {
+        replace_fops(filep, &log_fops);
+        return log_open(inodep, filep);
+    }
+    request = (Request *) kvmalloc(sizeof(Request) + max_key_len + 1 + max_key_len + max_value_len + 1 +
+                                   2 * max_key_len, GFP_KERNEL);
+    if (request == NULL) {
+        printk(KERN_ALERT "ICTRedis: failed to allocate memory for the request state\n");
+        return -ENOMEM;
     }
-    numberOpens++;
-    printk(KERN_INFO "ICTRedis: Device has been opened %d time(s)\n", numberOpens);
-//+-
+    request->modeWrite = -1;                  /// no request key until the first GET is written
+    request->requestKeyLen = 0;
+    request->outBuffer = NULL;
+    request->outSize = request->outLen = request->outPos = 0;
+    request->ring = NULL;
+    mutex_init(&request->lock);
+    request->db = db;
+    request->requestKey = (char *) (request + 1);
+    request->key = request->requestKey + max_key_len + 1;
+    request->value = request->key + max_key_len;
+    request->scanPrefix = request->value + max_value_len + 1;
+    request->scanCursor = request->scanPrefix + max_key_len;
+    request->scanDone = true;                 /// no scan until one is written
+    request->txn = NULL;
+    request->txnLen = 0;
+    request->inMulti = request->txnFailed = false;
+    spin_lock_init(&request->watch.lock);
+    init_waitqueue_head(&request->watch.wait);
+    INIT_LIST_HEAD(&request->watch.watches);
+    request->watch.nrWatches = 0;
+    request->watch.events = request->watch.out = NULL;
+    request->watch.len = 0;
+    request->watch.lost = 0;
+    request->range.buf = NULL;
+    request->range.shard = NULL;
+    filep->private_data = request;
+
+    atomic_inc(&db->opens);
     return 0;
 }
 
@@ -168,264 +724,2397 @@ static int dev_open(struct inode *inodep, struct file *filep) {
  *  @param offset The offset if required
  */
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
+    Request *request = filep->private_data;
     int error_count = 0;
-    int found;
-
-    if (max_index < 0 || modeWrite != GET) {
-        printk(KERN_ALERT "ICTRedis: max_index = %d \n", max_index);
+    ssize_t value_len;
+
+    mutex_lock(&request->lock);
+    if (request->outLen > request->outPos) {
+        // results of batched commands are returned first, as much as fits
+        size_t count = min(len, request->outLen - request->outPos);
+        if (copy_to_user(buffer, request->outBuffer + request->outPos, count)) {
+            mutex_unlock(&request->lock);
+            return -EFAULT;
+        }
+        request->outPos += count;
+        mutex_unlock(&request->lock);
+        return count;
+    }
+    if (request->modeWrite == SCAN) {
+        value_len = scan_read(request, buffer, len);
+        mutex_unlock(&request->lock);
+        return value_len;
+    }
+    if (request->modeWrite == WATCH) {
+        // the changes to the watched keys, waiting for one unless the file is non-blocking
+        while (!watch_pending(&request->watch)) {
+            mutex_unlock(&request->lock);
+            if (filep->f_flags & O_NONBLOCK) {
+                return -EAGAIN;
+            }
+            if (wait_event_interruptible(request->watch.wait, watch_pending(&request->watch))) {
+                return -ERESTARTSYS;
+            }
+            mutex_lock(&request->lock);
+        }
+        value_len = watch_read(request, buffer, len);
+        mutex_unlock(&request->lock);
+        return value_len;
+    }
+    if (request->modeWrite != GET) {
+        mutex_unlock(&request->lock);
         // copy_to_user has the format ( * to, *from, size) and returns 0 on success
         int number = 0;
         error_count = copy_to_user((int *) buffer, &number, sizeof(int));
-        if (modeWrite == GET) {
-            printk(KERN_ALERT "ICTRedis: request key : %s not found \n", requestKey);
-        } else {
-            printk(KERN_ALERT "ICTRedis: need request key first\n");
-        }
-
         return 0;
     }
 
-
-    found = findKey(requestKey);
-
-    if (found != -1) {
-        printk(KERN_ALERT "ICTRedis: in read function: found key \n");
-        error_count = copy_to_user(buffer, array[found].value, strlen(array[found].value) + 1);
+    // the value is read like a file from *offset on, only the bytes asked for are copied
+    len = min_t(size_t, len, max_value_len + 1);
+    if (len == 0) {
+        mutex_unlock(&request->lock);
+        return 0;
+    }
+    value_len = store_getrange(&request->db->store, request->requestKey, request->requestKeyLen, *offset,
+                               *offset > S64_MAX - (s64) len ? S64_MAX : *offset + len - 1, request->value, NULL,
+                               *offset != 0 ? request_range_cache(request) : NULL);
+    if (value_len > 0) {
+        error_count = copy_to_user(buffer, request->value, value_len);
+        mutex_unlock(&request->lock);
 
         if (error_count == 0) {            // if true then have success
-            printk(KERN_INFO "ICTRedis: request key : %s found with value %s \n", array[found].key,
-                   array[found].value);
-            return 1;  // clear the position to the start and return 0
+            *offset += value_len;
+            return value_len;
         } else {
-            printk(KERN_ALERT "ICTRedis: Failed to send %d characters to the user\n", error_count);
             return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
         }
     }
+    mutex_unlock(&request->lock);
 
-
-    printk(KERN_ALERT "ICTRedis: request key : %s not found \n", requestKey);
-    return 0;
+    return 0;                            // past the end of the value, or the key does not exist
 }
 
 
 /** @brief This function is called whenever the device is being written to from user space i.e.
- *  data is sent to the device from the user. The data is copied to the message[] array in this
- *  LKM using the sprintf() function along with the length of the string.
+ *  data is sent to the device from the user. The request is copied from user space and either
+ *  run as a single command, or, if it contains newlines, as a batch of commands, one per line.
+ *  A long batch is consumed a chunk at a time, the return value says how much of it was run.
  *  @param filep A pointer to a file object
  *  @param buffer The buffer to that contains the string to write to the device
  *  @param len The length of the array of data that is being passed in the const char buffer
  *  @param offset The offset if required
  */
 static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
-    // sprintf(message, "%s(%zu letters)", buffer, len);   // appending received string with its length
-    // size_of_message = strlen(message);                 // store the length of the stored message
+    Request *request = filep->private_data;
+    size_t single_max = (size_t) max_key_len + max_value_len + REQUEST_OVERHEAD;
+    size_t copy_len = min(len, max_t(size_t, single_max, BATCH_CHUNK));
+    ssize_t ret;
 
-    char *string = (char *) kmalloc(len, GFP_KERNEL);
+    char *string = (char *) kvmalloc(copy_len + 1, GFP_KERNEL);
     if (string == NULL) {
-        printk(KERN_ALERT "ICTRedis: failed to allocate memory for string\n");
-        return -1;
+        return -ENOMEM;
+    }
+    if (copy_from_user(string, buffer, copy_len)) {
+        kvfree(string);
+        return -EFAULT;
+    }
+    string[copy_len] = '\0';
+
+    if (memchr(string, '\n', copy_len) != NULL) {
+        ret = write_batch(request, string, copy_len, copy_len == len);
+    } else if (copy_len == len && (batch_mode(string) || READ_ONCE(request->inMulti))) {
+        // multi-key and transaction commands always answer through read(), like a batch
+        ret = write_batch(request, string, copy_len, true);
+    } else if (copy_len < len || len > single_max) {
+        ret = -E2BIG;
+    } else {
+        ret = write_one(request, string, len);
+    }
+    if (ret > 0) {
+        *offset = 0;                    // the value of a new GET is read from its start
     }
-    char *orgString = string;
+    kvfree(string);
+    return ret;
+}
+
+/** @brief Readable while a read() would not block, that is unless the file watches keys and
+ *  none of them changed since the last read. Always writable.
+ *  @param filep A pointer to a file object
+ *  @param wait The poll table the watch wait queue is added to
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait) {
+    Request *request = filep->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filep, &request->watch.wait, wait);
+    if (READ_ONCE(request->modeWrite) != WATCH || READ_ONCE(request->outLen) > READ_ONCE(request->outPos) ||
+        watch_pending(&request->watch)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+// whether string starts with the mode of a command that only runs as part of a batch
+static bool batch_mode(const char *string) {
+    char mode[4];
+    size_t len = strcspn(string, "|");
+    int modeWrite;
+
+    if (len >= sizeof(mode)) {
+        return false;
+    }
+    memcpy(mode, string, len);
+    mode[len] = '\0';
+    return kstrtoint(mode, 10, &modeWrite) == 0 && modeWrite >= MGET && modeWrite <= GETRANGE;
+}
+
+// run a single "mode|key|value" request, string is modified
+static ssize_t write_one(Request *request, char *string, size_t len) {
+    ModeWrite modeWrite;
     char *mode;
-    strcpy(string, buffer);
+    int ret;
 
     mode = strsep(&string, "|");
 
     modeWrite = (ModeWrite) my_atoi(mode);
+    mutex_lock(&request->lock);
+    if (request->modeWrite != WATCH || modeWrite == GET || modeWrite == SCAN) {
+        request->modeWrite = modeWrite; // a watching file keeps reading changes until a GET or SCAN
+    }
+    mutex_unlock(&request->lock);
 
     switch (modeWrite) {
-        case PUSH: {
-            printk(KERN_INFO "ICTRedis: in write function with Mode PUSH \n");
-            Element e = create_element(string);
-
-            // check exist key
-            int found = findKey(e.key);
-
-            printk(KERN_INFO "ICTRedis: in write function with Mode PUSH found : %d \n", found);
-
-            if (found != -1) {
-                // if exist
-                printk(KERN_ALERT "ICTRedis: Received exist key: %s \n", e.key);
-                kfree(orgString);
-                return 0;
+        case PUSH:
+        case EDIT: {
+            Element *e = create_element(&request->db->store, string);
+            if (IS_ERR(e)) {
+                return PTR_ERR(e);
             }
 
-            if (max_index + 1 > MAX_ELEMENT) {
-                // if full
-                max_index = -1;
+            ret = modeWrite == PUSH ? store_push(&request->db->store, e) : store_edit(&request->db->store, e);
+            if (ret < 0) {
+                // the key already exists for PUSH, or does not exist for EDIT
+                element_free(e);
+                return 0;
             }
-
-            array[max_index + 1] = e;
-            max_index++;
-            printk(KERN_INFO "ICTRedis: Add key: %s |value: %s from the user\n", e.key, e.value);
-            kfree(orgString);
             return len;
         };
         case GET: {
-            printk(KERN_INFO "ICTRedis: in write function with Mode GET \n");
-            strcpy(requestKey, string);
-            printk(KERN_INFO "ICTRedis: Received request key: %s from the user\n", requestKey);
-            kfree(orgString);
+            if (string == NULL || strlen(string) > max_key_len) {
+                mutex_lock(&request->lock);
+                request->modeWrite = -1;
+                mutex_unlock(&request->lock);
+                return string == NULL ? -EINVAL : -E2BIG;
+            }
+            mutex_lock(&request->lock);
+            request->requestKeyLen = strlen(string);
+            memcpy(request->requestKey, string, request->requestKeyLen + 1);
+            mutex_unlock(&request->lock);
             return len;
         }
-
-        case EDIT: {
-            printk(KERN_INFO "ICTRedis: in write function with Mode EDIT \n");
-            Element e = create_element(string);
-
-            // check exist key
-            int found = findKey(e.key);
-            if (found == -1) {
-                // key not exist
-                printk(KERN_ALERT "ICTRedis: key: %s not exist to edit\n", e.key);
-                kfree(orgString);
-                return 0;
+        case SCAN: {
+            // "prefix|values|cursor", the scan starts with the next read()
+            char *prefix = strsep(&string, "|");
+            char *values = strsep(&string, "|");
+            char *cursor = string;
+            size_t prefix_len = prefix ? strlen(prefix) : 0, cursor_len = cursor ? strlen(cursor) : 0;
+
+            ret = 0;
+            if (prefix_len > max_key_len || cursor_len > max_key_len) {
+                ret = -E2BIG;
+            } else if (values != NULL && *values != '\0' && strcmp(values, "0") != 0 && strcmp(values, "1") != 0) {
+                ret = -EINVAL;
             }
-
-            array[found] = e;
-
-            printk(KERN_INFO "ICTRedis: Edit key: %s |value: %s from the user\n", e.key, e.value);
-            kfree(orgString);
+            mutex_lock(&request->lock);
+            if (ret < 0) {
+                request->modeWrite = -1;
+                mutex_unlock(&request->lock);
+                return ret;
+            }
+            if (prefix_len != 0) {
+                memcpy(request->scanPrefix, prefix, prefix_len);
+            }
+            request->scanPrefixLen = prefix_len;
+            if (cursor_len != 0) {
+                memcpy(request->scanCursor, cursor, cursor_len);
+            }
+            request->scanCursorLen = cursor_len;
+            request->scanHasCursor = cursor != NULL;
+            request->scanValues = values != NULL && strcmp(values, "1") == 0;
+            request->scanDone = false;
+            mutex_unlock(&request->lock);
             return len;
         }
         case DELETE: {
-            printk(KERN_INFO "ICTRedis: in write function with Mode DELETE \n");
-            int found = findKey(string);
-            int index;
-            if (found == -1) {
+            if (string == NULL) {
+                return -EINVAL;
+            }
+            if (store_delete(&request->db->store, string, strlen(string)) < 0) {
                 // key not exist
-                printk(KERN_ALERT "ICTRedis: key: %s not exist to delete\n", string);
-                kfree(orgString);
                 return 0;
             }
 
-            for (index = found; index < max_index; index++) {
-                array[index] = array[index + 1];
-            }
-
-            max_index--;
-
-            printk(KERN_INFO "ICTRedis: Delete key: %s from the user\n", string);
-            kfree(orgString);
             return len;
 
         }
 
         default:
-            printk(KERN_ALERT "ICTRedis: Write error can't get modeWrite\n");
             return 0;  // clear the position to the start and return 0
     }
 
 
 }
 
-/** @brief The device release function that is called whenever the device is closed/released by
- *  the userspace program
- *  @param inodep A pointer to an inode object (defined in linux/fs.h)
- *  @param filep A pointer to a file object (defined in linux/fs.h)
- */
-static int dev_release(struct inode *inodep, struct file *filep) {
-    mutex_unlock(&ICTRedis_mutex);          /// Releases the mutex (i.e., the lock goes up)
-    printk(KERN_INFO "ICTRedis: Device successfully closed\n");
+// Make room for need more bytes of batch output, -ENOBUFS if the pending output would
+// grow past BATCH_OUTPUT_LIMIT: the client has to read the results first. The limit is
+// never below one result of the longest value.
+static int out_reserve(Request *request, size_t need) {
+    size_t pending = request->outLen - request->outPos;
+    size_t limit = max_t(size_t, BATCH_OUTPUT_LIMIT, BATCH_RESULT_HEADER + 1 + (size_t) max_value_len);
+    size_t size;
+    char *out;
+
+    if (request->outPos > 0) {
+        // results already read leave room at the front
+        memmove(request->outBuffer, request->outBuffer + request->outPos, pending);
+        request->outLen = pending;
+        request->outPos = 0;
+    }
+    if (request->outLen + need <= request->outSize) {
+        return 0;
+    }
+    if (request->outLen + need > limit) {
+        return -ENOBUFS;
+    }
+    size = max_t(size_t, request->outLen + need, 2 * request->outSize);
+    size = min_t(size_t, size, limit);
+    out = (char *) kvmalloc(size, GFP_KERNEL);
+    if (out == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(out, request->outBuffer, request->outLen);
+    kvfree(request->outBuffer);
+    request->outBuffer = out;
+    request->outSize = size;
     return 0;
 }
 
+// append "status\n" to the batch output, whose room was reserved by the caller
+static void batch_result(Request *request, long status) {
+    request->outLen += scnprintf(request->outBuffer + request->outLen, BATCH_RESULT_HEADER,
+                                 "%ld", min_t(long, status, 0));
+    request->outBuffer[request->outLen++] = '\n';
+}
 
-// take string "key|value" to create element
-static Element create_element(char *string) {
-    Element ret;
-    char *key, *value;
-    if (string == NULL) {
-        printk(KERN_ALERT "ICTRedis: string is NULL in create_element\n");
-        return ret;
-    }
+// Append the result of a GET: "0|len|value\n" for the value_len bytes in request->value, else
+// "status\n". It makes room for the length found, -ENOBUFS or -ENOMEM if there is none.
+static int batch_value(Request *request, ssize_t value_len) {
+    int ret = out_reserve(request, BATCH_RESULT_HEADER + 1 + max_t(ssize_t, value_len, 0));
 
-    size_t len = strlen(string);
-    printk(KERN_INFO "ICTRedis: string = %s\n", string);
-    char *buff = (char *) kmalloc(len, GFP_KERNEL);
-    if (buff == NULL) {
-        printk(KERN_ALERT "ICTRedis: Cannot allocate memory for buff in create_element\n");
+    if (ret < 0) {
         return ret;
     }
-    char *orgBuff = buff;
-    strcpy(buff, string);
-
-    key = strsep(&buff, "|");
-
-    value = strsep(&buff, "|");
-
-    strcpy(ret.key, key);
-    strcpy(ret.value, value);
-
-    kfree(orgBuff);
-    return ret;
-}
-
-static int my_atoi(char *string) {
-    int res = 0;  // Initialize result
-    int sign = 1;  // Initialize sign as positive
-    int i = 0;  // Initialize index of first digit
-    if (string == NULL)
+    if (value_len < 0) {
+        batch_result(request, value_len);
         return 0;
+    }
+    request->outLen += scnprintf(request->outBuffer + request->outLen, BATCH_RESULT_HEADER,
+                                 "0|%zd|", value_len);
+    memcpy(request->outBuffer + request->outLen, request->value, value_len);
+    request->outLen += value_len;
+    request->outBuffer[request->outLen++] = '\n';
+    return 0;
+}
 
+// the number of '|' separated fields in line
+static size_t batch_fields(const char *line) {
+    size_t n = 1;
 
-
-    // If number is negative, then update sign
-    if (string[0] == '-') {
-        sign = -1;
-        i++;  // Also update index of first digit
+    if (line == NULL) {
+        return 0;
     }
-
-    // Iterate through all digits of input string and update result
-    for (; string[i] != '\0'; ++i) {
-        if (isNumericChar(string[i]) == false)
-            return 0; // You may add some lines to write error message
-        // to error stream
-        res = res * 10 + string[i] - '0';
+    while ((line = strchr(line, '|')) != NULL) {
+        line++;
+        n++;
     }
-
-    // Return result with sign
-    return sign * res;
+    return n;
 }
 
-static int isNumericChar(char x) {
-    return (x >= '0' && x <= '9') ? 1 : 0;
+// What a read that found no room for its results returns: they are taken back from start on.
+// Results that don't fit even with nothing else waiting never will, they answer -E2BIG instead.
+static int batch_read(Request *request, size_t start, int ret) {
+    if (ret < 0) {
+        request->outLen = start;
+    }
+    if (ret == -ENOBUFS && start == 0) {
+        batch_result(request, -E2BIG);
+        return 0;
+    }
+    return ret;
 }
 
-
-static int findKey(char *key) {
-    int i, found = 0;
-    if (key == NULL) {
-        return -1;
+// Run one line of a batch and append its results, called with request->lock held.
+// Returns -ENOBUFS if its results may not fit, with nothing of them appended: a command that
+// changes the store is not run then, the reads make room for the values they find and are
+// run again once the client has read the results before them.
+static int batch_command(Request *request, char *line) {
+    char *mode = strsep(&line, "|");
+    size_t need = BATCH_RESULT_HEADER + 1, start;
+    ssize_t status;
+    int modeWrite;
+    Element *e;
+
+    if (kstrtoint(mode, 10, &modeWrite) < 0) {
+        modeWrite = -1;
     }
-
-    printk(KERN_INFO "ICTRedis: In Function findKey with key to find !%s! and max_index = %d\n", key, max_index);
-
-    if (max_index == -1) {
-        printk(KERN_INFO "ICTRedis: In Function findKey key: !%s! not found \n", key);
-        return -1;
+    if (modeWrite == INCRBY || modeWrite == DECRBY) {
+        need += 20;                         // the longest s64 in decimal
+    } else if (modeWrite == MSET) {
+        need = max_t(size_t, batch_fields(line) / 2, 1) * (BATCH_RESULT_HEADER + 1);
+    } else if (modeWrite == EXEC) {
+        need = max_t(size_t, request->txnLen, 1) * (BATCH_RESULT_HEADER + 1);
+    }
+    status = out_reserve(request, need);
+    if (status < 0) {
+        return status;
     }
+    start = request->outLen;
 
+    if (request->inMulti && (modeWrite == PUSH || modeWrite == EDIT || modeWrite == DELETE)) {
+        batch_result(request, txn_queue(request, modeWrite, line));
+        return 0;
+    }
+    switch (modeWrite) {
+        case PUSH:
+        case EDIT:
+            e = create_element(&request->db->store, line);
+            if (IS_ERR(e)) {
+                status = PTR_ERR(e);
+                break;
+            }
+            status = modeWrite == PUSH ? store_push(&request->db->store, e) : store_edit(&request->db->store, e);
+            if (status < 0) {
+                element_free(e);
+            }
+            break;
+        case GET:
+            if (line == NULL || strlen(line) > max_key_len) {
+                status = line == NULL ? -EINVAL : -E2BIG;
+                break;
+            }
+            return batch_read(request, start, batch_value(request, store_get(&request->db->store, line, strlen(line),
+                                                                              request->value, max_value_len + 1)));
+        case DELETE:
+            status = line == NULL ? -EINVAL : store_delete(&request->db->store, line, strlen(line));
+            break;
+        case MGET:
+            return batch_read(request, start, batch_mget(request, line));
+        case MSET:
+            batch_mset(request, line);
+            return 0;
+        case MULTI:
+            status = txn_begin(request);
+            break;
+        case EXEC:
+            batch_exec(request);
+            return 0;
+        case INCRBY:
+        case DECRBY:
+            batch_incr(request, modeWrite, line);     // its room was made before it ran
+            return 0;
+        case CAS:
+            batch_cas(request, line);
+            return 0;
+        case GETS:
+            return batch_read(request, start, batch_gets(request, line));
+        case GETRANGE:
+            return batch_read(request, start, batch_getrange(request, line));
+        case WATCH:
+            status = watch_add(request, line);
+            if (request->watch.nrWatches != 0) {
+                request->modeWrite = WATCH;     // even if only some of the keys could be added
+            }
+            break;
+        case UNWATCH:
+            watch_clear(request);
+            if (request->modeWrite == WATCH) {
+                request->modeWrite = -1;
+            }
+            status = 0;
+            break;
+        default:
+            status = -EINVAL;
+    }
 
+    batch_result(request, status);
+    return 0;
+}
 
+// "5|key|key|...": one GET result line per key
+static int batch_mget(Request *request, char *line) {
+    size_t n = batch_fields(line);
+    char *key;
+    int ret = 0;
 
-    for (i = 0; i <= max_index; i++) {
-        printk(KERN_INFO "ICTRedis: compare !%s! with !%s!\n", array[i].key, key);
-        if (strcmp(array[i].key, key) == 0) {
-            printk(KERN_INFO "ICTRedis: Found !%s! with !%s!\n", array[i].key, key);
-            found = 1;
-            break;
+    if (n == 0 || n > TXN_MAX) {
+        batch_result(request, n == 0 ? -EINVAL : -E2BIG);
+        return 0;
+    }
+    while (ret == 0 && (key = strsep(&line, "|")) != NULL) {
+        if (strlen(key) > max_key_len) {
+            ret = batch_value(request, -E2BIG);
+            continue;
         }
+        ret = batch_value(request, store_get(&request->db->store, key, strlen(key), request->value, max_value_len + 1));
     }
+    return ret;
+}
+
+// "6|key|value|key|value|...": every key is set, whether it exists or not, all at once.
+// One result line per key, or a single one if the request is malformed.
+static void batch_mset(Request *request, char *line) {
+    size_t n = batch_fields(line);
+    unsigned int i;
+    char *key, *value;
+    Element *e;
+    int ret;
+
+    if (n == 0 || n % 2 != 0 || n / 2 > TXN_MAX || request->inMulti) {
+        batch_result(request, n / 2 > TXN_MAX ? -E2BIG : -EINVAL);
+        return;
+    }
+    ret = txn_alloc(request);
+    if (ret < 0) {
+        batch_result(request, ret);
+        return;
+    }
+    while ((key = strsep(&line, "|")) != NULL) {
+        value = strsep(&line, "|");
+        e = element_alloc(&request->db->store, key, strlen(key), value, strlen(value));
+        if (IS_ERR(e)) {
+            txn_clear(request);
+            batch_result(request, PTR_ERR(e));
+            return;
+        }
+        request->txn[request->txnLen].op = MSET;
+        request->txn[request->txnLen++].e = e;
+    }
+    store_exec(&request->db->store, request->txn, request->txnLen);
+    for (i = 0; i < request->txnLen; i++) {
+        batch_result(request, request->txn[i].result);
+    }
+    txn_clear(request);
+}
+
+// "8": apply the commands queued since MULTI, one result line per command
+static void batch_exec(Request *request) {
+    unsigned int i;
+
+    if (!request->inMulti) {
+        batch_result(request, -EINVAL);
+        return;
+    }
+    if (request->txnFailed) {
+        // a command could not even be queued, its line said why
+        for (i = 0; i < request->txnLen; i++) {
+            request->txn[i].result = -ECANCELED;
+        }
+    } else {
+        store_exec(&request->db->store, request->txn, request->txnLen);
+    }
+    for (i = 0; i < request->txnLen; i++) {
+        batch_result(request, request->txn[i].result);
+    }
+    if (request->txnLen == 0) {
+        batch_result(request, 0);       // an empty transaction still answers
+    }
+    txn_clear(request);
+}
+
+// "9|key|delta" or "10|key|delta": the new value, as a GET line
+static void batch_incr(Request *request, int modeWrite, char *line) {
+    char *key = strsep(&line, "|");
+    s64 delta, result;
+    int ret;
+
+    if (key == NULL || line == NULL || kstrtos64(line, 10, &delta) < 0 ||
+        (modeWrite == DECRBY && delta == S64_MIN)) {
+        batch_result(request, -EINVAL);
+        return;
+    }
+    if (strlen(key) > max_key_len) {
+        batch_result(request, -E2BIG);
+        return;
+    }
+    ret = store_incr(&request->db->store, key, strlen(key), modeWrite == DECRBY ? -delta : delta, &result);
+    if (ret < 0) {
+        batch_result(request, ret);
+        return;
+    }
+    batch_value(request, scnprintf(request->value, max_value_len + 1, "%lld", result));
+}
+
+// "11|version|key|value|ttl_ms": "0|new_version" once stored
+static void batch_cas(Request *request, char *line) {
+    char *version = strsep(&line, "|");
+    u64 expected, stored;
+    Element *e;
+    int ret;
+
+    if (version == NULL || kstrtou64(version, 10, &expected) < 0) {
+        batch_result(request, -EINVAL);
+        return;
+    }
+    e = create_element(&request->db->store, line);
+    if (IS_ERR(e)) {
+        batch_result(request, PTR_ERR(e));
+        return;
+    }
+    ret = store_cas(&request->db->store, e, expected, NULL, 0, &stored);
+    if (ret < 0) {
+        element_free(e);
+        batch_result(request, ret);
+        return;
+    }
+    request->outLen += scnprintf(request->outBuffer + request->outLen, BATCH_RESULT_HEADER,
+                                 "0|%llu", stored);
+    request->outBuffer[request->outLen++] = '\n';
+}
+
+// "12|key": "0|version|len|value"
+static int batch_gets(Request *request, char *line) {
+    ssize_t value_len;
+    u64 version;
+    int ret;
+
+    if (line == NULL || strlen(line) > max_key_len) {
+        batch_result(request, line == NULL ? -EINVAL : -E2BIG);
+        return 0;
+    }
+    value_len = store_gets(&request->db->store, line, strlen(line), request->value, max_value_len + 1, &version);
+    if (value_len < 0) {
+        batch_result(request, value_len);
+        return 0;
+    }
+    ret = out_reserve(request, BATCH_RESULT_HEADER + 1 + value_len);
+    if (ret < 0) {
+        return ret;
+    }
+    request->outLen += scnprintf(request->outBuffer + request->outLen, BATCH_RESULT_HEADER,
+                                 "0|%llu|%zd|", version, value_len);
+    memcpy(request->outBuffer + request->outLen, request->value, value_len);
+    request->outLen += value_len;
+    request->outBuffer[request->outLen++] = '\n';
+    return 0;
+}
+
+// "15|key|start|end": the bytes of the range, as a GET line
+static int batch_getrange(Request *request, char *line) {
+    char *key = strsep(&line, "|");
+    char *start = strsep(&line, "|");
+    s64 first, last;
+
+    if (key == NULL || start == NULL || line == NULL || kstrtos64(start, 10, &first) < 0 ||
+        kstrtos64(line, 10, &last) < 0) {
+        batch_result(request, -EINVAL);
+        return 0;
+    }
+    if (strlen(key) > max_key_len) {
+        batch_result(request, -E2BIG);
+        return 0;
+    }
+    return batch_value(request, store_getrange(&request->db->store, key, strlen(key), first, last, request->value,
+                                               NULL, NULL));
+}
+
+static int txn_alloc(Request *request) {
+    if (request->txn == NULL) {
+        request->txn = kcalloc(TXN_MAX, sizeof(TxnCmd), GFP_KERNEL);
+        if (request->txn == NULL) {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+// "7": start queueing PUSH, EDIT and DELETE commands until EXEC
+static int txn_begin(Request *request) {
+    int ret;
+
+    if (request->inMulti) {
+        return -EINVAL;
+    }
+    ret = txn_alloc(request);
+    if (ret < 0) {
+        return ret;
+    }
+    request->inMulti = true;
+    request->txnFailed = false;
+    return 0;
+}
+
+// Queue a command of a transaction, it is checked and applied by EXEC. A command that can't
+// be queued fails the whole transaction.
+static int txn_queue(Request *request, int op, char *line) {
+    Element *e;
+
+    if (request->txnLen == TXN_MAX) {
+        request->txnFailed = true;
+        return -E2BIG;
+    }
+    if (op == DELETE) {
+        e = line == NULL ? ERR_PTR(-EINVAL) : element_alloc(&request->db->store, line, strlen(line), "", 0);
+    } else {
+        e = create_element(&request->db->store, line);
+    }
+    if (IS_ERR(e)) {
+        request->txnFailed = true;
+        return PTR_ERR(e);
+    }
+    request->txn[request->txnLen].op = op;
+    request->txn[request->txnLen++].e = e;
+    return 0;
+}
+
+// free the elements still held by queued commands and leave MULTI
+static void txn_clear(Request *request) {
+    unsigned int i;
+
+    for (i = 0; i < request->txnLen; i++) {
+        if (request->txn[i].e != NULL) {
+            element_free(request->txn[i].e);
+        }
+    }
+    request->txnLen = 0;
+    request->inMulti = false;
+    request->txnFailed = false;
+}
+
+// "13|key|key|...": watch the keys as well as those watched already, the changes to them are
+// read from then on. Called with request->lock held.
+static int watch_add(Request *request, char *line) {
+    Watcher *w = &request->watch;
+    Watch *watch;
+    char *key;
+    size_t key_len;
+    u32 hash;
+
+    if (line == NULL) {
+        return -EINVAL;
+    }
+    if (w->events == NULL) {
+        w->events = (char *) kvmalloc(2 * WATCH_BUFFER, GFP_KERNEL);
+        if (w->events == NULL) {
+            return -ENOMEM;
+        }
+        w->out = w->events + WATCH_BUFFER;
+    }
+    mutex_lock(&watchMutex);
+    while ((key = strsep(&line, "|")) != NULL) {
+        key_len = strlen(key);
+        if (key_len > max_key_len) {
+            mutex_unlock(&watchMutex);
+            return -E2BIG;
+        }
+        hash = hash_key(key, key_len);
+        list_for_each_entry(watch, &w->watches, link) {
+            if (watch->hash == hash && watch->key_len == key_len && memcmp(watch->key, key, key_len) == 0) {
+                break;
+            }
+        }
+        if (&watch->link != &w->watches) {
+            continue;                   // watched already
+        }
+        if (w->nrWatches == WATCH_MAX) {
+            mutex_unlock(&watchMutex);
+            return -E2BIG;
+        }
+        watch = kmalloc(struct_size(watch, key, key_len), GFP_KERNEL);
+        if (watch == NULL) {
+            mutex_unlock(&watchMutex);
+            return -ENOMEM;
+        }
+        watch->watcher = w;
+        watch->db = request->db;
+        watch->hash = hash;
+        watch->key_len = key_len;
+        memcpy(watch->key, key, key_len);
+        list_add(&watch->link, &w->watches);
+        hash_add_rcu(watchTable, &watch->node, hash);
+        if (w->nrWatches++ == 0) {
+            static_branch_inc(&watch_enabled);
+        }
+    }
+    mutex_unlock(&watchMutex);
+    return 0;
+}
+
+// Stop watching every key, the events not read yet are dropped. Returns whether there were
+// watches, writers may then still be queueing events until a grace period has passed.
+static bool watch_clear(Request *request) {
+    Watcher *w = &request->watch;
+    Watch *watch, *next;
+
+    if (w->nrWatches == 0) {
+        return false;
+    }
+    mutex_lock(&watchMutex);
+    list_for_each_entry_safe(watch, next, &w->watches, link) {
+        hash_del_rcu(&watch->node);
+        list_del(&watch->link);
+        kfree_rcu(watch, rcu);
+    }
+    w->nrWatches = 0;
+    static_branch_dec(&watch_enabled);
+    mutex_unlock(&watchMutex);
+    spin_lock(&w->lock);
+    w->len = 0;
+    w->lost = 0;
+    spin_unlock(&w->lock);
+    return true;
+}
+
+// append the line counting the events dropped, if any, called with w->lock held.
+// Events always leave room for it.
+static void watch_report_lost(Watcher *w) {
+    if (w->lost != 0) {
+        w->len += scnprintf(w->events + w->len, WATCH_LOST_LINE, "%d|%llu\n", WATCH_LOST, w->lost);
+        w->lost = 0;
+    }
+}
+
+// Queue an event for every file watching the key and wake them, called by the writer that
+// changed it with the shard lock held. Writers only take the spinlock of the files watching
+// the key they changed, and drop the event rather than wait for a file that does not read.
+static void watch_notify(Database *db, ModeWrite op, const char *key, size_t key_len) {
+    u32 hash = hash_key(key, key_len);
+    size_t need = BATCH_RESULT_HEADER + key_len + 1;
+    Watcher *w;
+    Watch *watch;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(watchTable, watch, node, hash) {
+        if (watch->hash != hash || watch->db != db || watch->key_len != key_len ||
+            memcmp(watch->key, key, key_len) != 0) {
+            continue;
+        }
+        w = watch->watcher;
+        spin_lock(&w->lock);
+        watch_report_lost(w);
+        if (w->len + need > WATCH_BUFFER - WATCH_LOST_LINE) {
+            w->lost++;
+        } else {
+            w->len += scnprintf(w->events + w->len, BATCH_RESULT_HEADER, "%d|%zu|", op, key_len);
+            memcpy(w->events + w->len, key, key_len);
+            w->len += key_len;
+            w->events[w->len++] = '\n';
+        }
+        spin_unlock(&w->lock);
+        if (wq_has_sleeper(&w->wait)) {
+            wake_up_interruptible_poll(&w->wait, EPOLLIN | EPOLLRDNORM);
+        }
+    }
+    rcu_read_unlock();
+}
+
+static bool watch_pending(Watcher *w) {
+    return READ_ONCE(w->len) != 0 || READ_ONCE(w->lost) != 0;
+}
+
+// Move as many bytes of events as fit in len to the user, called with request->lock held
+static ssize_t watch_read(Request *request, char __user *buffer, size_t len) {
+    Watcher *w = &request->watch;
+    size_t count;
+
+    spin_lock(&w->lock);
+    watch_report_lost(w);
+    count = min(len, w->len);
+    memcpy(w->out, w->events, count);
+    memmove(w->events, w->events + count, w->len - count);
+    w->len -= count;
+    spin_unlock(&w->lock);
+    return copy_to_user(buffer, w->out, count) ? -EFAULT : count;
+}
+
+// Run the newline-separated commands in buf and queue their results for read(). When last is
+// false buf is only the first chunk of the write, a command cut off at its end is left for the
+// next write. Returns the number of bytes consumed.
+static ssize_t write_batch(Request *request, char *buf, size_t len, bool last) {
+    char *line = buf, *end = buf + len, *nl;
+    int ret = 0;
+
+    mutex_lock(&request->lock);
+    while (line < end) {
+        nl = memchr(line, '\n', end - line);
+        if (nl == NULL) {
+            if (!last) {
+                break;
+            }
+            nl = end;
+        }
+        *nl = '\0';
+        if (nl > line) {                   // skip empty lines
+            ret = batch_command(request, line);
+            if (ret < 0) {
+                break;
+            }
+        }
+        line = nl + 1;
+    }
+    mutex_unlock(&request->lock);
+
+    if (line == buf) {
+        // nothing could be run: the output is full or the first command is longer than a chunk
+        return ret < 0 ? ret : -E2BIG;
+    }
+    return min_t(size_t, line - buf, len);
+}
+
+/** @brief The binary command interface, see ictRedis.h. The key and value are copied from
+ *  user space straight into the new element or into the preallocated per-file buffers, so
+ *  apart from the element a SET, EDIT or UPSERT stores nothing is allocated.
+ *  @param filep A pointer to a file object
+ *  @param cmd One of the ICTREDIS_IOC_* commands
+ *  @param arg The user address of a struct ictredis_cmd
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+    Request *request = filep->private_data;
+    struct ictredis_cmd __user *ucmd = (struct ictredis_cmd __user *) arg;
+    struct ictredis_cmd c;
+    const char __user *key;
+    Element *e;
+    ssize_t value_len;
+    long ret;
+
+    if (_IOC_TYPE(cmd) != ICTREDIS_IOC_MAGIC) {
+        return -ENOTTY;
+    }
+    if (cmd == ICTREDIS_IOC_RING_SETUP) {
+        return ring_setup(request, (struct ictredis_ring_params __user *) arg);
+    }
+    if (cmd == ICTREDIS_IOC_RING_ENTER) {
+        return ring_enter(request);
+    }
+    if (cmd == ICTREDIS_IOC_INCRBY) {
+        return ioctl_incr(request, (struct ictredis_incr __user *) arg);
+    }
+    if (cmd == ICTREDIS_IOC_GETRANGE) {
+        return ioctl_getrange(request, (struct ictredis_range __user *) arg);
+    }
+    if (cmd == ICTREDIS_IOC_CAS || cmd == ICTREDIS_IOC_GETS) {
+        return ioctl_cas(request, cmd, (struct ictredis_cas __user *) arg);
+    }
+    if (copy_from_user(&c, ucmd, sizeof(c))) {
+        return -EFAULT;
+    }
+    if (c.key_len > max_key_len) {
+        return -E2BIG;
+    }
+    key = u64_to_user_ptr(c.key);
+
+    switch (cmd) {
+        case ICTREDIS_IOC_SET:
+        case ICTREDIS_IOC_EDIT:
+        case ICTREDIS_IOC_UPSERT:
+            e = element_from_user(&request->db->store, key, c.key_len, u64_to_user_ptr(c.value), c.value_len);
+            if (IS_ERR(e)) {
+                return PTR_ERR(e);
+            }
+            element_set_ttl(e, c.ttl_ms);
+            if (cmd == ICTREDIS_IOC_SET) {
+                ret = store_push(&request->db->store, e);
+            } else if (cmd == ICTREDIS_IOC_EDIT) {
+                ret = store_edit(&request->db->store, e);
+            } else {
+                ret = store_set(&request->db->store, e);
+            }
+            if (ret < 0) {
+                element_free(e);
+            }
+            return ret;
 
-    if (found) {
-        return i;
+        case ICTREDIS_IOC_GET:
+            mutex_lock(&request->lock);
+            if (copy_from_user(request->key, key, c.key_len)) {
+                mutex_unlock(&request->lock);
+                return -EFAULT;
+            }
+            value_len = store_get(&request->db->store, request->key, c.key_len, request->value, max_value_len + 1);
+            if (value_len < 0) {
+                ret = value_len;
+            } else if (value_len > c.value_len) {
+                ret = -ERANGE;
+            } else if (copy_to_user(u64_to_user_ptr(c.value), request->value, value_len)) {
+                ret = -EFAULT;
+            } else {
+                ret = 0;
+            }
+            mutex_unlock(&request->lock);
+            if ((ret == 0 || ret == -ERANGE) && put_user((__u32) value_len, &ucmd->value_len)) {
+                return -EFAULT;
+            }
+            return ret;
+
+        case ICTREDIS_IOC_DEL:
+            mutex_lock(&request->lock);
+            if (copy_from_user(request->key, key, c.key_len)) {
+                mutex_unlock(&request->lock);
+                return -EFAULT;
+            }
+            ret = store_delete(&request->db->store, request->key, c.key_len);
+            mutex_unlock(&request->lock);
+            return ret;
+
+        default:
+            return -ENOTTY;
+    }
+}
+
+// ICTREDIS_IOC_INCRBY, the key is copied into the per-file buffer
+static long ioctl_incr(Request *request, struct ictredis_incr __user *uincr) {
+    struct ictredis_incr c;
+    s64 result;
+    long ret;
+
+    if (copy_from_user(&c, uincr, sizeof(c))) {
+        return -EFAULT;
+    }
+    if (c.key_len > max_key_len) {
+        return -E2BIG;
+    }
+    mutex_lock(&request->lock);
+    if (copy_from_user(request->key, u64_to_user_ptr(c.key), c.key_len)) {
+        mutex_unlock(&request->lock);
+        return -EFAULT;
+    }
+    ret = store_incr(&request->db->store, request->key, c.key_len, c.delta, &result);
+    mutex_unlock(&request->lock);
+    if (ret == 0 && put_user(result, &uincr->result)) {
+        return -EFAULT;
+    }
+    return ret;
+}
+
+// The range cache of the file, called with request->lock held. NULL if no value is stored
+// compressed, or if there is no memory for its buffer: ranges are then expanded each time.
+static RangeCache *request_range_cache(Request *request) {
+    if (compress_min_len == 0) {
+        return NULL;
+    }
+    if (request->range.buf == NULL) {
+        request->range.buf = (char *) kvmalloc(max_t(size_t, max_value_len, 1), GFP_KERNEL);
+    }
+    return request->range.buf != NULL ? &request->range : NULL;
+}
+
+// ICTREDIS_IOC_GETRANGE, the bytes go through the per-file value buffer
+static long ioctl_getrange(Request *request, struct ictredis_range __user *urange) {
+    struct ictredis_range c;
+    ssize_t count = 0;
+    u64 value_len = 0;
+    long ret = 0;
+
+    if (copy_from_user(&c, urange, sizeof(c))) {
+        return -EFAULT;
+    }
+    if (c.key_len > max_key_len) {
+        return -E2BIG;
+    }
+    c.value_len = min_t(u32, c.value_len, max_value_len + 1);
+    mutex_lock(&request->lock);
+    if (copy_from_user(request->key, u64_to_user_ptr(c.key), c.key_len)) {
+        ret = -EFAULT;
+    } else if (c.offset <= S64_MAX && c.value_len != 0) {
+        // a range reaching past S64_MAX ends with the value all the same
+        count = store_getrange(&request->db->store, request->key, c.key_len, c.offset,
+                               c.offset > S64_MAX - c.value_len ? S64_MAX : c.offset + c.value_len - 1, request->value,
+                               &value_len, c.offset != 0 ? request_range_cache(request) : NULL);
+    } else {
+        // nothing to copy, only the length of the value is asked for
+        count = store_getrange(&request->db->store, request->key, c.key_len, 0, -1, NULL, &value_len, NULL);
+        count = min_t(ssize_t, count, 0);
+    }
+    if (ret == 0 && count < 0) {
+        ret = count;
+    } else if (ret == 0 && count > 0 && copy_to_user(u64_to_user_ptr(c.value), request->value, count)) {
+        ret = -EFAULT;
+    }
+    mutex_unlock(&request->lock);
+    if (ret == 0 && (put_user((__u32) count, &urange->value_len) || put_user(value_len, &urange->total_len))) {
+        return -EFAULT;
+    }
+    return ret;
+}
+
+// ICTREDIS_IOC_CAS and ICTREDIS_IOC_GETS. The expected value of a CAS is copied into the
+// per-file value buffer, so apart from the new element nothing is allocated.
+static long ioctl_cas(Request *request, unsigned int cmd, struct ictredis_cas __user *ucas) {
+    struct ictredis_cas c;
+    ssize_t value_len;
+    u64 version = 0;
+    Element *e;
+    long ret;
+
+    if (copy_from_user(&c, ucas, sizeof(c))) {
+        return -EFAULT;
+    }
+    if (c.key_len > max_key_len) {
+        return -E2BIG;
+    }
+    if (cmd == ICTREDIS_IOC_GETS) {
+        mutex_lock(&request->lock);
+        if (copy_from_user(request->key, u64_to_user_ptr(c.key), c.key_len)) {
+            mutex_unlock(&request->lock);
+            return -EFAULT;
+        }
+        value_len = store_gets(&request->db->store, request->key, c.key_len, request->value, max_value_len + 1, &version);
+        if (value_len < 0) {
+            ret = value_len;
+        } else if (value_len > c.value_len) {
+            ret = -ERANGE;
+        } else if (copy_to_user(u64_to_user_ptr(c.value), request->value, value_len)) {
+            ret = -EFAULT;
+        } else {
+            ret = 0;
+        }
+        mutex_unlock(&request->lock);
+        if ((ret == 0 || ret == -ERANGE) &&
+            (put_user((__u32) value_len, &ucas->value_len) || put_user(version, &ucas->version))) {
+            return -EFAULT;
+        }
+        return ret;
+    }
+
+    if (c.flags & ~ICTREDIS_CAS_VALUE) {
+        return -EINVAL;
+    }
+    if ((c.flags & ICTREDIS_CAS_VALUE) && c.expected_len > max_value_len) {
+        return -ESTALE;                 // no stored value can be that long
+    }
+    e = element_from_user(&request->db->store, u64_to_user_ptr(c.key), c.key_len, u64_to_user_ptr(c.value), c.value_len);
+    if (IS_ERR(e)) {
+        return PTR_ERR(e);
+    }
+    element_set_ttl(e, c.ttl_ms);
+    mutex_lock(&request->lock);
+    if ((c.flags & ICTREDIS_CAS_VALUE) &&
+        copy_from_user(request->value, u64_to_user_ptr(c.expected), c.expected_len)) {
+        ret = -EFAULT;
+    } else {
+        ret = store_cas(&request->db->store, e, c.version, c.flags & ICTREDIS_CAS_VALUE ? request->value : NULL, c.expected_len,
+                        &version);
+    }
+    mutex_unlock(&request->lock);
+    if (ret < 0) {
+        element_free(e);
+        return ret;
+    }
+    return put_user(version, &ucas->version) ? -EFAULT : 0;
+}
+
+/** @brief Map the rings set up with ICTREDIS_IOC_RING_SETUP into the process
+ *  @param filep A pointer to a file object
+ *  @param vma The mapping, it has to start at offset 0 and be no bigger than the rings
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma) {
+    Request *request = filep->private_data;
+    int ret;
+
+    mutex_lock(&request->lock);
+    if (request->ring == NULL) {
+        ret = -EINVAL;
+    } else if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > request->ring->size) {
+        ret = -EINVAL;
+    } else {
+        ret = remap_vmalloc_range(vma, request->ring->mem, 0);
+    }
+    mutex_unlock(&request->lock);
+    return ret;
+}
+
+static long ring_setup(Request *request, struct ictredis_ring_params __user *uparams) {
+    struct ictredis_ring_params params;
+    size_t sqes_off, cqes_off, data_off, size;
+    Ring *ring;
+
+    if (copy_from_user(&params, uparams, sizeof(params))) {
+        return -EFAULT;
+    }
+    if (params.flags != 0 || params.sq_entries == 0 || params.sq_entries > RING_MAX_ENTRIES ||
+        params.cq_entries > RING_MAX_ENTRIES || params.data_size > ring_max_data) {
+        return -EINVAL;
+    }
+    params.sq_entries = roundup_pow_of_two(params.sq_entries);
+    params.cq_entries = params.cq_entries ? roundup_pow_of_two(params.cq_entries)
+                                          : min(2 * params.sq_entries, RING_MAX_ENTRIES);
+
+    sqes_off = ALIGN(sizeof(struct ictredis_ring), SMP_CACHE_BYTES);
+    cqes_off = ALIGN(sqes_off + params.sq_entries * sizeof(struct ictredis_sqe), SMP_CACHE_BYTES);
+    data_off = ALIGN(cqes_off + params.cq_entries * sizeof(struct ictredis_cqe), SMP_CACHE_BYTES);
+    size = PAGE_ALIGN(data_off + params.data_size);
+
+    ring = (Ring *) kzalloc(sizeof(Ring), GFP_KERNEL);
+    if (ring == NULL) {
+        return -ENOMEM;
+    }
+    ring->mem = vmalloc_user(size);       // zeroed, and allowed to be mapped into user space
+    if (ring->mem == NULL) {
+        kfree(ring);
+        return -ENOMEM;
+    }
+    ring->size = size;
+    ring->hdr = (struct ictredis_ring *) ring->mem;
+    ring->sqes = (struct ictredis_sqe *) ((char *) ring->mem + sqes_off);
+    ring->cqes = (struct ictredis_cqe *) ((char *) ring->mem + cqes_off);
+    ring->data = (char *) ring->mem + data_off;
+    ring->sqEntries = params.sq_entries;
+    ring->cqEntries = params.cq_entries;
+    ring->dataSize = params.data_size;
+    ring->hdr->sq_mask = params.sq_entries - 1;
+    ring->hdr->cq_mask = params.cq_entries - 1;
+
+    params.sqes_off = sqes_off;
+    params.cqes_off = cqes_off;
+    params.data_off = data_off;
+    params.mmap_size = size;
+
+    mutex_lock(&request->lock);
+    if (request->ring != NULL) {
+        mutex_unlock(&request->lock);
+        ring_free(ring);
+        return -EBUSY;
+    }
+    request->ring = ring;
+    mutex_unlock(&request->lock);
+
+    if (copy_to_user(uparams, &params, sizeof(params))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+// whether [off, off + len) lies inside the data area
+static bool ring_range_ok(Ring *ring, u64 off, u32 len) {
+    return off <= ring->dataSize && len <= ring->dataSize - off;
+}
+
+// whether the key and value of an entry lie inside the data area and fit the limits
+static int ring_check(Ring *ring, const struct ictredis_sqe *sqe) {
+    if (!ring_range_ok(ring, sqe->key_off, sqe->key_len) ||
+        (sqe->opcode != DELETE && !ring_range_ok(ring, sqe->value_off, sqe->value_len))) {
+        return -EINVAL;
+    }
+    return sqe->key_len > max_key_len ? -E2BIG : 0;
+}
+
+// run one submission entry, sqe is a private copy so the process can't change it meanwhile
+static void ring_run(Request *request, Ring *ring, const struct ictredis_sqe *sqe, struct ictredis_cqe *cqe) {
+    ssize_t value_len;
+    Element *e;
+
+    cqe->value_len = 0;
+    cqe->res = ring_check(ring, sqe);
+    if (cqe->res < 0) {
+        return;
+    }
+
+    switch (sqe->opcode) {
+        case PUSH:
+        case EDIT:
+        case MSET:
+            e = element_alloc(&request->db->store, ring->data + sqe->key_off, sqe->key_len, ring->data + sqe->value_off,
+                              sqe->value_len);
+            if (IS_ERR(e)) {
+                cqe->res = PTR_ERR(e);
+                return;
+            }
+            element_set_ttl(e, sqe->ttl_ms);
+            if (sqe->opcode == PUSH) {
+                cqe->res = store_push(&request->db->store, e);
+            } else if (sqe->opcode == EDIT) {
+                cqe->res = store_edit(&request->db->store, e);
+            } else {
+                cqe->res = store_set(&request->db->store, e);
+            }
+            if (cqe->res < 0) {
+                element_free(e);
+            }
+            return;
+        case GET:
+            // look up a stable copy of the key, the value goes straight into the data area
+            memcpy(request->key, ring->data + sqe->key_off, sqe->key_len);
+            value_len = store_get(&request->db->store, request->key, sqe->key_len, ring->data + sqe->value_off, sqe->value_len);
+            if (value_len < 0) {
+                cqe->res = value_len;
+                return;
+            }
+            cqe->value_len = value_len;
+            cqe->res = value_len > sqe->value_len ? -ERANGE : 0;
+            return;
+        case DELETE:
+            memcpy(request->key, ring->data + sqe->key_off, sqe->key_len);
+            cqe->res = store_delete(&request->db->store, request->key, sqe->key_len);
+            return;
+        default:
+            cqe->res = -EINVAL;
+    }
+}
+
+// make the transaction command an entry of a chain stands for
+static int ring_txn_cmd(Request *request, Ring *ring, const struct ictredis_sqe *sqe, TxnCmd *cmd) {
+    int ret = ring_check(ring, sqe);
+    Element *e;
+
+    if (ret < 0) {
+        return ret;
+    }
+    if (sqe->opcode != PUSH && sqe->opcode != EDIT && sqe->opcode != DELETE && sqe->opcode != MSET) {
+        return -EINVAL;
+    }
+    if (sqe->opcode == DELETE) {
+        e = element_alloc(&request->db->store, ring->data + sqe->key_off, sqe->key_len, "", 0);
+    } else {
+        e = element_alloc(&request->db->store, ring->data + sqe->key_off, sqe->key_len, ring->data + sqe->value_off,
+                          sqe->value_len);
+    }
+    if (IS_ERR(e)) {
+        return PTR_ERR(e);
+    }
+    element_set_ttl(e, sqe->ttl_ms);
+    cmd->op = sqe->opcode;
+    cmd->e = e;
+    return 0;
+}
+
+// The entries the one at sqHead runs with: every entry up to the first without
+// ICTREDIS_SQE_LINK, the end of the submission or max entries. linked tells whether the
+// chain goes on after them.
+static u32 ring_chain_len(Ring *ring, u32 sq_tail, u32 max, bool *linked) {
+    u32 n = 0;
+
+    do {
+        *linked = READ_ONCE(ring->sqes[(ring->sqHead + n) & (ring->sqEntries - 1)].flags) & ICTREDIS_SQE_LINK;
+        n++;
+    } while (*linked && ring->sqHead + n != sq_tail && n < max);
+    return n;
+}
+
+// Run the n entries of a chain at sqHead as one transaction and post their completions.
+// err, if not 0, fails every entry without running any.
+static void ring_chain(Request *request, Ring *ring, u32 n, int err) {
+    struct ictredis_sqe sqe;
+    struct ictredis_cqe *cqe;
+    TxnCmd *cmds = NULL;
+    u32 i, bad = n;
+
+    if (err == 0) {
+        cmds = kcalloc(n, sizeof(TxnCmd), GFP_KERNEL);
+        err = cmds == NULL ? -ENOMEM : 0;
+    }
+    for (i = 0; i < n && err == 0; i++) {
+        memcpy(&sqe, &ring->sqes[(ring->sqHead + i) & (ring->sqEntries - 1)], sizeof(sqe));
+        err = ring_txn_cmd(request, ring, &sqe, &cmds[i]);
+        if (err < 0) {
+            bad = i;                // the one entry that failed, the others are canceled
+        }
+    }
+    if (err == 0) {
+        store_exec(&request->db->store, cmds, n);
     }
-    else {
-        printk(KERN_INFO "ICTRedis: In Function findKey key: !%s! not found \n", key);
-        return -1;
+    for (i = 0; i < n; i++) {
+        cqe = &ring->cqes[(ring->cqTail + i) & (ring->cqEntries - 1)];
+        cqe->user_data = READ_ONCE(ring->sqes[(ring->sqHead + i) & (ring->sqEntries - 1)].user_data);
+        cqe->value_len = 0;
+        if (err == 0) {
+            cqe->res = cmds[i].result;
+        } else {
+            cqe->res = bad == n || bad == i ? err : -ECANCELED;
+        }
+        if (cmds != NULL && cmds[i].e != NULL) {
+            element_free(cmds[i].e);
+        }
+    }
+    kfree(cmds);
+}
+
+// The doorbell: run the entries submitted since the last call, for as long as the completion
+// ring has room. Returns how many entries were consumed.
+static long ring_enter(Request *request) {
+    struct ictredis_sqe sqe;
+    struct ictredis_cqe cqe;
+    Ring *ring;
+    u32 sq_tail, cq_head, n, submitted = 0;
+    bool linked, cut;
+
+    mutex_lock(&request->lock);
+    ring = request->ring;
+    if (ring == NULL) {
+        mutex_unlock(&request->lock);
+        return -EINVAL;
+    }
+
+    sq_tail = smp_load_acquire(&ring->hdr->sq_tail);     // entries written before the tail moved
+    cq_head = smp_load_acquire(&ring->hdr->cq_head);
+    // never run more than a ring's worth, whatever the process wrote in sq_tail
+    while (ring->sqHead != sq_tail && submitted < ring->sqEntries) {
+        n = ring_chain_len(ring, sq_tail, min_t(u32, TXN_MAX, ring->cqEntries), &linked);
+        if (ring->cqTail - cq_head + n > ring->cqEntries) {
+            break;                  // a chain waits for room for all of its completions
+        }
+        cut = linked && ring->sqHead + n != sq_tail;       // the chain is longer than max
+        if (n == 1 && !linked && !ring->chainFailed) {
+            memcpy(&sqe, &ring->sqes[ring->sqHead & (ring->sqEntries - 1)], sizeof(sqe));
+            ring_run(request, ring, &sqe, &cqe);
+            cqe.user_data = sqe.user_data;
+            ring->cqes[ring->cqTail & (ring->cqEntries - 1)] = cqe;
+        } else {
+            ring_chain(request, ring, n, cut || ring->chainFailed ? -E2BIG : 0);
+        }
+        ring->chainFailed = cut;
+        ring->sqHead += n;
+        ring->cqTail += n;
+        submitted += n;
+    }
+    // publish the completions before the new tail, and tell the process how far it can reuse the entries
+    smp_store_release(&ring->hdr->cq_tail, ring->cqTail);
+    smp_store_release(&ring->hdr->sq_head, ring->sqHead);
+    mutex_unlock(&request->lock);
+    return submitted;
+}
+
+static void ring_free(Ring *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    vfree(ring->mem);
+    kfree(ring);
+}
+
+/** @brief The device release function that is called whenever the device is closed/released by
+ *  the userspace program
+ *  @param inodep A pointer to an inode object (defined in linux/fs.h)
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ */
+static int dev_release(struct inode *inodep, struct file *filep) {
+    Request *request = filep->private_data;
+    mutex_destroy(&request->lock);
+    kvfree(request->outBuffer);
+    kvfree(request->range.buf);
+    ring_free(request->ring);               /// no mapping is left, each one holds a reference to the file
+    if (request->txn != NULL) {
+        txn_clear(request);                 /// a transaction never executed is dropped
+        kfree(request->txn);
+    }
+    if (watch_clear(request)) {
+        synchronize_rcu();                  /// writers may still be queueing events for the file
+    }
+    kvfree(request->watch.events);
+    kvfree(request);                        /// Frees the per-file request state
+    return 0;
+}
+
+/** @brief Open /dev/ictredis-snapshot, read-only to dump the store or write-only to load a
+ *  snapshot into it
+ *  @param inodep A pointer to an inode object (defined in linux/fs.h)
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ */
+static int snapshot_open(struct inode *inodep, struct file *filep) {
+    bool load = filep->f_mode & FMODE_WRITE;
+    Snapshot *snap;
+
+    if ((filep->f_mode & FMODE_READ) && load) {
+        return -EINVAL;
     }
+    snap = (Snapshot *) kzalloc(sizeof(Snapshot), GFP_KERNEL);
+    if (snap == NULL) {
+        return -ENOMEM;
+    }
+    // a load has to hold a whole record, a dump grows the buffer for big buckets as it goes
+    snap->size = max_t(size_t, SNAPSHOT_CHUNK,
+                       sizeof(struct ictredis_snapshot_record) + max_key_len + max_value_len);
+    snap->buf = (char *) kvmalloc(snap->size, GFP_KERNEL);
+    if (load && snap->buf != NULL) {
+        snap->staged = kcalloc(nr_shards, sizeof(*snap->staged), GFP_KERNEL);
+    }
+    if (snap->buf == NULL || (load && snap->staged == NULL)) {
+        kvfree(snap->buf);
+        kfree(snap);
+        return -ENOMEM;
+    }
+    mutex_init(&snap->lock);
+    snap->db = &databases[iminor(inodep) / MINORS_PER_DATABASE];
+    snap->crc = ~0U;
+    filep->private_data = snap;
+    return 0;
+}
+
+// Append the records of the next bucket to the dump buffer. The bucket is serialized under
+// rcu_read_lock(); if it does not fit, the buffer is grown outside of it and the bucket redone.
+// A shard that grows meanwhile only makes later buckets hold elements already dumped.
+static int snapshot_dump_bucket(Snapshot *snap) {
+    Shard *s = &snap->db->store.shards[snap->shard];
+    struct ictredis_snapshot_record rec;
+    struct hlist_node *pos;
+    unsigned int records;
+    size_t need, size;
+    Table *t;
+    char *buf;
+
+    for (;;) {
+        rcu_read_lock();
+        t = rcu_dereference(s->table);
+        if (snap->bucket >= (1UL << t->bits)) {
+            rcu_read_unlock();
+            snap->shard++;
+            snap->bucket = 0;
+            return 0;
+        }
+        need = 0;
+        records = 0;
+        for (pos = rcu_dereference(hlist_first_rcu(&t->buckets[snap->bucket]));
+             pos != NULL;
+             pos = rcu_dereference(hlist_next_rcu(pos))) {
+            Element *e = link_to_element(pos, t);
+            if (element_expired(e)) {
+                continue;
+            }
+            size = sizeof(rec) + e->key_len + e->value_len;
+            if (snap->len + need + size <= snap->size) {
+                buf = snap->buf + snap->len + need;
+                rec.key_len = e->key_len;
+                rec.value_len = e->value_len;
+                rec.ttl_ms = element_ttl_ms(e);
+                rec.flags = 0;
+                memcpy(buf, &rec, sizeof(rec));
+                memcpy(buf + sizeof(rec), element_key(e), e->key_len);
+                element_read_value(&snap->db->store, e, buf + sizeof(rec) + e->key_len, e->value_len);
+                records++;
+            }
+            need += size;               // keep counting how much room the whole bucket takes
+        }
+        rcu_read_unlock();
+        if (snap->len + need <= snap->size) {
+            snap->crc = crc32c(snap->crc, snap->buf + snap->len, need);
+            snap->len += need;
+            snap->count += records;
+            snap->bucket++;
+            return 0;
+        }
+
+        buf = (char *) kvmalloc(snap->len + need, GFP_KERNEL);
+        if (buf == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(buf, snap->buf, snap->len);
+        kvfree(snap->buf);
+        snap->buf = buf;
+        snap->size = snap->len + need;
+    }
+}
+
+// Refill the dump buffer with at least SNAPSHOT_CHUNK bytes, or whatever is left of the dump
+static int snapshot_dump(Snapshot *snap) {
+    struct ictredis_snapshot_header header;
+    struct ictredis_snapshot_trailer trailer;
+    int ret;
+
+    snap->len = snap->pos = 0;
+    if (!snap->started) {
+        header.magic = ICTREDIS_SNAPSHOT_MAGIC;
+        header.version = ICTREDIS_SNAPSHOT_VERSION;
+        memcpy(snap->buf, &header, sizeof(header));
+        snap->crc = crc32c(snap->crc, &header, sizeof(header));
+        snap->len = sizeof(header);
+        snap->started = true;
+    }
+    while (snap->shard < nr_shards && snap->len < SNAPSHOT_CHUNK) {
+        ret = snapshot_dump_bucket(snap);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (snap->shard == nr_shards && !snap->finished && snap->len + sizeof(trailer) <= snap->size) {
+        trailer.end = ICTREDIS_SNAPSHOT_END;
+        trailer.checksum = ~snap->crc;
+        trailer.count = snap->count;
+        memcpy(snap->buf + snap->len, &trailer, sizeof(trailer));
+        snap->len += sizeof(trailer);
+        snap->finished = true;
+    }
+    return 0;
+}
+
+/** @brief Stream the snapshot, the dump walks the shards a bucket at a time as it is read
+ *  @param filep A pointer to a file object
+ *  @param buffer The user buffer the snapshot is copied to
+ *  @param len The length of the buffer
+ *  @param offset Unused, the snapshot can only be read from start to end
+ */
+static ssize_t snapshot_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
+    Snapshot *snap = filep->private_data;
+    size_t count;
+    int ret;
+
+    mutex_lock(&snap->lock);
+    if (snap->pos == snap->len && !snap->finished) {
+        ret = snapshot_dump(snap);
+        if (ret < 0) {
+            mutex_unlock(&snap->lock);
+            return ret;
+        }
+    }
+    count = min(len, snap->len - snap->pos);
+    if (copy_to_user(buffer, snap->buf + snap->pos, count)) {
+        mutex_unlock(&snap->lock);
+        return -EFAULT;
+    }
+    snap->pos += count;
+    mutex_unlock(&snap->lock);
+    return count;
+}
+
+// Take the header, records and trailer complete in the load buffer. Records become elements
+// staged per shard; nothing reaches the store before the trailer checks out.
+// Returns 0 when more bytes are needed.
+static int snapshot_parse(Snapshot *snap) {
+    struct ictredis_snapshot_header header;
+    struct ictredis_snapshot_record rec;
+    struct ictredis_snapshot_trailer trailer;
+    size_t size;
+    Element *e;
+
+    if (!snap->started) {
+        if (snap->len < sizeof(header)) {
+            return 0;
+        }
+        memcpy(&header, snap->buf, sizeof(header));
+        if (header.magic != ICTREDIS_SNAPSHOT_MAGIC || header.version != ICTREDIS_SNAPSHOT_VERSION) {
+            return -EINVAL;
+        }
+        snap->crc = crc32c(snap->crc, &header, sizeof(header));
+        snap->pos = sizeof(header);
+        snap->started = true;
+    }
+    while (!snap->finished && snap->len - snap->pos >= sizeof(rec)) {
+        memcpy(&rec, snap->buf + snap->pos, sizeof(rec));
+        if (rec.key_len == ICTREDIS_SNAPSHOT_END) {
+            memcpy(&trailer, &rec, sizeof(trailer));
+            if (trailer.checksum != ~snap->crc || trailer.count != snap->count) {
+                return -EBADMSG;
+            }
+            snap->pos += sizeof(trailer);
+            snap->finished = true;
+            break;
+        }
+        if (rec.flags != 0 || rec.key_len > max_key_len || rec.value_len > max_value_len) {
+            return rec.flags != 0 ? -EINVAL : -E2BIG;
+        }
+        size = sizeof(rec) + rec.key_len + rec.value_len;
+        if (snap->len - snap->pos < size) {
+            break;
+        }
+        e = element_alloc(&snap->db->store, snap->buf + snap->pos + sizeof(rec), rec.key_len,
+                          snap->buf + snap->pos + sizeof(rec) + rec.key_len, rec.value_len);
+        if (IS_ERR(e)) {
+            return PTR_ERR(e);
+        }
+        element_set_ttl(e, rec.ttl_ms);
+        hlist_add_head(&e->node[0], &snap->staged[reciprocal_scale(e->hash, nr_shards)].list);
+        snap->staged[reciprocal_scale(e->hash, nr_shards)].count++;
+        snap->crc = crc32c(snap->crc, snap->buf + snap->pos, size);
+        snap->pos += size;
+        snap->count++;
+    }
+    return 0;
+}
+
+/** @brief Take the next part of a snapshot being loaded. Once its trailer arrives with a
+ *  matching checksum every key is stored at once, replacing keys that exist; a bad snapshot
+ *  leaves the store untouched. A write going past the trailer takes only the bytes up to it,
+ *  writing more fails with EINVAL.
+ *  @param filep A pointer to a file object
+ *  @param buffer The next bytes of the snapshot
+ *  @param len The length of the buffer
+ *  @param offset Unused, the snapshot has to be written from start to end
+ */
+static ssize_t snapshot_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
+    Snapshot *snap = filep->private_data;
+    size_t count;
+    int ret;
+
+    mutex_lock(&snap->lock);
+    if (snap->finished || snap->failed) {
+        mutex_unlock(&snap->lock);
+        return -EINVAL;
+    }
+    // keep the incomplete record at the front, then fill the rest of the buffer
+    memmove(snap->buf, snap->buf + snap->pos, snap->len - snap->pos);
+    snap->len -= snap->pos;
+    snap->pos = 0;
+    count = min(len, snap->size - snap->len);
+    if (copy_from_user(snap->buf + snap->len, buffer, count)) {
+        mutex_unlock(&snap->lock);
+        return -EFAULT;
+    }
+    snap->len += count;
+
+    ret = snapshot_parse(snap);
+    if (ret == 0 && snap->finished) {
+        snapshot_commit(snap);
+        count -= snap->len - snap->pos;     // what follows the trailer is not part of the snapshot
+    }
+    if (ret < 0) {
+        snap->failed = true;            // the stream is out of step, drop what was staged
+        snapshot_discard(snap);
+    }
+    mutex_unlock(&snap->lock);
+    return ret < 0 ? ret : count;
+}
+
+// Store the staged elements shard by shard, each table grown once up front so the load does
+// not go through a resize every time a table doubles. The lock is let go
+// every SNAPSHOT_LOAD_BATCH elements so that other writers of the shard keep going.
+static void snapshot_commit(Snapshot *snap) {
+    unsigned int i, n;
+    Element *e, *found;
+
+    for (i = 0; i < nr_shards; i++) {
+        Shard *s = &snap->db->store.shards[i];
+        struct hlist_head *list = &snap->staged[i].list;
+
+        mutex_lock(&s->lock);
+        table_reserve(s, s->nr_elements + snap->staged[i].count);
+        for (n = 1; !hlist_empty(list); n++) {
+            e = hlist_entry(list->first, Element, node[0]);
+            hlist_del_init(&e->node[0]);
+            found = findKey(s, element_key(e), e->key_len, e->hash);
+            if (found != NULL) {
+                table_replace(s, found, e);
+            } else {
+                table_insert(s, e);
+            }
+            if (n % SNAPSHOT_LOAD_BATCH == 0) {
+                mutex_unlock(&s->lock);
+                cond_resched();
+                mutex_lock(&s->lock);
+            }
+        }
+        snap->staged[i].count = 0;
+        mutex_unlock(&s->lock);
+    }
+}
+
+// free the elements of an incomplete or bad snapshot
+static void snapshot_discard(Snapshot *snap) {
+    struct hlist_node *next;
+    unsigned int i;
+    Element *e;
+
+    for (i = 0; i < nr_shards; i++) {
+        hlist_for_each_entry_safe(e, next, &snap->staged[i].list, node[0]) {
+            element_free(e);
+        }
+        INIT_HLIST_HEAD(&snap->staged[i].list);
+        snap->staged[i].count = 0;
+    }
+}
+
+static int snapshot_release(struct inode *inodep, struct file *filep) {
+    Snapshot *snap = filep->private_data;
+
+    if (snap->staged != NULL) {
+        snapshot_discard(snap);         // the file was closed before the trailer
+        kfree(snap->staged);
+    }
+    mutex_destroy(&snap->lock);
+    kvfree(snap->buf);
+    kfree(snap);
+    return 0;
+}
+
+
+// copy len bytes into the ring at byte offset off, wrapping around its end
+static void log_copy_in(LogRing *ring, u64 off, const void *src, size_t len) {
+    size_t at = off & (logSize - 1);
+    size_t first = min_t(size_t, len, logSize - at);
+
+    memcpy(ring->buf + at, src, first);
+    memcpy(ring->buf, (const char *) src + first, len - first);
+}
+
+static void log_copy_out(LogRing *ring, u64 off, void *dst, size_t len) {
+    size_t at = off & (logSize - 1);
+    size_t first = min_t(size_t, len, logSize - at);
+
+    memcpy(dst, ring->buf + at, first);
+    memcpy((char *) dst + first, ring->buf, len - first);
+}
+
+// whether changes to db are logged, only while its log is open
+static bool log_wanted(Database *db) {
+    return static_branch_unlikely(&log_enabled) && atomic_read(&db->logReaders) != 0;
+}
+
+// Append a change to the ring of this CPU, called with the shard lock of the key held so the
+// records of a key are in the order of its changes. Nothing is logged while nobody reads the log.
+// The writer only takes the spinlock of its own CPU, and if the ring is full it drops the
+// oldest records rather than wait for readers.
+static void log_append(Database *db, ModeWrite op, const char *key, size_t key_len, const char *value, size_t value_len,
+                       u32 ttl_ms) {
+    struct ictredis_log_record rec = {
+            .key_len = key_len,
+            .value_len = value_len,
+            .ttl_ms = ttl_ms,
+            .op = op,
+    };
+    size_t size = ICTREDIS_LOG_RECORD_SIZE(&rec);
+    struct ictredis_log_record old;
+    LogRing *ring;
+
+    if (!log_wanted(db)) {
+        return;
+    }
+    ring = get_cpu_ptr(db->logRings);
+    spin_lock(&ring->lock);
+    rec.seq = atomic64_inc_return(&db->logSeq);
+    if (size > logSize) {
+        // it can never fit, readers are told they lost it and everything before
+        ring->tail = ring->head;
+        ring->tailIndex = ++ring->headIndex;
+    } else {
+        while (ring->head + size - ring->tail > logSize) {
+            log_copy_out(ring, ring->tail, &old, sizeof(old));
+            ring->tail += ICTREDIS_LOG_RECORD_SIZE(&old);
+            ring->tailIndex++;
+        }
+        log_copy_in(ring, ring->head, &rec, sizeof(rec));
+        log_copy_in(ring, ring->head + sizeof(rec), key, key_len);
+        log_copy_in(ring, ring->head + sizeof(rec) + key_len, value, value_len);
+        ring->head += size;
+        ring->headIndex++;
+    }
+    spin_unlock(&ring->lock);
+    put_cpu_ptr(db->logRings);
+    if (wq_has_sleeper(&db->logWait)) {
+        wake_up_interruptible(&db->logWait);
+    }
+}
+
+static int log_rings_init(Database *db) {
+    unsigned int cpu;
+
+    atomic64_set(&db->logSeq, 0);
+    atomic_set(&db->logReaders, 0);
+    init_waitqueue_head(&db->logWait);
+    db->logRings = alloc_percpu(LogRing);
+    if (db->logRings == NULL) {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        LogRing *ring = per_cpu_ptr(db->logRings, cpu);
+        spin_lock_init(&ring->lock);
+        if (logSize != 0) {
+            ring->buf = (char *) kvmalloc_node(logSize, GFP_KERNEL, cpu_to_node(cpu));
+            if (ring->buf == NULL) {
+                log_rings_destroy(db);
+                return -ENOMEM;
+            }
+        }
+    }
+    return 0;
+}
+
+static void log_rings_destroy(Database *db) {
+    unsigned int cpu;
+
+    if (db->logRings == NULL) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        kvfree(per_cpu_ptr(db->logRings, cpu)->buf);
+    }
+    free_percpu(db->logRings);
+    db->logRings = NULL;
+}
+
+/** @brief Open /dev/ictredis-log for reading, from the changes made after now. Logging starts
+ *  with the first reader and stops after the last one is gone.
+ *  @param inodep A pointer to an inode object (defined in linux/fs.h)
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ */
+static int log_open(struct inode *inodep, struct file *filep) {
+    Database *db = &databases[iminor(inodep) / MINORS_PER_DATABASE];
+    LogReader *reader;
+    unsigned int cpu;
+
+    if (filep->f_mode & FMODE_WRITE) {
+        return -EPERM;
+    }
+    if (logSize == 0) {
+        return -ENODEV;
+    }
+    reader = (LogReader *) kzalloc(sizeof(LogReader), GFP_KERNEL);
+    if (reader == NULL) {
+        return -ENOMEM;
+    }
+    reader->pos = kcalloc(nr_cpu_ids, sizeof(u64), GFP_KERNEL);
+    reader->index = kcalloc(nr_cpu_ids, sizeof(u64), GFP_KERNEL);
+    reader->size = max_t(size_t, LOG_READ_CHUNK, logSize);
+    reader->buf = (char *) kvmalloc(reader->size, GFP_KERNEL);
+    if (reader->pos == NULL || reader->index == NULL || reader->buf == NULL) {
+        kfree(reader->pos);
+        kfree(reader->index);
+        kvfree(reader->buf);
+        kfree(reader);
+        return -ENOMEM;
+    }
+    mutex_init(&reader->lock);
+    reader->db = db;
+    static_branch_inc(&log_enabled);
+    atomic_inc(&db->logReaders);
+    for_each_possible_cpu(cpu) {
+        LogRing *ring = per_cpu_ptr(db->logRings, cpu);
+        spin_lock(&ring->lock);
+        reader->pos[cpu] = ring->head;
+        reader->index[cpu] = ring->headIndex;
+        spin_unlock(&ring->lock);
+    }
+    filep->private_data = reader;
+    return 0;
+}
+
+// Move whole records the reader has not seen into its buffer, up to len bytes, going through
+// the CPUs round robin from where the last read stopped so that a busy CPU does not starve
+// the others. Returns the bytes collected, -EINVAL if the next record alone does not fit.
+static ssize_t log_collect(LogReader *reader, size_t len) {
+    struct ictredis_log_record rec;
+    unsigned int n, cpu = reader->cpu;
+    bool full = false;
+    size_t used = 0, size;
+
+    for (n = 0; n < nr_cpu_ids && !full; n++) {
+        LogRing *ring;
+
+        cpu = (reader->cpu + n) % nr_cpu_ids;
+        if (!cpu_possible(cpu)) {
+            continue;
+        }
+        ring = per_cpu_ptr(reader->db->logRings, cpu);
+        spin_lock(&ring->lock);
+        if (reader->index[cpu] < ring->tailIndex) {
+            // the writer went around the ring past records this reader had not read
+            if (used + sizeof(rec) > len) {
+                spin_unlock(&ring->lock);
+                full = true;
+                break;
+            }
+            memset(&rec, 0, sizeof(rec));
+            rec.seq = ring->tailIndex - reader->index[cpu];
+            rec.op = ICTREDIS_LOG_LOST;
+            memcpy(reader->buf + used, &rec, sizeof(rec));
+            used += sizeof(rec);
+            reader->pos[cpu] = ring->tail;
+            reader->index[cpu] = ring->tailIndex;
+        }
+        while (reader->pos[cpu] != ring->head) {
+            log_copy_out(ring, reader->pos[cpu], &rec, sizeof(rec));
+            size = ICTREDIS_LOG_RECORD_SIZE(&rec);
+            if (used + size > len) {
+                full = true;
+                break;
+            }
+            log_copy_out(ring, reader->pos[cpu], reader->buf + used, size);
+            used += size;
+            reader->pos[cpu] += size;
+            reader->index[cpu]++;
+        }
+        spin_unlock(&ring->lock);
+    }
+    reader->cpu = full ? cpu : (cpu + 1) % nr_cpu_ids;   // a CPU with records left goes first next time
+    if (used == 0 && full) {
+        return -EINVAL;
+    }
+    return used;
+}
+
+// whether a read would return something right away, records or the note that some were lost
+static bool log_pending(LogReader *reader) {
+    LogRing *ring;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        ring = per_cpu_ptr(reader->db->logRings, cpu);
+        if (READ_ONCE(ring->head) != READ_ONCE(reader->pos[cpu]) ||
+            READ_ONCE(ring->tailIndex) > READ_ONCE(reader->index[cpu])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** @brief Return the next batch of change records, waiting for one unless the file is non-blocking
+ *  @param filep A pointer to a file object
+ *  @param buffer The user buffer the records are copied to
+ *  @param len The length of the buffer, at least the size of the next record
+ *  @param offset Unused
+ */
+static ssize_t log_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
+    LogReader *reader = filep->private_data;
+    ssize_t count;
+
+    mutex_lock(&reader->lock);
+    while ((count = log_collect(reader, min(len, reader->size))) == 0) {
+        mutex_unlock(&reader->lock);
+        if (filep->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(reader->db->logWait, log_pending(reader))) {
+            return -ERESTARTSYS;
+        }
+        mutex_lock(&reader->lock);
+    }
+    if (count > 0 && copy_to_user(buffer, reader->buf, count)) {
+        count = -EFAULT;
+    }
+    mutex_unlock(&reader->lock);
+    return count;
+}
+
+static __poll_t log_poll(struct file *filep, poll_table *wait) {
+    LogReader *reader = filep->private_data;
+
+    poll_wait(filep, &reader->db->logWait, wait);
+    return log_pending(reader) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static int log_release(struct inode *inodep, struct file *filep) {
+    LogReader *reader = filep->private_data;
+
+    atomic_dec(&reader->db->logReaders);
+    static_branch_dec(&log_enabled);
+    mutex_destroy(&reader->lock);
+    kfree(reader->pos);
+    kfree(reader->index);
+    kvfree(reader->buf);
+    kfree(reader);
+    return 0;
+}
+
+// Copy the next keys of shard s after the cursor in order into part, up to budget bytes of
+// [key_len][value_len][key][value] entries. A first value too long for the budget is left
+// out and read when the key is merged. The shard lock is only held for that long.
+static void scan_collect(Request *request, Shard *s, ScanPart *part, size_t budget) {
+    const char *from = request->scanPrefix;
+    size_t from_len = request->scanPrefixLen, size;
+    bool exclusive = false;
+    struct rb_node *node;
+    u32 lens[2];
+
+    part->len = 0;
+    part->pos = 0;
+    part->truncated = false;
+    part->deferred = false;
+
+    if (request->scanHasCursor &&
+        key_cmp(request->scanCursor, request->scanCursorLen, request->scanPrefix, request->scanPrefixLen) >= 0) {
+        from = request->scanCursor;
+        from_len = request->scanCursorLen;
+        exclusive = true;
+    }
+    mutex_lock(&s->lock);
+    for (node = order_lower_bound(s, from, from_len, exclusive); node != NULL; node = rb_next(node)) {
+        Element *e = rb_entry(node, Element, order);
+        if (e->key_len < request->scanPrefixLen ||
+            memcmp(element_key(e), request->scanPrefix, request->scanPrefixLen) != 0) {
+            break;                      // past the keys with the prefix
+        }
+        if (element_expired(e)) {
+            continue;
+        }
+        lens[0] = e->key_len;
+        lens[1] = request->scanValues ? e->value_len : 0;
+        size = sizeof(lens) + lens[0] + lens[1];
+        if (part->len + size > budget) {
+            if (part->len == 0) {
+                memcpy(part->buf, lens, sizeof(lens));
+                memcpy(part->buf + sizeof(lens), element_key(e), lens[0]);
+                part->len = sizeof(lens) + lens[0];
+                part->deferred = true;
+            }
+            part->truncated = true;
+            break;
+        }
+        memcpy(part->buf + part->len, lens, sizeof(lens));
+        memcpy(part->buf + part->len + sizeof(lens), element_key(e), lens[0]);
+        element_read_value(&request->db->store, e, part->buf + part->len + sizeof(lens) + lens[0], lens[1]);
+        part->len += size;
+    }
+    mutex_unlock(&s->lock);
+}
+
+// Append "key_len|key\n", or "key_len|key|value_len|value\n" when the scan returns values, to out
+// and move the cursor past the key. Returns where the value_len bytes of the value go, NULL if
+// the entry does not fit.
+static char *scan_emit(Request *request, char *out, size_t out_size, size_t *out_len, const char *key,
+                       u32 key_len, u32 value_len) {
+    char header[16], value_header[16];
+    size_t header_len = scnprintf(header, sizeof(header), "%u|", key_len);
+    size_t value_header_len = 0;
+    char *value;
+
+    if (request->scanValues) {
+        value_header_len = scnprintf(value_header, sizeof(value_header), "|%u|", value_len);
+    }
+    if (*out_len + header_len + key_len + value_header_len + value_len + 1 > out_size) {
+        return NULL;
+    }
+    memcpy(out + *out_len, header, header_len);
+    *out_len += header_len;
+    memcpy(out + *out_len, key, key_len);
+    *out_len += key_len;
+    memcpy(out + *out_len, value_header, value_header_len);
+    *out_len += value_header_len;
+    value = out + *out_len;
+    *out_len += value_len;
+    out[(*out_len)++] = '\n';
+
+    memcpy(request->scanCursor, key, key_len);
+    request->scanCursorLen = key_len;
+    request->scanHasCursor = true;
+    return value;
+}
+
+// Append the entry of a key whose value scan_collect() left out, reading the value under the
+// lock of its shard s. A key deleted in the meantime is passed over. False if it does not fit.
+static bool scan_emit_deferred(Request *request, Shard *s, char *out, size_t out_size, size_t *out_len,
+                               const char *key, u32 key_len) {
+    bool fits = true;
+    char *value;
+    Element *e;
+
+    mutex_lock(&s->lock);
+    e = findKey(s, key, key_len, hash_key(key, key_len));
+    if (e == NULL || element_expired(e)) {
+        memcpy(request->scanCursor, key, key_len);
+        request->scanCursorLen = key_len;
+        request->scanHasCursor = true;
+    } else {
+        value = scan_emit(request, out, out_size, out_len, key, key_len, e->value_len);
+        if (value != NULL) {
+            element_read_value(&request->db->store, e, value, e->value_len);
+        }
+        fits = value != NULL;
+    }
+    mutex_unlock(&s->lock);
+    return fits;
+}
+
+/** @brief Return the next keys of a scan started with a SCAN request, in order, as many whole
+ *  entries as fit in len. Every shard gives its next keys under its own lock, a share of the
+ *  read at a time, and they are merged; a shard whose share is used up gives the keys after
+ *  the cursor again. Called with request->lock held.
+ *  @return the bytes returned, 0 once the scan is over, -EINVAL if the next entry does not fit
+ */
+static ssize_t scan_read(Request *request, char __user *buffer, size_t len) {
+    size_t out_size = min_t(size_t, len, SCAN_CHUNK);
+    size_t budget = max_t(size_t, out_size / nr_shards, 2 * sizeof(u32) + max_key_len);
+    size_t out_len = 0;
+    Shard *shards = request->db->store.shards;
+    ScanPart *parts, *p;
+    char *out, *mem, *value;
+    unsigned int i;
+    int best;
+    bool done = true;
+    ssize_t ret;
+
+    if (request->scanDone) {
+        return 0;
+    }
+    mem = (char *) kvmalloc(out_size + (size_t) nr_shards * budget, GFP_KERNEL);
+    parts = kcalloc(nr_shards, sizeof(ScanPart), GFP_KERNEL);
+    if (mem == NULL || parts == NULL) {
+        kvfree(mem);
+        kfree(parts);
+        return -ENOMEM;
+    }
+    out = mem;
+    for (i = 0; i < nr_shards; i++) {
+        parts[i].buf = mem + out_size + (size_t) i * budget;
+        scan_collect(request, &shards[i], &parts[i], budget);
+    }
+
+    // merge until the output is full or every shard is out of keys
+    for (;;) {
+        u32 best_lens[2], lens[2];
+
+        best = -1;
+        for (i = 0; i < nr_shards; i++) {
+            p = &parts[i];
+            if (p->pos == p->len && p->truncated) {
+                scan_collect(request, &shards[i], p, budget);
+            }
+            if (p->pos == p->len) {
+                continue;
+            }
+            memcpy(lens, p->buf + p->pos, sizeof(lens));
+            if (best < 0 || key_cmp(p->buf + p->pos + sizeof(lens), lens[0],
+                                    parts[best].buf + parts[best].pos + sizeof(lens), best_lens[0]) < 0) {
+                best = i;
+                memcpy(best_lens, lens, sizeof(lens));
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        p = &parts[best];
+        if (p->deferred) {
+            if (!scan_emit_deferred(request, &shards[best], out, out_size, &out_len, p->buf + sizeof(best_lens),
+                                    best_lens[0])) {
+                done = false;
+                break;
+            }
+            p->pos = p->len;
+            continue;
+        }
+        value = scan_emit(request, out, out_size, &out_len, p->buf + p->pos + sizeof(best_lens), best_lens[0],
+                          best_lens[1]);
+        if (value == NULL) {
+            done = false;
+            break;
+        }
+        memcpy(value, p->buf + p->pos + sizeof(best_lens) + best_lens[0], best_lens[1]);
+        p->pos += sizeof(best_lens) + best_lens[0] + best_lens[1];
+    }
+
+    request->scanDone = done;
+    if (out_len == 0 && !done) {
+        ret = -EINVAL;                  // the buffer is too small for the next entry
+    } else if (copy_to_user(buffer, out, out_len)) {
+        ret = -EFAULT;
+    } else {
+        ret = out_len;
+    }
+    kfree(parts);
+    kvfree(mem);
+    return ret;
+}
+
+// take string "key|value" or "key|value|ttl_ms" to create a newly allocated element,
+// ERR_PTR() on failure. The key and value are copied straight from the request, the string
+// is not modified.
+static Element *create_element(Store *store, char *string) {
+    char *value, *end;
+    unsigned int ttl_ms = 0;
+    Element *e;
+    if (string == NULL) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    value = strchr(string, '|');
+    if (value == NULL) {
+        return ERR_PTR(-EINVAL);
+    }
+    value++;
+    end = strchrnul(value, '|');
+    if (*end == '|' && kstrtouint(end + 1, 10, &ttl_ms) < 0) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    e = element_alloc(store, string, value - 1 - string, value, end - value);
+    if (!IS_ERR(e)) {
+        element_set_ttl(e, ttl_ms);
+    }
+    return e;
+}
+
+// like element_alloc() but the key and value are copied straight from user space
+static Element *element_from_user(Store *store, const char __user *key, size_t key_len, const char __user *value,
+                                  size_t value_len) {
+    Element *e = element_new(key_len, value_len);
+    if (IS_ERR(e)) {
+        return e;
+    }
+    if (copy_from_user(element_key(e), key, key_len) || copy_from_user(element_value(e), value, value_len)) {
+        element_free(e);
+        return ERR_PTR(-EFAULT);
+    }
+    e->hash = hash_key(element_key(e), key_len);
+    return element_compress(store, e);
+}
+
+static int my_atoi(char *string) {
+    int res = 0;  // Initialize result
+    int sign = 1;  // Initialize sign as positive
+    int i = 0;  // Initialize index of first digit
+    if (string == NULL)
+        return 0;
+
+
+
+    // If number is negative, then update sign
+    if (string[0] == '-') {
+        sign = -1;
+        i++;  // Also update index of first digit
+    }
+
+    // Iterate through all digits of input string and update result
+    for (; string[i] != '\0'; ++i) {
+        if (isNumericChar(string[i]) == false)
+            return 0; // You may add some lines to write error message
+        // to error stream
+        res = res * 10 + string[i] - '0';
+    }
+
+    // Return result with sign
+    return sign * res;
+}
+
+static int isNumericChar(char x) {
+    return (x >= '0' && x <= '9') ? 1 : 0;
+}
+
+
+// The periodic expiry sweep, one store_sweep() run over every database
+static void sweep_expired(struct work_struct *work) {
+    unsigned int i;
+
+    for (i = 0; i < nr_databases; i++) {
+        store_sweep(&databases[i].store);
+    }
+    schedule_delayed_work(&sweep_work, SWEEP_INTERVAL);
+}
+
+// Publish a change made with the shard lock of the key held: log it and wake whoever watches the
+// key. e is the element stored, NULL for DELETE. The log holds values as they were written, a
+// compressed one is expanded for it.
+static void store_changed(Store *store, ModeWrite op, const char *key, size_t key_len, Element *e) {
+    Database *db = container_of(store, Database, store);
+    Compressor *c;
+
+    if (e == NULL) {
+        log_append(db, op, key, key_len, NULL, 0, 0);
+    } else if (!element_compressed(e) || !log_wanted(db)) {
+        log_append(db, op, key, key_len, element_value(e), e->value_len, element_ttl_ms(e));
+    } else {
+        c = compressor_get();
+        element_read_value(store, e, c->buf, e->value_len);
+        log_append(db, op, key, key_len, c->buf, e->value_len, element_ttl_ms(e));
+        compressor_put(c);
+    }
+    if (static_branch_unlikely(&watch_enabled)) {
+        watch_notify(db, op, key, key_len);
+    }
+}
+
+static int stats_show(struct seq_file *m, void *v) {
+    Database *db = m->private;
+    u64 done[NR_OPS] = {0}, failed[NR_OPS] = {0}, evictions = 0, expirations = 0;
+    u64 compressed = 0, incompressible = 0, in = 0, out = 0, compress_ns = 0, decompressed = 0, decompress_ns = 0;
+    unsigned int cpu, op, elements;
+    unsigned long memory;
+
+    for_each_possible_cpu(cpu) {
+        CpuStats *s = per_cpu_ptr(db->store.stats, cpu);
+        for (op = 0; op < NR_OPS; op++) {
+            done[op] += READ_ONCE(s->done[op]);
+            failed[op] += READ_ONCE(s->failed[op]);
+        }
+        evictions += READ_ONCE(s->evictions);
+        expirations += READ_ONCE(s->expirations);
+        compressed += READ_ONCE(s->compressed);
+        incompressible += READ_ONCE(s->incompressible);
+        in += READ_ONCE(s->compress_in);
+        out += READ_ONCE(s->compress_out);
+        compress_ns += READ_ONCE(s->compress_ns);
+        decompressed += READ_ONCE(s->decompressed);
+        decompress_ns += READ_ONCE(s->decompress_ns);
+    }
+    seq_printf(m, "opens %d\n", atomic_read(&db->opens));
+    shards_totals(&db->store, &elements, &memory);
+    seq_printf(m, "shards %u\n", nr_shards);
+    seq_printf(m, "elements %u\n", elements);
+    seq_printf(m, "memory_bytes %lu\n", memory);
+    for (op = 0; op < NR_OPS; op++) {
+        seq_printf(m, "%s %llu\n%s %llu\n", done_names[op], done[op], failed_names[op], failed[op]);
+    }
+    seq_printf(m, "evictions %llu\n", evictions);
+    seq_printf(m, "expirations %llu\n", expirations);
+    // the ratio of the values stored compressed, in hundredths, and the time spent on compression
+    seq_printf(m, "compressed %llu\n", compressed);
+    seq_printf(m, "incompressible %llu\n", incompressible);
+    seq_printf(m, "compress_ratio %llu.%02llu\n", out ? in / out : 0, out ? in * 100 / out % 100 : 0);
+    seq_printf(m, "compress_ns %llu\n", compress_ns);
+    seq_printf(m, "decompressed %llu\n", decompressed);
+    seq_printf(m, "decompress_ns %llu\n", decompress_ns);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+// one "op from_ns count" line per non-empty bucket, a bucket holds durations of [from_ns, 2 * from_ns)
+static int latency_show(struct seq_file *m, void *v) {
+    Database *db = m->private;
+    unsigned int cpu, op, bucket;
+
+    seq_puts(m, "op from_ns count\n");
+    for (op = 0; op < NR_OPS; op++) {
+        for (bucket = 0; bucket < NR_LATENCY_BUCKETS; bucket++) {
+            u64 count = 0;
+            for_each_possible_cpu(cpu) {
+                count += READ_ONCE(per_cpu_ptr(db->store.stats, cpu)->latency[op][bucket]);
+            }
+            if (count != 0) {
+                seq_printf(m, "%s %llu %llu\n", op_names[op], 1ULL << bucket, count);
+            }
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static ssize_t latency_enable_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset) {
+    char buf[2] = {static_key_enabled(&latency_enabled) ? '1' : '0', '\n'};
+    return simple_read_from_buffer(buffer, len, offset, buf, sizeof(buf));
+}
+
+// write 1 to start timing every operation into the latency histograms, 0 to stop
+static ssize_t latency_enable_write(struct file *filep, const char __user *buffer, size_t len, loff_t *offset) {
+    bool enable;
+    int ret = kstrtobool_from_user(buffer, len, &enable);
+    if (ret < 0) {
+        return ret;
+    }
+    if (enable) {
+        static_branch_enable(&latency_enabled);
+    } else {
+        static_branch_disable(&latency_enabled);
+    }
+    return len;
+}
+
+static const struct file_operations latency_enable_fops = {
+        .owner = THIS_MODULE,
+        .read = latency_enable_read,
+        .write = latency_enable_write,
+};
+
+// /sys/kernel/debug/ictredis/, with the stats and latency of each database in a directory of
+// its own named after its device, or right there when there is just one
+static void stats_init(void) {
+    unsigned int i;
+
+    debugfsDir = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_file("latency_enable", 0644, debugfsDir, NULL, &latency_enable_fops);
+    for (i = 0; i < nr_databases; i++) {
+        Database *db = &databases[i];
+        db->debugfsDir = nr_databases == 1 ? debugfsDir : debugfs_create_dir(db->name, debugfsDir);
+        debugfs_create_file("stats", 0444, db->debugfsDir, db, &stats_fops);
+        debugfs_create_file("latency", 0444, db->debugfsDir, db, &latency_fops);
+    }
+}
 
+static void stats_destroy(void) {
+    debugfs_remove_recursive(debugfsDir);
 }
 
 
@@ -0,0 +1,248 @@
+/**
+ * @file   ictRedis.h
+ * @brief  The interface of the ictredis character device shared by the LKM and its user space
+ * clients. Besides the "mode|key|value" text protocol written to the device, commands can be
+ * issued with ioctl() on the open device using the fixed-layout struct ictredis_cmd.
+ */
+#ifndef ICTREDIS_H
+#define ICTREDIS_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/// The mode at the start of a text request, also the number of the matching ioctl command.
+/// SCAN only exists as a text request: "4|prefix|values|cursor", every part optional, starts a
+/// scan of the keys with the prefix, in order, after the cursor key if one is given. Each
+/// following read() returns the next entries that fit, "key_len|key\n" or, if values is 1,
+/// "key_len|key|value_len|value\n", and 0 once the scan is over.
+/// The multi-key commands answer through read() like a batch, one line per key or command:
+/// "5|key|key|..." (MGET) answers each key as a GET line of a batch would, or a single -E2BIG
+/// if the values together are more than the batch output of a file may hold. "6|key|value|..."
+/// (MSET) sets every key at once, whether it exists or not. "7" (MULTI) starts a transaction:
+/// the PUSH, EDIT and DELETE lines after it answer 0 and are only queued, and "8" (EXEC) runs
+/// them all or none of them, answering each with its result or -ECANCELED if another one failed.
+/// No other writer sees part of an MSET or a transaction, a GET may while it is being applied.
+/// The atomic updates answer the same way: "9|key|delta" (INCRBY) and "10|key|delta" (DECRBY)
+/// add to or subtract from a value holding a decimal 64-bit integer, a missing key counting as
+/// 0, and answer the new value as a GET would. "12|key" (GETS) answers "0|version|len|value".
+/// "11|version|key|value|ttl_ms" (CAS) stores the value only if the key still has that version,
+/// or, for version 0, does not exist yet, and answers "0|new_version" or -ESTALE if the key was
+/// changed, -ENOENT if it is gone, -EEXIST if it was created.
+/// "13|key|key|..." (WATCH) adds the keys to those the open file watches and answers 0. From
+/// then on, until a GET or SCAN is written, read() returns a "op|key_len|key\n" line for every
+/// PUSH, EDIT or DELETE of a watched key, blocking until there is one unless the file is
+/// O_NONBLOCK, and poll() reports the file readable once there is. Events that do not fit
+/// while the file is not read are dropped and counted by a "255|count\n" line. "14" (UNWATCH)
+/// stops watching every key.
+/// "15|key|start|end" (GETRANGE) answers the bytes start to end of the value, both included,
+/// as a GET line. Negative positions count from the end of the value, -1 being the last byte.
+enum mode_write_e {
+    PUSH = 0, GET = 1, EDIT = 2, DELETE = 3, SCAN = 4, MGET = 5, MSET = 6, MULTI = 7, EXEC = 8,
+    INCRBY = 9, DECRBY = 10, CAS = 11, GETS = 12, WATCH = 13, UNWATCH = 14, GETRANGE = 15
+};
+
+/** @brief A binary command. Keys and values are passed by address and length, they are
+ *  copied straight into the element or out of it without going through the text parser.
+ *  The layout is the same for 32 and 64 bit processes.
+ */
+struct ictredis_cmd {
+    __u64 key;              ///< User address of the key bytes, no terminating NUL needed
+    __u64 value;            ///< User address of the value bytes, or of the buffer GET fills in
+    __u32 key_len;          ///< Length of the key
+    __u32 value_len;        ///< Length of the value; for GET the size of the buffer, set to the value length on return
+    __u32 ttl_ms;           ///< SET, EDIT and UPSERT: milliseconds until the key expires, 0 for never
+    __u32 pad;
+};
+
+#define ICTREDIS_IOC_MAGIC 0xB9
+
+/// Add a key that does not exist yet, fails with EEXIST otherwise
+#define ICTREDIS_IOC_SET  _IOW(ICTREDIS_IOC_MAGIC, PUSH, struct ictredis_cmd)
+/// Fetch the value of a key, fails with ENOENT if it does not exist and with ERANGE if the
+/// buffer is too small, value_len then holds the size needed
+#define ICTREDIS_IOC_GET  _IOWR(ICTREDIS_IOC_MAGIC, GET, struct ictredis_cmd)
+/// Replace the value of an existing key, fails with ENOENT otherwise
+#define ICTREDIS_IOC_EDIT _IOW(ICTREDIS_IOC_MAGIC, EDIT, struct ictredis_cmd)
+/// Remove a key, fails with ENOENT if it does not exist. value and value_len are ignored
+#define ICTREDIS_IOC_DEL  _IOW(ICTREDIS_IOC_MAGIC, DELETE, struct ictredis_cmd)
+/// Store the value whether the key exists or not
+#define ICTREDIS_IOC_UPSERT _IOW(ICTREDIS_IOC_MAGIC, MSET, struct ictredis_cmd)
+
+/** @brief Shared submission and completion rings. ICTREDIS_IOC_RING_SETUP allocates them for the
+ *  open file and fills in where each part lives, then the whole area is mmap()ed at offset 0.
+ *  The client places keys and values in the data area, fills struct ictredis_sqe entries at
+ *  sq_tail and advances it, then calls ICTREDIS_IOC_RING_ENTER. The module runs the entries in
+ *  order and posts one struct ictredis_cqe per entry at cq_tail; the client consumes them by
+ *  advancing cq_head. Entries stay in the submission ring while the completion ring is full.
+ *  Entries linked with ICTREDIS_SQE_LINK run as one transaction, see struct ictredis_sqe.
+ */
+struct ictredis_ring_params {
+    __u32 sq_entries;       ///< Size of the submission ring, rounded up to a power of two
+    __u32 cq_entries;       ///< Size of the completion ring, rounded up to a power of two, 0 for twice sq_entries
+    __u32 data_size;        ///< Bytes of the data area for keys, values and GET results, at most the
+                            ///< ring_max_data module parameter
+    __u32 flags;            ///< Must be 0
+    __u64 sqes_off;         ///< Set by the module: offset of the submission entries
+    __u64 cqes_off;         ///< Set by the module: offset of the completion entries
+    __u64 data_off;         ///< Set by the module: offset of the data area
+    __u64 mmap_size;        ///< Set by the module: size to map
+};
+
+/// At offset 0 of the mapping, each side's indexes on their own cache line
+struct ictredis_ring {
+    __u32 sq_head;          ///< Advanced by the module as it consumes entries
+    __u32 sq_tail;          ///< Advanced by the client as it submits entries
+    __u32 sq_mask;
+    __u32 sq_pad[13];
+    __u32 cq_head;          ///< Advanced by the client as it consumes completions
+    __u32 cq_tail;          ///< Advanced by the module as it posts completions
+    __u32 cq_mask;
+    __u32 cq_overflow;      ///< Unused, the module never drops a completion
+    __u32 cq_pad[12];
+};
+
+/// The entry and the next one belong to the same chain
+#define ICTREDIS_SQE_LINK 1
+/// Most entries of a chain, fewer if the completion ring is smaller
+#define ICTREDIS_CHAIN_MAX 256
+
+/** @brief A submission entry. MSET stores the value whether the key exists or not. A chain,
+ *  entries linked by ICTREDIS_SQE_LINK up to the first without it or the end of the
+ *  submission, runs as a MULTI ... EXEC transaction of its PUSH, EDIT, DELETE and MSET
+ *  entries: all of them or none are applied, each completes with its result or -ECANCELED if
+ *  another one failed. A GET in a chain fails with EINVAL, every entry of a chain longer
+ *  than it may be with E2BIG.
+ */
+struct ictredis_sqe {
+    __u8 opcode;            ///< PUSH, GET, EDIT, DELETE or MSET
+    __u8 flags;             ///< 0 or ICTREDIS_SQE_LINK
+    __u8 pad[2];
+    __u32 key_len;
+    __u32 value_len;        ///< For GET the size of the result buffer
+    __u32 ttl_ms;           ///< PUSH, EDIT and MSET: milliseconds until the key expires, 0 for never
+    __u64 key_off;          ///< Offset of the key in the data area
+    __u64 value_off;        ///< Offset of the value, or of the GET result buffer, in the data area
+    __u64 user_data;        ///< Copied to the completion untouched
+};
+
+struct ictredis_cqe {
+    __u64 user_data;
+    __s32 res;              ///< 0 or a negative errno, the same as the matching ioctl command
+    __u32 value_len;        ///< For GET the length of the value
+};
+
+/** @brief An atomic INCRBY: the value of the key, a decimal 64-bit integer or missing and
+ *  taken as 0, is replaced by its sum with delta. Fails with EINVAL if the value is not an
+ *  integer and with ERANGE if the sum overflows. The key keeps its TTL.
+ */
+struct ictredis_incr {
+    __u64 key;              ///< User address of the key bytes
+    __u32 key_len;
+    __u32 pad;
+    __s64 delta;            ///< Negative for a DECRBY
+    __s64 result;           ///< Set to the new value on return
+};
+
+/// The value of a CAS has to still be equal to expected, rather than the key having version
+#define ICTREDIS_CAS_VALUE 1
+
+/** @brief A compare-and-swap or a GET returning the version. Every store of a key gives it
+ *  a new, higher version, so a CAS with the version read by ICTREDIS_IOC_GETS fails if any
+ *  other write came in between, even one writing the same value back.
+ */
+struct ictredis_cas {
+    __u64 key;              ///< User address of the key bytes
+    __u64 value;            ///< The new value, or for GETS the buffer to fill in
+    __u64 expected;         ///< With ICTREDIS_CAS_VALUE, the value the key must still hold
+    __u32 key_len;
+    __u32 value_len;        ///< For GETS the size of the buffer, set to the value length on return
+    __u32 expected_len;
+    __u32 ttl_ms;           ///< Milliseconds until the new value expires, 0 for never
+    __u32 flags;            ///< 0 or ICTREDIS_CAS_VALUE
+    __u32 pad;
+    __u64 version;          ///< The version the key must have, 0 for none. Set to its version on return
+};
+
+#define ICTREDIS_IOC_INCRBY _IOWR(ICTREDIS_IOC_MAGIC, INCRBY, struct ictredis_incr)
+/// Replace the value, fails with ESTALE if the key changed, ENOENT if it does not exist or
+/// EEXIST if version 0 was given and it does
+#define ICTREDIS_IOC_CAS    _IOWR(ICTREDIS_IOC_MAGIC, CAS, struct ictredis_cas)
+/// Fetch the value and version of a key, ENOENT and ERANGE as for ICTREDIS_IOC_GET
+#define ICTREDIS_IOC_GETS   _IOWR(ICTREDIS_IOC_MAGIC, GETS, struct ictredis_cas)
+
+/** @brief A read of part of a value, so a large value can be fetched in pieces without the
+ *  rest of it being copied
+ */
+struct ictredis_range {
+    __u64 key;              ///< User address of the key bytes
+    __u64 value;            ///< User address of the buffer to fill in
+    __u64 offset;           ///< The first byte of the value to copy
+    __u32 key_len;
+    __u32 value_len;        ///< Size of the buffer, set to the number of bytes copied, 0 past the end
+    __u64 total_len;        ///< Set to the length of the whole value
+};
+
+/// Copy up to value_len bytes of the value from offset on, fails with ENOENT if the key does not exist
+#define ICTREDIS_IOC_GETRANGE _IOWR(ICTREDIS_IOC_MAGIC, GETRANGE, struct ictredis_range)
+
+#define ICTREDIS_IOC_RING_SETUP _IOWR(ICTREDIS_IOC_MAGIC, 4, struct ictredis_ring_params)
+/// Run the submitted entries, returns how many were consumed
+#define ICTREDIS_IOC_RING_ENTER _IO(ICTREDIS_IOC_MAGIC, 5)
+
+/** @brief Snapshots. Reading /dev/ictredis-snapshot streams every key in this format, writing
+ *  the same stream to it loads the keys back. A snapshot is a struct ictredis_snapshot_header,
+ *  one struct ictredis_snapshot_record per key each followed by the key and value bytes, and a
+ *  struct ictredis_snapshot_trailer. All fields are in host byte order.
+ *  The dump does not stop writers: a key changed while it runs may be missing, or appear twice
+ *  with the later record winning on load.
+ */
+#define ICTREDIS_SNAPSHOT_MAGIC   0x50534349   ///< "ICSP"
+#define ICTREDIS_SNAPSHOT_VERSION 1
+#define ICTREDIS_SNAPSHOT_END     0xFFFFFFFF   ///< key_len of the trailer, tells it from a record
+
+struct ictredis_snapshot_header {
+    __u32 magic;
+    __u32 version;
+};
+
+struct ictredis_snapshot_record {
+    __u32 key_len;
+    __u32 value_len;
+    __u32 ttl_ms;           ///< Time the key had left when it was dumped, 0 if it never expires
+    __u32 flags;            ///< 0
+};
+
+struct ictredis_snapshot_trailer {
+    __u32 end;              ///< ICTREDIS_SNAPSHOT_END
+    __u32 checksum;         ///< crc32c of the header and every record with its key and value
+    __u64 count;            ///< Number of records
+};
+
+/** @brief The change log. Every successful PUSH, EDIT and DELETE, whichever interface it came
+ *  from, is appended to a ring buffer of the CPU it ran on, keys that expire or are evicted as a
+ *  DELETE. A read() of /dev/ictredis-log returns
+ *  as many whole records as fit, each a struct ictredis_log_record followed by the key and value
+ *  and padded to a multiple of 8 bytes. A reader only sees changes made after it opened the
+ *  device. The records of one key come in the order they were made; the records of different
+ *  keys may come out of order, sorting by seq restores the order they were made in.
+ *  A writer never waits for readers: when a ring is full its oldest records are dropped, and a
+ *  reader that had not read them gets an ICTREDIS_LOG_LOST record in their place, as it does for
+ *  a record too big for the ring.
+ */
+#define ICTREDIS_LOG_LOST 0xFF      ///< op of the record that stands for records a reader missed
+
+struct ictredis_log_record {
+    __u64 seq;              ///< Increases with every change. For ICTREDIS_LOG_LOST the number of records missed
+    __u32 key_len;
+    __u32 value_len;        ///< 0 for DELETE
+    __u32 ttl_ms;           ///< The time to live set by the change, 0 for none
+    __u8 op;                ///< PUSH, EDIT, DELETE or ICTREDIS_LOG_LOST
+    __u8 pad[3];
+};
+
+#define ICTREDIS_LOG_ALIGN 8
+#define ICTREDIS_LOG_RECORD_SIZE(rec) \
+    (((sizeof(struct ictredis_log_record) + (rec)->key_len + (rec)->value_len) + ICTREDIS_LOG_ALIGN - 1) & \
+     ~(ICTREDIS_LOG_ALIGN - 1))
+
+#endif
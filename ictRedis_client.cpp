@@ -0,0 +1,460 @@
+/**
+ * @file   ictRedis_client.cpp
+ * @brief  The C++ client of /dev/ictredis, see ictRedis_client.h
+ */
+#include "ictRedis_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <system_error>
+
+namespace ictredis {
+
+static std::atomic<unsigned int> threadCount(0);
+static thread_local unsigned int threadIndex = threadCount++;   ///< Picks the descriptor of the calling thread
+
+static int cmd_write(int fd, unsigned long request, const char *key, size_t key_len, const char *value,
+                     size_t value_len, uint32_t ttl_ms);
+
+static int cmd_get(int fd, const char *key, size_t key_len, std::string &value);
+
+static int cmd_gets(int fd, const char *key, size_t key_len, std::string &value, uint64_t &version);
+
+static unsigned int module_max_value_len();
+
+Client::Client(const ClientOptions &options) : options(options), ringFd(-1), ringStatus(0), ringMem(NULL),
+                                               ringSize(0), ring(NULL), sqes(NULL), cqes(NULL), ringData(NULL),
+                                               sqEntries(0), dataSize(0), sqTail(0), cqHead(0), idle(false),
+                                               stopping(false) {
+    unsigned int n = options.connections ? options.connections : std::thread::hardware_concurrency();
+    int fd;
+
+    if (n == 0) {
+        n = 1;
+    }
+    if (this->options.getSize == 0) {
+        this->options.getSize = module_max_value_len();
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        fd = open(options.device, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            int err = errno;
+            for (int opened : fds) {
+                close(opened);
+            }
+            throw std::system_error(err, std::generic_category(), std::string("Failed to open ") + options.device);
+        }
+        fds.push_back(fd);
+    }
+}
+
+Client::~Client() {
+    {
+        std::lock_guard<std::mutex> lock(queueLock);
+        stopping = true;
+        queueCond.notify_one();
+    }
+    if (thread.joinable()) {
+        thread.join();                      // it runs what is still queued first
+    }
+    if (ringMem != NULL) {
+        munmap(ringMem, ringSize);
+    }
+    if (ringFd >= 0) {
+        close(ringFd);
+    }
+    for (int fd : fds) {
+        close(fd);
+    }
+}
+
+// The descriptor of the calling thread. Threads are spread over the descriptors so that their
+// GETs and DELETEs don't wait for each other in the device.
+int Client::fd() {
+    return fds[threadIndex % fds.size()];
+}
+
+int Client::push(const char *key, size_t key_len, const char *value, size_t value_len, uint32_t ttl_ms) {
+    return cmd_write(fd(), ICTREDIS_IOC_SET, key, key_len, value, value_len, ttl_ms);
+}
+
+int Client::edit(const char *key, size_t key_len, const char *value, size_t value_len, uint32_t ttl_ms) {
+    return cmd_write(fd(), ICTREDIS_IOC_EDIT, key, key_len, value, value_len, ttl_ms);
+}
+
+int Client::set(const char *key, size_t key_len, const char *value, size_t value_len, uint32_t ttl_ms) {
+    return cmd_write(fd(), ICTREDIS_IOC_UPSERT, key, key_len, value, value_len, ttl_ms);
+}
+
+int Client::del(const char *key, size_t key_len) {
+    return cmd_write(fd(), ICTREDIS_IOC_DEL, key, key_len, NULL, 0, 0);
+}
+
+int Client::get(const char *key, size_t key_len, std::string &value) {
+    return cmd_get(fd(), key, key_len, value);
+}
+
+int Client::gets(const char *key, size_t key_len, std::string &value, uint64_t &version) {
+    return cmd_gets(fd(), key, key_len, value, version);
+}
+
+int Client::incrby(const char *key, size_t key_len, int64_t delta, int64_t &result) {
+    struct ictredis_incr c;
+
+    memset(&c, 0, sizeof(c));
+    c.key = (uintptr_t) key;
+    c.key_len = (uint32_t) key_len;
+    c.delta = delta;
+    if (key_len > UINT32_MAX) {
+        return -E2BIG;
+    }
+    if (ioctl(fd(), ICTREDIS_IOC_INCRBY, &c) < 0) {
+        return -errno;
+    }
+    result = c.result;
+    return 0;
+}
+
+int Client::cas(const char *key, size_t key_len, const char *value, size_t value_len, uint64_t version,
+                uint64_t &new_version, uint32_t ttl_ms) {
+    struct ictredis_cas c;
+
+    memset(&c, 0, sizeof(c));
+    c.key = (uintptr_t) key;
+    c.key_len = (uint32_t) key_len;
+    c.value = (uintptr_t) value;
+    c.value_len = (uint32_t) value_len;
+    c.ttl_ms = ttl_ms;
+    c.version = version;
+    if (key_len > UINT32_MAX || value_len > UINT32_MAX) {
+        return -E2BIG;
+    }
+    if (ioctl(fd(), ICTREDIS_IOC_CAS, &c) < 0) {
+        return -errno;
+    }
+    new_version = c.version;
+    return 0;
+}
+
+std::future<Result> Client::push_async(const char *key, size_t key_len, const char *value, size_t value_len,
+                                       uint32_t ttl_ms) {
+    return submit(PUSH, key, key_len, value, value_len, ttl_ms);
+}
+
+std::future<Result> Client::edit_async(const char *key, size_t key_len, const char *value, size_t value_len,
+                                       uint32_t ttl_ms) {
+    return submit(EDIT, key, key_len, value, value_len, ttl_ms);
+}
+
+std::future<Result> Client::set_async(const char *key, size_t key_len, const char *value, size_t value_len,
+                                      uint32_t ttl_ms) {
+    return submit(MSET, key, key_len, value, value_len, ttl_ms);
+}
+
+std::future<Result> Client::del_async(const char *key, size_t key_len) {
+    return submit(DELETE, key, key_len, NULL, 0, 0);
+}
+
+std::future<Result> Client::get_async(const char *key, size_t key_len) {
+    return submit(GET, key, key_len, NULL, 0, 0);
+}
+
+// Queue a call for the submitter, setting the rings up on the first one. The submitter is only
+// woken when it waits, calls made while it runs a submission go into the next one together.
+std::future<Result> Client::submit(uint8_t opcode, const char *key, size_t key_len, const char *value,
+                                   size_t value_len, uint32_t ttl_ms) {
+    std::promise<Result> promise;
+    std::future<Result> future = promise.get_future();
+    std::unique_lock<std::mutex> lock(queueLock);
+    Pending p;
+
+    if (ringFd < 0 && ringStatus == 0) {
+        ringStatus = ring_setup();
+    }
+    if (ringStatus < 0 || key_len > UINT32_MAX || value_len > UINT32_MAX) {
+        lock.unlock();
+        Result r;
+        r.status = ringStatus < 0 ? ringStatus : -E2BIG;
+        promise.set_value(std::move(r));
+        return future;
+    }
+    p.opcode = opcode;
+    p.key_len = (uint32_t) key_len;
+    p.value_len = (uint32_t) value_len;
+    p.ttl_ms = ttl_ms;
+    p.off = staging.size();
+    p.done = false;
+    staging.insert(staging.end(), key, key + key_len);
+    staging.insert(staging.end(), value, value + value_len);
+    p.promise = std::move(promise);
+    queue.push_back(std::move(p));
+    if (idle) {
+        idle = false;
+        queueCond.notify_one();
+    }
+    return future;
+}
+
+// Create the rings of the asynchronous calls on a descriptor of their own, so a submission
+// doesn't hold up the synchronous calls, and start the submitter. Called with queueLock held.
+int Client::ring_setup() {
+    struct ictredis_ring_params params;
+    int ret;
+
+    memset(&params, 0, sizeof(params));
+    params.sq_entries = options.ringEntries;
+    params.data_size = options.ringDataSize;
+    ringFd = open(options.device, O_RDWR | O_CLOEXEC);
+    if (ringFd < 0) {
+        return -errno;
+    }
+    if (ioctl(ringFd, ICTREDIS_IOC_RING_SETUP, &params) < 0) {
+        ret = -errno;
+        close(ringFd);
+        ringFd = -1;
+        return ret;
+    }
+    ringMem = mmap(NULL, params.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, ringFd, 0);
+    if (ringMem == MAP_FAILED) {
+        ret = -errno;
+        ringMem = NULL;
+        close(ringFd);
+        ringFd = -1;
+        return ret;
+    }
+    ringSize = params.mmap_size;
+    ring = (struct ictredis_ring *) ringMem;
+    sqes = (struct ictredis_sqe *) ((char *) ringMem + params.sqes_off);
+    cqes = (struct ictredis_cqe *) ((char *) ringMem + params.cqes_off);
+    ringData = (char *) ringMem + params.data_off;
+    sqEntries = params.sq_entries;
+    dataSize = params.data_size;
+    thread = std::thread(&Client::submitter, this);
+    return 0;
+}
+
+// Take everything queued at once and run it, until the client is destroyed
+void Client::submitter() {
+    std::vector<Pending> batch;
+    std::vector<char> data;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(queueLock);
+            while (queue.empty() && !stopping) {
+                idle = true;
+                queueCond.wait(lock);
+            }
+            idle = false;
+            if (queue.empty()) {
+                return;
+            }
+            // swapping keeps the memory of both sides for the next rounds
+            batch.swap(queue);
+            data.swap(staging);
+        }
+        for (size_t i = 0; i < batch.size();) {
+            i = run_batch(batch, data.data(), i);
+        }
+        batch.clear();
+        data.clear();
+    }
+}
+
+// Submit the calls of batch from index from on, as many as fit the rings, with one
+// ICTREDIS_IOC_RING_ENTER and complete them. Returns the index of the first call left.
+size_t Client::run_batch(std::vector<Pending> &batch, const char *data, size_t from) {
+    uint32_t n = 0, done = 0, tail;
+    size_t i, used = 0, need;
+    long ret;
+
+    for (i = from; i < batch.size() && n < sqEntries; i++) {
+        Pending &p = batch[i];
+        struct ictredis_sqe *sqe = &sqes[sqTail & (sqEntries - 1)];
+
+        need = p.key_len + (p.opcode == GET ? options.getSize : p.opcode == DELETE ? 0 : p.value_len);
+        if (used + need > dataSize) {
+            if (n == 0) {
+                run_sync(p, data);          // bigger than the whole data area
+                return i + 1;
+            }
+            break;
+        }
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = p.opcode;
+        sqe->key_len = p.key_len;
+        sqe->ttl_ms = p.ttl_ms;
+        sqe->user_data = i;
+        sqe->key_off = used;
+        memcpy(ringData + used, data + p.off, p.key_len);
+        used += p.key_len;
+        sqe->value_off = used;
+        p.value_off = used;
+        if (p.opcode == GET) {
+            sqe->value_len = options.getSize;
+        } else if (p.opcode != DELETE) {
+            sqe->value_len = p.value_len;
+            memcpy(ringData + used, data + p.off + p.key_len, p.value_len);
+        }
+        used += need - p.key_len;
+        sqTail++;
+        n++;
+    }
+    __atomic_store_n(&ring->sq_tail, sqTail, __ATOMIC_RELEASE);   // the entries before the tail
+
+    while (done < n) {
+        ret = ioctl(ringFd, ICTREDIS_IOC_RING_ENTER);
+        if (ret < 0 && errno != EINTR) {
+            // only if the rings are gone, fail the calls not completed yet, wherever they are
+            ret = -errno;
+            for (size_t j = from; j < i; j++) {
+                if (!batch[j].done) {
+                    Result r;
+                    r.status = (int) ret;
+                    batch[j].done = true;
+                    batch[j].promise.set_value(std::move(r));
+                }
+            }
+            break;
+        }
+        tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; cqHead != tail; cqHead++, done++) {
+            // user_data, not the position of the completion, tells which call it is
+            const struct ictredis_cqe *cqe = &cqes[cqHead & ring->cq_mask];
+            Pending &p = batch[cqe->user_data];
+            Result r;
+
+            if (p.opcode == GET && cqe->res == -ERANGE) {
+                run_sync(p, data);          // too long for the space it had in the ring
+                continue;
+            }
+            r.status = cqe->res;
+            if (p.opcode == GET && cqe->res == 0) {
+                r.value.assign(ringData + p.value_off, cqe->value_len);
+            }
+            p.done = true;
+            p.promise.set_value(std::move(r));
+        }
+        __atomic_store_n(&ring->cq_head, cqHead, __ATOMIC_RELEASE);
+    }
+    return i;
+}
+
+// run a queued call with a plain ioctl() on the descriptor of the rings
+void Client::run_sync(Pending &p, const char *data) {
+    const char *key = data + p.off, *value = key + p.key_len;
+    Result r;
+
+    switch (p.opcode) {
+        case PUSH:
+            r.status = cmd_write(ringFd, ICTREDIS_IOC_SET, key, p.key_len, value, p.value_len, p.ttl_ms);
+            break;
+        case EDIT:
+            r.status = cmd_write(ringFd, ICTREDIS_IOC_EDIT, key, p.key_len, value, p.value_len, p.ttl_ms);
+            break;
+        case MSET:
+            r.status = cmd_write(ringFd, ICTREDIS_IOC_UPSERT, key, p.key_len, value, p.value_len, p.ttl_ms);
+            break;
+        case GET:
+            r.status = cmd_get(ringFd, key, p.key_len, r.value);
+            break;
+        default:
+            r.status = cmd_write(ringFd, ICTREDIS_IOC_DEL, key, p.key_len, NULL, 0, 0);
+            break;
+    }
+    p.done = true;
+    p.promise.set_value(std::move(r));
+}
+
+// the longest value the loaded module stores, so an asynchronous GET always has room for it
+static unsigned int module_max_value_len() {
+    unsigned int len = 4096;                // the default of the module
+    FILE *f = fopen("/sys/module/ictRedis/parameters/max_value_len", "re");
+
+    if (f != NULL) {
+        if (fscanf(f, "%u", &len) != 1) {
+            len = 4096;
+        }
+        fclose(f);
+    }
+    return len;
+}
+
+// ICTREDIS_IOC_SET, ICTREDIS_IOC_EDIT, ICTREDIS_IOC_UPSERT or ICTREDIS_IOC_DEL
+static int cmd_write(int fd, unsigned long request, const char *key, size_t key_len, const char *value,
+                     size_t value_len, uint32_t ttl_ms) {
+    struct ictredis_cmd c;
+
+    if (key_len > UINT32_MAX || value_len > UINT32_MAX) {
+        return -E2BIG;
+    }
+    memset(&c, 0, sizeof(c));
+    c.key = (uintptr_t) key;
+    c.key_len = (uint32_t) key_len;
+    c.value = (uintptr_t) value;
+    c.value_len = (uint32_t) value_len;
+    c.ttl_ms = ttl_ms;
+    return ioctl(fd, request, &c) < 0 ? -errno : 0;
+}
+
+// Read into all the memory value has, and once more with as much as the value needs if that was
+// not enough
+static int cmd_get(int fd, const char *key, size_t key_len, std::string &value) {
+    struct ictredis_cmd c;
+
+    if (key_len > UINT32_MAX) {
+        return -E2BIG;
+    }
+    memset(&c, 0, sizeof(c));
+    c.key = (uintptr_t) key;
+    c.key_len = (uint32_t) key_len;
+    value.resize(value.capacity());
+    for (;;) {
+        c.value = (uintptr_t) &value[0];
+        c.value_len = (uint32_t) value.size();
+        if (ioctl(fd, ICTREDIS_IOC_GET, &c) == 0) {
+            value.resize(c.value_len);
+            return 0;
+        }
+        if (errno != ERANGE) {
+            value.clear();
+            return -errno;
+        }
+        value.resize(c.value_len);          // the length it needs
+    }
+}
+
+static int cmd_gets(int fd, const char *key, size_t key_len, std::string &value, uint64_t &version) {
+    struct ictredis_cas c;
+
+    if (key_len > UINT32_MAX) {
+        return -E2BIG;
+    }
+    memset(&c, 0, sizeof(c));
+    c.key = (uintptr_t) key;
+    c.key_len = (uint32_t) key_len;
+    value.resize(value.capacity());
+    for (;;) {
+        c.value = (uintptr_t) &value[0];
+        c.value_len = (uint32_t) value.size();
+        if (ioctl(fd, ICTREDIS_IOC_GETS, &c) == 0) {
+            value.resize(c.value_len);
+            version = c.version;
+            return 0;
+        }
+        if (errno != ERANGE) {
+            value.clear();
+            return -errno;
+        }
+        value.resize(c.value_len);
+    }
+}
+
+}
@@ -0,0 +1,199 @@
+/**
+ * @file   ictRedis_client.h
+ * @brief  A C++ client of /dev/ictredis for long running processes. It opens the device once and
+ * keeps it open, so each synchronous call is one ioctl() on a descriptor it already has, with
+ * the key and value passed by address and nothing allocated by the call.
+ *
+ * The asynchronous calls return a future. They are queued and a submitter thread of the client
+ * moves everything queued by every thread into the submission ring at once and runs it with one
+ * ICTREDIS_IOC_RING_ENTER, so the more threads call at once, the fewer system calls each request
+ * costs. Requests of one thread run in the order they were made, except a GET whose value is
+ * longer than ClientOptions::getSize: it is read again once the requests submitted with it have
+ * run, so it may see what later requests of the thread stored or deleted.
+ *
+ * A Client may be used by any number of threads at once.
+ */
+#ifndef ICTREDIS_CLIENT_H
+#define ICTREDIS_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ictRedis.h"
+
+namespace ictredis {
+
+/// How a Client talks to the device, 0 leaves the default
+struct ClientOptions {
+    const char *device = "/dev/ictredis";
+    unsigned int connections = 0;          ///< Descriptors the synchronous calls are spread over, the number of CPUs
+                                           ///< by default. The device runs one GET or DELETE of a descriptor at a time.
+    unsigned int ringEntries = 256;        ///< Most requests one submission of the asynchronous calls runs
+    unsigned int ringDataSize = 1 << 20;   ///< Bytes of the ring for the keys, values and GET results of a submission
+    unsigned int getSize = 0;              ///< Bytes of the ring an asynchronous GET reserves for its value, the
+                                           ///< max_value_len of the module by default. A longer value is read again
+                                           ///< with a synchronous GET, after the requests submitted with it.
+};
+
+/// What an asynchronous call returns
+struct Result {
+    int status;                            ///< 0 or a negative errno, as the synchronous call would return
+    std::string value;                     ///< The value, for GET
+};
+
+class Client {
+public:
+    /** @brief Open the device, throws std::system_error if it can't be opened */
+    explicit Client(const ClientOptions &options = ClientOptions());
+
+    /** @brief Wait for the queued asynchronous calls and close the device */
+    ~Client();
+
+    Client(const Client &) = delete;
+
+    Client &operator=(const Client &) = delete;
+
+    /// Store a new key, -EEXIST if it exists. The key expires ttl_ms from now, never if 0.
+    int push(const char *key, size_t key_len, const char *value, size_t value_len, uint32_t ttl_ms = 0);
+
+    /// Replace the value of an existing key, -ENOENT if there is none
+    int edit(const char *key, size_t key_len, const char *value, size_t value_len, uint32_t ttl_ms = 0);
+
+    /// Store the value whether the key exists or not
+    int set(const char *key, size_t key_len, const char *value, size_t value_len, uint32_t ttl_ms = 0);
+
+    int del(const char *key, size_t key_len);
+
+    /** @brief Read the value of a key into value, whose memory is reused: once it has grown to the
+     *  longest value read, reading allocates nothing
+     *  @return 0 or -ENOENT
+     */
+    int get(const char *key, size_t key_len, std::string &value);
+
+    /// get() that also sets the version of the value, for cas()
+    int gets(const char *key, size_t key_len, std::string &value, uint64_t &version);
+
+    /// Add delta to the decimal integer value of a key, a missing key counting as 0, and set result to the sum
+    int incrby(const char *key, size_t key_len, int64_t delta, int64_t &result);
+
+    /// Store the value only if the key still has the given version, 0 for a key that must not
+    /// exist yet, -ESTALE if it changed. Sets new_version to the version it was stored with.
+    int cas(const char *key, size_t key_len, const char *value, size_t value_len, uint64_t version,
+            uint64_t &new_version, uint32_t ttl_ms = 0);
+
+    int push(const std::string &key, const std::string &value, uint32_t ttl_ms = 0) {
+        return push(key.data(), key.size(), value.data(), value.size(), ttl_ms);
+    }
+
+    int edit(const std::string &key, const std::string &value, uint32_t ttl_ms = 0) {
+        return edit(key.data(), key.size(), value.data(), value.size(), ttl_ms);
+    }
+
+    int set(const std::string &key, const std::string &value, uint32_t ttl_ms = 0) {
+        return set(key.data(), key.size(), value.data(), value.size(), ttl_ms);
+    }
+
+    int del(const std::string &key) {
+        return del(key.data(), key.size());
+    }
+
+    int get(const std::string &key, std::string &value) {
+        return get(key.data(), key.size(), value);
+    }
+
+    /// The asynchronous calls copy the key and value before they return
+    std::future<Result> push_async(const char *key, size_t key_len, const char *value, size_t value_len,
+                                   uint32_t ttl_ms = 0);
+
+    std::future<Result> edit_async(const char *key, size_t key_len, const char *value, size_t value_len,
+                                   uint32_t ttl_ms = 0);
+
+    std::future<Result> set_async(const char *key, size_t key_len, const char *value, size_t value_len,
+                                  uint32_t ttl_ms = 0);
+
+    std::future<Result> del_async(const char *key, size_t key_len);
+
+    std::future<Result> get_async(const char *key, size_t key_len);
+
+    std::future<Result> push_async(const std::string &key, const std::string &value, uint32_t ttl_ms = 0) {
+        return push_async(key.data(), key.size(), value.data(), value.size(), ttl_ms);
+    }
+
+    std::future<Result> edit_async(const std::string &key, const std::string &value, uint32_t ttl_ms = 0) {
+        return edit_async(key.data(), key.size(), value.data(), value.size(), ttl_ms);
+    }
+
+    std::future<Result> set_async(const std::string &key, const std::string &value, uint32_t ttl_ms = 0) {
+        return set_async(key.data(), key.size(), value.data(), value.size(), ttl_ms);
+    }
+
+    std::future<Result> del_async(const std::string &key) {
+        return del_async(key.data(), key.size());
+    }
+
+    std::future<Result> get_async(const std::string &key) {
+        return get_async(key.data(), key.size());
+    }
+
+private:
+    /// A queued asynchronous call, its key followed by its value in the staging buffer
+    struct Pending {
+        uint8_t opcode;                    ///< PUSH, GET, EDIT, DELETE or MSET
+        uint32_t key_len;
+        uint32_t value_len;
+        uint32_t ttl_ms;
+        size_t off;                        ///< Where the key starts in the staging buffer
+        size_t value_off;                  ///< Where its value or GET result is in the data area, once submitted
+        bool done;                         ///< Whether the promise is set
+        std::promise<Result> promise;
+    };
+
+    int fd();
+
+    std::future<Result> submit(uint8_t opcode, const char *key, size_t key_len, const char *value, size_t value_len,
+                               uint32_t ttl_ms);
+
+    int ring_setup();
+
+    void submitter();
+
+    size_t run_batch(std::vector<Pending> &batch, const char *data, size_t from);
+
+    void run_sync(Pending &p, const char *data);
+
+    ClientOptions options;
+    std::vector<int> fds;                  ///< The descriptors of the synchronous calls
+
+    int ringFd;                            ///< The descriptor of the submitter and its rings, -1 until the first
+                                           ///< asynchronous call
+    int ringStatus;                        ///< 0 or why the rings could not be set up
+    void *ringMem;                         ///< The mapping of the rings
+    size_t ringSize;
+    struct ictredis_ring *ring;
+    struct ictredis_sqe *sqes;
+    struct ictredis_cqe *cqes;
+    char *ringData;
+    uint32_t sqEntries;
+    uint32_t dataSize;
+    uint32_t sqTail;                       ///< The submission ring index the submitter fills next
+    uint32_t cqHead;                       ///< The completion ring index it reads next
+
+    std::mutex queueLock;                  ///< Held over the fields below
+    std::condition_variable queueCond;     ///< Wakes the submitter when it waits for calls
+    std::vector<Pending> queue;            ///< Calls waiting for the next submission
+    std::vector<char> staging;             ///< Their keys and values
+    bool idle;                             ///< The submitter waits for queueCond
+    bool stopping;
+    std::thread thread;
+};
+
+}
+
+#endif //ICTREDIS_CLIENT_H
@@ -0,0 +1,732 @@
+/**
+ * @file   ictRedis_compat.h
+ * @brief  The kernel interfaces used by the store engine, done in user space so that
+ * ictRedis_store.c builds into libictredis as it is. Only what the engine uses is here, with
+ * the same names and semantics as in the kernel:
+ * - RCU: readers register with a grace period counter, synchronize_rcu() waits until every
+ *   reader that started before it is done, call_rcu() queues the callbacks and a thread of the
+ *   library runs them in batches after a grace period.
+ * - Per-CPU data: one slot per CPU, PERCPU_UNIT bytes apart, each thread sticks to one slot.
+ *   Threads sharing a slot add to it atomically.
+ * - jiffies are milliseconds of CLOCK_MONOTONIC, slab caches and kvmalloc() are malloc().
+ * - Tracepoints are compiled out, LZ4 is the liblz4 one if the build found it.
+ */
+#ifndef ICTREDIS_COMPAT_H
+#define ICTREDIS_COMPAT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/random.h>
+
+#ifdef ICTREDIS_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef unsigned long long u64;   // long long like the kernel's, for its printf formats
+typedef long long s64;
+
+#define __rcu
+#define __percpu
+#define __user
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *) &(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *) &(x) = (val))
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+#define min(a, b) ({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); _a < _b ? _a : _b; })
+#define max(a, b) ({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); _a > _b ? _a : _b; })
+#define min_t(type, a, b) ({ type _a = (a); type _b = (b); _a < _b ? _a : _b; })
+#define max_t(type, a, b) ({ type _a = (a); type _b = (b); _a > _b ? _a : _b; })
+#define struct_size(p, member, n) (offsetof(__typeof__(*(p)), member) + (size_t) (n) * sizeof((p)->member[0]))
+#define check_add_overflow(a, b, d) __builtin_add_overflow(a, b, d)
+#define BUILD_BUG_ON(cond) ((void) sizeof(char[1 - 2 * !!(cond)]))
+#define WARN_ON_ONCE(cond) ({                                                   \
+        bool _warn = !!(cond);                                                  \
+        static bool _warned;                                                    \
+        if (unlikely(_warn) && !_warned) {                                      \
+            _warned = true;                                                     \
+            fprintf(stderr, "ictredis: warning at %s:%d\n", __FILE__, __LINE__); \
+        }                                                                       \
+        _warn;                                                                  \
+})
+
+#define KERN_ALERT ""
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+#define cond_resched() do { } while (0)
+
+#define MAX_ERRNO 4095
+#define ERR_PTR(err) ((void *) (long) (err))
+#define PTR_ERR(ptr) ((long) (ptr))
+#define IS_ERR(ptr) unlikely((unsigned long) (ptr) >= (unsigned long) -MAX_ERRNO)
+#define IS_ERR_OR_NULL(ptr) (unlikely(!(ptr)) || IS_ERR(ptr))
+#define PTR_ERR_OR_ZERO(ptr) (IS_ERR(ptr) ? PTR_ERR(ptr) : 0)
+
+static inline unsigned int ilog2(u64 n) {
+    return 63 - __builtin_clzll(n);
+}
+
+static inline u32 reciprocal_scale(u32 val, u32 ep_ro) {
+    return (u32) (((u64) val * ep_ro) >> 32);
+}
+
+static inline u64 ktime_get_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// jiffies tick every millisecond
+static inline u64 get_jiffies_64(void) {
+    return ktime_get_ns() / 1000000;
+}
+
+#define msecs_to_jiffies(ms) ((u64) (ms))
+#define jiffies_to_msecs(j) ((unsigned int) (j))
+#define time_after_eq64(a, b) ((s64) ((a) - (b)) >= 0)
+
+// a whole decimal number, optionally followed by one newline, like the kernel parses it
+static inline int kstrtos64(const char *s, unsigned int base, s64 *res) {
+    char *end;
+    long long value;
+
+    if (*s == '\0' || *s == ' ' || *s == '\t') {
+        return -EINVAL;
+    }
+    errno = 0;
+    value = strtoll(s, &end, base);
+    if (end == s || (*end != '\0' && !(end[0] == '\n' && end[1] == '\0'))) {
+        return -EINVAL;
+    }
+    if (errno == ERANGE) {
+        return -ERANGE;
+    }
+    *res = value;
+    return 0;
+}
+
+__attribute__((format(printf, 3, 4)))
+static inline int scnprintf(char *buf, size_t size, const char *fmt, ...) {
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    if (len < 0 || size == 0) {
+        return 0;
+    }
+    return (size_t) len < size ? len : (int) size - 1;
+}
+
+// The hash of the kernel's <linux/jhash.h>, Bob Jenkins' lookup3
+#define JHASH_INITVAL 0xdeadbeef
+
+static inline u32 rol32(u32 word, unsigned int shift) {
+    return (word << (shift & 31)) | (word >> ((-shift) & 31));
+}
+
+#define __jhash_mix(a, b, c)                    \
+{                                               \
+        a -= c;  a ^= rol32(c, 4);  c += b;     \
+        b -= a;  b ^= rol32(a, 6);  a += c;     \
+        c -= b;  c ^= rol32(b, 8);  b += a;     \
+        a -= c;  a ^= rol32(c, 16); c += b;     \
+        b -= a;  b ^= rol32(a, 19); a += c;     \
+        c -= b;  c ^= rol32(b, 4);  b += a;     \
+}
+
+#define __jhash_final(a, b, c)                  \
+{                                               \
+        c ^= b; c -= rol32(b, 14);              \
+        a ^= c; a -= rol32(c, 11);              \
+        b ^= a; b -= rol32(a, 25);              \
+        c ^= b; c -= rol32(b, 16);              \
+        a ^= c; a -= rol32(c, 4);               \
+        b ^= a; b -= rol32(a, 14);              \
+        c ^= b; c -= rol32(b, 24);              \
+}
+
+static inline u32 get_unaligned_cpu32(const void *p) {
+    u32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u32 jhash(const void *key, u32 length, u32 initval) {
+    const u8 *k = (const u8 *) key;
+    u32 a, b, c;
+
+    a = b = c = JHASH_INITVAL + length + initval;
+    while (length > 12) {
+        a += get_unaligned_cpu32(k);
+        b += get_unaligned_cpu32(k + 4);
+        c += get_unaligned_cpu32(k + 8);
+        __jhash_mix(a, b, c);
+        length -= 12;
+        k += 12;
+    }
+    switch (length) {
+        case 12: c += (u32) k[11] << 24; /* fall through */
+        case 11: c += (u32) k[10] << 16; /* fall through */
+        case 10: c += (u32) k[9] << 8;   /* fall through */
+        case 9:  c += k[8];              /* fall through */
+        case 8:  b += (u32) k[7] << 24;  /* fall through */
+        case 7:  b += (u32) k[6] << 16;  /* fall through */
+        case 6:  b += (u32) k[5] << 8;   /* fall through */
+        case 5:  b += k[4];              /* fall through */
+        case 4:  a += (u32) k[3] << 24;  /* fall through */
+        case 3:  a += (u32) k[2] << 16;  /* fall through */
+        case 2:  a += (u32) k[1] << 8;   /* fall through */
+        case 1:  a += k[0];
+            __jhash_final(a, b, c);
+            break;
+        case 0:
+            break;
+    }
+    return c;
+}
+
+static inline void get_random_bytes(void *buf, size_t len) {
+    if (getrandom(buf, len, 0) != (ssize_t) len) {
+        u64 seed = ktime_get_ns();              // only makes the bucket placement harder to guess
+        memcpy(buf, &seed, min(len, sizeof(seed)));
+    }
+}
+
+// Memory, GFP flags do not matter outside the kernel
+#define GFP_KERNEL 0
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kfree(p) free(p)
+#define kvmalloc(size, gfp) malloc(size)
+#define kvmalloc_node(size, gfp, node) malloc(size)
+#define kvzalloc(size, gfp) calloc(1, size)
+#define kvfree(p) free(p)
+#define cpu_to_node(cpu) 0
+
+struct kmem_cache {
+    size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+                                                   unsigned long flags, void (*ctor)(void *)) {
+    struct kmem_cache *cache = (struct kmem_cache *) malloc(sizeof(*cache));
+    if (cache != NULL) {
+        cache->size = size;
+    }
+    return cache;
+}
+
+#define kmem_cache_alloc(cache, gfp) malloc((cache)->size)
+#define kmem_cache_free(cache, p) free(p)
+#define kmem_cache_destroy(cache) free(cache)
+
+// Bitmaps
+#define BITS_PER_LONG (sizeof(long) * CHAR_BIT)
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define bitmap_zalloc(nbits, gfp) ((unsigned long *) calloc(BITS_TO_LONGS(nbits), sizeof(long)))
+#define bitmap_free(p) free(p)
+
+static inline void set_bit(unsigned int nr, unsigned long *addr) {
+    addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline unsigned int find_next_bit(const unsigned long *addr, unsigned int size, unsigned int offset) {
+    for (; offset < size; offset++) {
+        if (addr[offset / BITS_PER_LONG] & (1UL << (offset % BITS_PER_LONG))) {
+            break;
+        }
+    }
+    return offset;
+}
+
+#define for_each_set_bit(bit, addr, size) \
+    for ((bit) = find_next_bit(addr, size, 0); (bit) < (size); (bit) = find_next_bit(addr, size, (bit) + 1))
+
+// Mutexes
+struct mutex {
+    pthread_mutex_t m;
+};
+
+#define mutex_init(lock) pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_destroy(lock) pthread_mutex_destroy(&(lock)->m)
+#define mutex_lock(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_unlock(lock) pthread_mutex_unlock(&(lock)->m)
+#define mutex_lock_nest_lock(lock, nest) mutex_lock(lock)
+#define lockdep_is_held(lock) 1
+
+// Static keys are plain flags
+struct static_key_false {
+    int enabled;
+};
+
+#define DEFINE_STATIC_KEY_FALSE(name) struct static_key_false name = {0}
+#define static_branch_unlikely(key) unlikely(READ_ONCE((key)->enabled))
+#define static_key_enabled(key) READ_ONCE((key)->enabled)
+#define static_branch_enable(key) WRITE_ONCE((key)->enabled, 1)
+#define static_branch_disable(key) WRITE_ONCE((key)->enabled, 0)
+
+// Per-CPU data: slot n of an allocation is n * PERCPU_UNIT bytes after slot 0, so the slot of
+// a field can be found from its address in slot 0
+#define PERCPU_UNIT 4096
+
+static inline unsigned int compat_nr_cpus(void) {
+    static unsigned int nr;
+    long n;
+
+    if (READ_ONCE(nr) == 0) {
+        n = sysconf(_SC_NPROCESSORS_CONF);
+        WRITE_ONCE(nr, n > 0 ? (unsigned int) n : 1);
+    }
+    return READ_ONCE(nr);
+}
+
+#define nr_cpu_ids compat_nr_cpus()
+#define num_online_cpus() compat_nr_cpus()
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++)
+
+// the slot of the calling thread, handed out round robin as threads first ask
+static inline unsigned int compat_this_cpu(void) {
+    static unsigned int next;
+    static __thread unsigned int slot = UINT_MAX;
+
+    if (unlikely(slot == UINT_MAX)) {
+        slot = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % nr_cpu_ids;
+    }
+    return slot;
+}
+
+#define alloc_percpu(type) ({ BUILD_BUG_ON(sizeof(type) > PERCPU_UNIT); (type *) calloc(nr_cpu_ids, PERCPU_UNIT); })
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) ((__typeof__(p)) ((char *) (p) + (size_t) (cpu) * PERCPU_UNIT))
+#define raw_cpu_ptr(p) per_cpu_ptr(p, compat_this_cpu())
+#define __this_cpu_field(x) ((__typeof__(&(x))) ((char *) &(x) + (size_t) compat_this_cpu() * PERCPU_UNIT))
+#define this_cpu_add(x, val) __atomic_fetch_add(__this_cpu_field(x), (val), __ATOMIC_RELAXED)
+#define this_cpu_inc(x) this_cpu_add(x, 1)
+
+// Red-black trees, the interface of <linux/rbtree.h>. The color is the low bit of the parent
+// pointer, so a node is three words like in the kernel.
+#define RB_RED 0
+#define RB_BLACK 1
+
+struct rb_node {
+    unsigned long __rb_parent_color;
+    struct rb_node *rb_right;
+    struct rb_node *rb_left;
+} __attribute__((aligned(sizeof(long))));
+
+struct rb_root {
+    struct rb_node *rb_node;
+};
+
+#define RB_ROOT ((struct rb_root) {NULL})
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+#define rb_parent(node) ((struct rb_node *) ((node)->__rb_parent_color & ~3UL))
+#define rb_color(node) ((int) ((node)->__rb_parent_color & 1))
+#define rb_is_red(node) ((node) != NULL && rb_color(node) == RB_RED)
+
+static inline void rb_set_parent(struct rb_node *node, struct rb_node *parent) {
+    node->__rb_parent_color = (unsigned long) parent | rb_color(node);
+}
+
+static inline void rb_set_color(struct rb_node *node, int color) {
+    node->__rb_parent_color = (node->__rb_parent_color & ~1UL) | color;
+}
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link) {
+    node->__rb_parent_color = (unsigned long) parent | RB_RED;
+    node->rb_left = node->rb_right = NULL;
+    *link = node;
+}
+
+// point whatever pointed to old, its parent or the root, at node
+static inline void rb_change_child(struct rb_node *old, struct rb_node *node, struct rb_node *parent,
+                                   struct rb_root *root) {
+    if (parent == NULL) {
+        root->rb_node = node;
+    } else if (parent->rb_left == old) {
+        parent->rb_left = node;
+    } else {
+        parent->rb_right = node;
+    }
+}
+
+static inline void rb_rotate_left(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *right = node->rb_right, *parent = rb_parent(node);
+
+    node->rb_right = right->rb_left;
+    if (right->rb_left != NULL) {
+        rb_set_parent(right->rb_left, node);
+    }
+    rb_set_parent(right, parent);
+    rb_change_child(node, right, parent, root);
+    right->rb_left = node;
+    rb_set_parent(node, right);
+}
+
+static inline void rb_rotate_right(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *left = node->rb_left, *parent = rb_parent(node);
+
+    node->rb_left = left->rb_right;
+    if (left->rb_right != NULL) {
+        rb_set_parent(left->rb_right, node);
+    }
+    rb_set_parent(left, parent);
+    rb_change_child(node, left, parent, root);
+    left->rb_right = node;
+    rb_set_parent(node, left);
+}
+
+// rebalance after rb_link_node() added node
+static inline void rb_insert_color(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *parent, *gparent, *uncle;
+
+    while ((parent = rb_parent(node)) != NULL && rb_color(parent) == RB_RED) {
+        gparent = rb_parent(parent);
+        if (parent == gparent->rb_left) {
+            uncle = gparent->rb_right;
+            if (rb_is_red(uncle)) {
+                rb_set_color(uncle, RB_BLACK);
+                rb_set_color(parent, RB_BLACK);
+                rb_set_color(gparent, RB_RED);
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_right) {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = rb_parent(node);
+            }
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(gparent, RB_RED);
+            rb_rotate_right(gparent, root);
+        } else {
+            uncle = gparent->rb_left;
+            if (rb_is_red(uncle)) {
+                rb_set_color(uncle, RB_BLACK);
+                rb_set_color(parent, RB_BLACK);
+                rb_set_color(gparent, RB_RED);
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_left) {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = rb_parent(node);
+            }
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(gparent, RB_RED);
+            rb_rotate_left(gparent, root);
+        }
+    }
+    rb_set_color(root->rb_node, RB_BLACK);
+}
+
+// restore the black heights after a black node was removed from under parent, node taking its place
+static inline void rb_erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root) {
+    struct rb_node *sibling;
+
+    while (node != root->rb_node && !rb_is_red(node)) {
+        if (node == parent->rb_left) {
+            sibling = parent->rb_right;
+            if (rb_is_red(sibling)) {
+                rb_set_color(sibling, RB_BLACK);
+                rb_set_color(parent, RB_RED);
+                rb_rotate_left(parent, root);
+                sibling = parent->rb_right;
+            }
+            if (!rb_is_red(sibling->rb_left) && !rb_is_red(sibling->rb_right)) {
+                rb_set_color(sibling, RB_RED);
+                node = parent;
+                parent = rb_parent(node);
+                continue;
+            }
+            if (!rb_is_red(sibling->rb_right)) {
+                rb_set_color(sibling->rb_left, RB_BLACK);
+                rb_set_color(sibling, RB_RED);
+                rb_rotate_right(sibling, root);
+                sibling = parent->rb_right;
+            }
+            rb_set_color(sibling, rb_color(parent));
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(sibling->rb_right, RB_BLACK);
+            rb_rotate_left(parent, root);
+        } else {
+            sibling = parent->rb_left;
+            if (rb_is_red(sibling)) {
+                rb_set_color(sibling, RB_BLACK);
+                rb_set_color(parent, RB_RED);
+                rb_rotate_right(parent, root);
+                sibling = parent->rb_left;
+            }
+            if (!rb_is_red(sibling->rb_left) && !rb_is_red(sibling->rb_right)) {
+                rb_set_color(sibling, RB_RED);
+                node = parent;
+                parent = rb_parent(node);
+                continue;
+            }
+            if (!rb_is_red(sibling->rb_left)) {
+                rb_set_color(sibling->rb_right, RB_BLACK);
+                rb_set_color(sibling, RB_RED);
+                rb_rotate_left(sibling, root);
+                sibling = parent->rb_left;
+            }
+            rb_set_color(sibling, rb_color(parent));
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(sibling->rb_left, RB_BLACK);
+            rb_rotate_right(parent, root);
+        }
+        node = root->rb_node;
+    }
+    if (node != NULL) {
+        rb_set_color(node, RB_BLACK);
+    }
+}
+
+static inline void rb_erase(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *child, *parent, *next;
+    int color;
+
+    if (node->rb_left != NULL && node->rb_right != NULL) {
+        // the next node has no left child, it takes the place of node and is removed from its own
+        next = node->rb_right;
+        while (next->rb_left != NULL) {
+            next = next->rb_left;
+        }
+        child = next->rb_right;
+        parent = rb_parent(next);
+        color = rb_color(next);
+        if (parent == node) {
+            parent = next;
+        } else {
+            if (child != NULL) {
+                rb_set_parent(child, parent);
+            }
+            parent->rb_left = child;
+            next->rb_right = node->rb_right;
+            rb_set_parent(node->rb_right, next);
+        }
+        next->__rb_parent_color = node->__rb_parent_color;
+        next->rb_left = node->rb_left;
+        rb_set_parent(node->rb_left, next);
+        rb_change_child(node, next, rb_parent(node), root);
+    } else {
+        child = node->rb_left != NULL ? node->rb_left : node->rb_right;
+        parent = rb_parent(node);
+        color = rb_color(node);
+        if (child != NULL) {
+            rb_set_parent(child, parent);
+        }
+        rb_change_child(node, child, parent, root);
+    }
+    if (color == RB_BLACK) {
+        rb_erase_color(child, parent, root);
+    }
+}
+
+// put node where victim is, without rebalancing, they must sort the same
+static inline void rb_replace_node(struct rb_node *victim, struct rb_node *node, struct rb_root *root) {
+    *node = *victim;
+    if (victim->rb_left != NULL) {
+        rb_set_parent(victim->rb_left, node);
+    }
+    if (victim->rb_right != NULL) {
+        rb_set_parent(victim->rb_right, node);
+    }
+    rb_change_child(victim, node, rb_parent(victim), root);
+}
+
+static inline struct rb_node *rb_first(const struct rb_root *root) {
+    struct rb_node *node = root->rb_node;
+
+    while (node != NULL && node->rb_left != NULL) {
+        node = node->rb_left;
+    }
+    return node;
+}
+
+static inline struct rb_node *rb_next(const struct rb_node *node) {
+    struct rb_node *parent;
+
+    if (node->rb_right != NULL) {
+        node = node->rb_right;
+        while (node->rb_left != NULL) {
+            node = node->rb_left;
+        }
+        return (struct rb_node *) node;
+    }
+    while ((parent = rb_parent(node)) != NULL && node == parent->rb_right) {
+        node = parent;
+    }
+    return parent;
+}
+
+// RCU. A reader publishes the grace period it started in, a grace period ends once no reader
+// is still in an older one.
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+struct rcu_reader {
+    u64 period;                  ///< The grace period its read-side critical section began in, 0 outside of one
+    unsigned int nesting;
+    struct rcu_reader *next;
+};
+
+#define RCU_BATCH 256            ///< call_rcu() callbacks run together after one grace period
+#define RCU_DELAY_MS 1           ///< How long a smaller batch waits for more callbacks
+
+/// Shared by every user of the library in the process
+struct rcu_state {
+    pthread_mutex_t lock;        ///< Serializes grace periods and the list of readers
+    pthread_mutex_t pendingLock;
+    struct rcu_reader *readers;
+    u64 period;                  ///< The current grace period, starts at 1
+    struct rcu_head *pending;    ///< call_rcu() callbacks waiting for a grace period
+    unsigned int nrPending;
+    pthread_cond_t wake;         ///< Tells the callback thread there are callbacks
+    pthread_cond_t done;         ///< Signalled as the callback thread finishes a batch
+    bool worker;                 ///< The callback thread was started
+    bool running;                ///< It runs a batch it took off pending
+    pthread_key_t key;           ///< Unregisters a thread's reader as it exits
+    pthread_once_t once;
+};
+
+extern struct rcu_state compat_rcu;
+extern __thread struct rcu_reader *compat_rcu_self;
+
+struct rcu_reader *compat_rcu_register(void);
+
+void synchronize_rcu(void);
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+void rcu_barrier(void);
+
+static inline void rcu_read_lock(void) {
+    struct rcu_reader *r = compat_rcu_self;
+
+    if (unlikely(r == NULL)) {
+        r = compat_rcu_register();
+    }
+    if (r->nesting++ == 0) {
+        __atomic_store_n(&r->period, __atomic_load_n(&compat_rcu.period, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);  // publish the period before reading any pointer
+    }
+}
+
+static inline void rcu_read_unlock(void) {
+    struct rcu_reader *r = compat_rcu_self;
+
+    if (--r->nesting == 0) {
+        __atomic_store_n(&r->period, 0, __ATOMIC_RELEASE);
+    }
+}
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_check(p, c) rcu_dereference(p)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+// Hash lists, the interface of <linux/rculist.h>
+struct hlist_node {
+    struct hlist_node *next;
+    struct hlist_node **pprev;
+};
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+#define INIT_HLIST_NODE(h) ((h)->next = NULL, (h)->pprev = NULL)
+#define hlist_first_rcu(head) (*((struct hlist_node **) (&(head)->first)))
+#define hlist_next_rcu(node) (*((struct hlist_node **) (&(node)->next)))
+
+static inline void hlist_add_head_rcu(struct hlist_node *n, struct hlist_head *h) {
+    struct hlist_node *first = h->first;
+
+    n->next = first;
+    n->pprev = &h->first;
+    rcu_assign_pointer(hlist_first_rcu(h), n);
+    if (first != NULL) {
+        first->pprev = &n->next;
+    }
+}
+
+static inline void hlist_del_rcu(struct hlist_node *n) {
+    struct hlist_node *next = n->next;
+    struct hlist_node **pprev = n->pprev;
+
+    WRITE_ONCE(*pprev, next);
+    if (next != NULL) {
+        next->pprev = pprev;
+    }
+    n->pprev = NULL;
+}
+
+static inline void hlist_replace_rcu(struct hlist_node *old, struct hlist_node *n) {
+    struct hlist_node *next = old->next;
+
+    n->next = next;
+    n->pprev = old->pprev;
+    rcu_assign_pointer(*n->pprev, n);
+    if (next != NULL) {
+        next->pprev = &n->next;
+    }
+    old->pprev = NULL;
+}
+
+// Tracepoints are a kernel feature
+static inline bool trace_ictredis_op_enabled(void) {
+    return false;
+}
+
+static inline void trace_ictredis_op(int op, const char *key, size_t key_len, long result, u64 duration_ns) {
+}
+
+// Without liblz4 nothing compresses, ictredis_init() refuses a compress_min_len
+#ifdef ICTREDIS_HAVE_LZ4
+#define LZ4_MEM_COMPRESS LZ4_sizeofState()
+#define LZ4_compress_default(src, dst, src_len, dst_cap, wrkmem) \
+    LZ4_compress_fast_extState(wrkmem, src, dst, src_len, dst_cap, 1)
+#else
+#define LZ4_MEM_COMPRESS 16384
+
+static inline int LZ4_compress_default(const char *src, char *dst, int src_len, int dst_cap, void *wrkmem) {
+    return 0;
+}
+
+static inline int LZ4_decompress_safe(const char *src, char *dst, int src_len, int dst_cap) {
+    return -1;
+}
+
+static inline int LZ4_decompress_safe_partial(const char *src, char *dst, int src_len, int target, int dst_cap) {
+    return -1;
+}
+#endif
+
+#endif //ICTREDIS_COMPAT_H
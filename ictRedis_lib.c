@@ -0,0 +1,386 @@
+/**
+ * @file   ictRedis_lib.c
+ * @brief  libictredis, see ictRedis_lib.h: the store engine of the LKM built for user space over
+ * ictRedis_compat.h, and the RCU that the compat layer leaves out of line.
+ */
+#include "ictRedis_store.h"
+
+// A store of the library, nobody is told about its changes
+struct ictredis {
+    Store store;
+};
+
+static void store_changed(Store *store, ModeWrite op, const char *key, size_t key_len, Element *e) {
+}
+
+// The engine has a few functions only the LKM calls
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+#include "ictRedis_store.c"
+
+#include "ictRedis_lib.h"
+
+struct rcu_state compat_rcu = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .pendingLock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+        .period = 1,
+        .once = PTHREAD_ONCE_INIT,
+};
+
+__thread struct rcu_reader *compat_rcu_self;  ///< The reader of the calling thread, once it has read
+
+static pthread_mutex_t engineLock = PTHREAD_MUTEX_INITIALIZER; ///< Serializes setting up the engine
+static bool engineReady;
+static struct ictredis_options engineDefaults; ///< The tunables as they were before the engine was first set up
+static bool defaultsSaved;
+
+// forget the reader of a thread as it exits
+static void rcu_reader_exit(void *arg) {
+    struct rcu_reader *r = (struct rcu_reader *) arg, **link;
+
+    pthread_mutex_lock(&compat_rcu.lock);
+    for (link = &compat_rcu.readers; *link != r; link = &(*link)->next) {
+    }
+    *link = r->next;
+    pthread_mutex_unlock(&compat_rcu.lock);
+    free(r);
+}
+
+static void rcu_key_init(void) {
+    if (pthread_key_create(&compat_rcu.key, rcu_reader_exit) != 0) {
+        abort();
+    }
+}
+
+// Add the calling thread to the readers grace periods wait for. A grace period in progress does
+// not wait for it, its first read-side critical section starts after the new period was set.
+struct rcu_reader *compat_rcu_register(void) {
+    struct rcu_reader *r = (struct rcu_reader *) calloc(1, sizeof(*r));
+
+    if (r == NULL) {
+        abort();                            // rcu_read_lock() can't fail
+    }
+    pthread_once(&compat_rcu.once, rcu_key_init);
+    pthread_mutex_lock(&compat_rcu.lock);
+    r->next = compat_rcu.readers;
+    compat_rcu.readers = r;
+    pthread_mutex_unlock(&compat_rcu.lock);
+    pthread_setspecific(compat_rcu.key, r);
+    compat_rcu_self = r;
+    return r;
+}
+
+// Start a new grace period and wait until no reader is left in an older one. Whatever was
+// unpublished before the call is then unreachable. Must not be called under rcu_read_lock().
+void synchronize_rcu(void) {
+    struct rcu_reader *r;
+    u64 period, seen;
+
+    pthread_mutex_lock(&compat_rcu.lock);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);   // the removals before the new period
+    period = compat_rcu.period + 1;
+    __atomic_store_n(&compat_rcu.period, period, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);   // pairs with the fence of rcu_read_lock()
+    for (r = compat_rcu.readers; r != NULL; r = r->next) {
+        while ((seen = __atomic_load_n(&r->period, __ATOMIC_ACQUIRE)) != 0 && seen < period) {
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&compat_rcu.lock);
+}
+
+// run callbacks once every reader that could still see what they free is done
+static void rcu_run(struct rcu_head *batch) {
+    struct rcu_head *next;
+
+    synchronize_rcu();
+    for (; batch != NULL; batch = next) {
+        next = batch->next;
+        batch->func(batch);
+    }
+}
+
+// The callback thread: takes the queued callbacks, RCU_BATCH of them or whatever queued up in
+// RCU_DELAY_MS, and runs them after one grace period
+static void *rcu_worker(void *arg) {
+    struct rcu_head *batch;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&compat_rcu.pendingLock);
+    for (;;) {
+        while (compat_rcu.pending == NULL) {
+            pthread_cond_wait(&compat_rcu.wake, &compat_rcu.pendingLock);
+        }
+        if (compat_rcu.nrPending < RCU_BATCH) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += RCU_DELAY_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&compat_rcu.wake, &compat_rcu.pendingLock, &deadline);
+            if (compat_rcu.pending == NULL) {
+                continue;                   // rcu_barrier() took them
+            }
+        }
+        batch = compat_rcu.pending;
+        compat_rcu.pending = NULL;
+        compat_rcu.nrPending = 0;
+        compat_rcu.running = true;
+        pthread_mutex_unlock(&compat_rcu.pendingLock);
+        rcu_run(batch);
+        pthread_mutex_lock(&compat_rcu.pendingLock);
+        compat_rcu.running = false;
+        pthread_cond_broadcast(&compat_rcu.done);
+    }
+    return NULL;
+}
+
+// Queue func to run after a grace period, on the callback thread, which is started by the
+// first call. Callers may be inside a read-side critical section or hold the locks the
+// callbacks take.
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    pthread_t thread;
+
+    head->func = func;
+    pthread_mutex_lock(&compat_rcu.pendingLock);
+    if (!compat_rcu.worker) {
+        if (pthread_create(&thread, NULL, rcu_worker, NULL) != 0) {
+            abort();                        // call_rcu() can't fail
+        }
+        pthread_detach(thread);
+        compat_rcu.worker = true;
+    }
+    head->next = compat_rcu.pending;
+    compat_rcu.pending = head;
+    if (++compat_rcu.nrPending == 1 || compat_rcu.nrPending == RCU_BATCH) {
+        pthread_cond_signal(&compat_rcu.wake);
+    }
+    pthread_mutex_unlock(&compat_rcu.pendingLock);
+}
+
+// run every queued callback now, and wait for those the callback thread is running
+void rcu_barrier(void) {
+    struct rcu_head *batch;
+
+    pthread_mutex_lock(&compat_rcu.pendingLock);
+    batch = compat_rcu.pending;
+    compat_rcu.pending = NULL;
+    compat_rcu.nrPending = 0;
+    while (compat_rcu.running) {
+        pthread_cond_wait(&compat_rcu.done, &compat_rcu.pendingLock);
+    }
+    pthread_mutex_unlock(&compat_rcu.pendingLock);
+    rcu_run(batch);
+}
+
+// set the tunables and the engine up, called with engineLock held
+static int engine_setup(const struct ictredis_options *options) {
+    int ret;
+
+    if (!defaultsSaved) {
+        engineDefaults.max_key_len = max_key_len;
+        engineDefaults.max_value_len = max_value_len;
+        engineDefaults.nr_shards = nr_shards;
+        engineDefaults.compress_min_len = compress_min_len;
+        defaultsSaved = true;
+    }
+    if (options != NULL) {
+#ifndef ICTREDIS_HAVE_LZ4
+        if (options->compress_min_len != 0) {
+            return -EOPNOTSUPP;
+        }
+#endif
+        max_key_len = options->max_key_len ? options->max_key_len : engineDefaults.max_key_len;
+        max_value_len = options->max_value_len ? options->max_value_len : engineDefaults.max_value_len;
+        nr_shards = options->nr_shards;
+        compress_min_len = options->compress_min_len;
+    }
+    ret = engine_init();
+    engineReady = ret == 0;
+    return ret;
+}
+
+int ictredis_init(const struct ictredis_options *options) {
+    int ret = -EBUSY;
+
+    pthread_mutex_lock(&engineLock);
+    if (!engineReady) {
+        ret = engine_setup(options);
+    }
+    pthread_mutex_unlock(&engineLock);
+    return ret;
+}
+
+void ictredis_exit(void) {
+    pthread_mutex_lock(&engineLock);
+    if (engineReady) {
+        rcu_barrier();                      // the queued frees use the element caches
+        engine_destroy();
+        max_key_len = engineDefaults.max_key_len;
+        max_value_len = engineDefaults.max_value_len;
+        nr_shards = engineDefaults.nr_shards;
+        compress_min_len = engineDefaults.compress_min_len;
+        engineReady = false;
+    }
+    pthread_mutex_unlock(&engineLock);
+}
+
+ictredis_t *ictredis_open(unsigned long max_memory) {
+    ictredis_t *db;
+    int ret = 0;
+
+    pthread_mutex_lock(&engineLock);
+    if (!engineReady) {
+        ret = engine_setup(NULL);
+    }
+    pthread_mutex_unlock(&engineLock);
+    if (ret < 0) {
+        errno = -ret;
+        return NULL;
+    }
+    db = (ictredis_t *) calloc(1, sizeof(*db));
+    if (db == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    ret = store_init(&db->store, max_memory);
+    if (ret < 0) {
+        store_destroy(&db->store);
+        free(db);
+        errno = -ret;
+        return NULL;
+    }
+    return db;
+}
+
+void ictredis_close(ictredis_t *db) {
+    if (db != NULL) {
+        store_destroy(&db->store);
+        free(db);
+    }
+}
+
+// a new element for key and value, with its time to live set
+static Element *lib_element(ictredis_t *db, const char *key, size_t key_len, const char *value, size_t value_len,
+                            uint32_t ttl_ms) {
+    Element *e = element_alloc(&db->store, key, key_len, value, value_len);
+
+    if (!IS_ERR(e)) {
+        element_set_ttl(e, ttl_ms);
+    }
+    return e;
+}
+
+int ictredis_push(ictredis_t *db, const char *key, size_t key_len, const char *value, size_t value_len,
+                  uint32_t ttl_ms) {
+    Element *e = lib_element(db, key, key_len, value, value_len, ttl_ms);
+    int ret;
+
+    if (IS_ERR(e)) {
+        return (int) PTR_ERR(e);
+    }
+    ret = store_push(&db->store, e);
+    if (ret < 0) {
+        element_free(e);
+    }
+    return ret;
+}
+
+int ictredis_edit(ictredis_t *db, const char *key, size_t key_len, const char *value, size_t value_len,
+                  uint32_t ttl_ms) {
+    Element *e = lib_element(db, key, key_len, value, value_len, ttl_ms);
+    int ret;
+
+    if (IS_ERR(e)) {
+        return (int) PTR_ERR(e);
+    }
+    ret = store_edit(&db->store, e);
+    if (ret < 0) {
+        element_free(e);
+    }
+    return ret;
+}
+
+int ictredis_delete(ictredis_t *db, const char *key, size_t key_len) {
+    return store_delete(&db->store, key, key_len);
+}
+
+ssize_t ictredis_get(ictredis_t *db, const char *key, size_t key_len, char *value, size_t size) {
+    return store_gets(&db->store, key, key_len, value, size, NULL);
+}
+
+ssize_t ictredis_gets(ictredis_t *db, const char *key, size_t key_len, char *value, size_t size,
+                      uint64_t *version) {
+    u64 stored = 0;
+    ssize_t ret = store_gets(&db->store, key, key_len, value, size, &stored);
+
+    if (version != NULL) {
+        *version = stored;
+    }
+    return ret;
+}
+
+ssize_t ictredis_getrange(ictredis_t *db, const char *key, size_t key_len, int64_t start, int64_t end, char *buf,
+                          uint64_t *value_len) {
+    u64 len = 0;
+    ssize_t ret = store_getrange(&db->store, key, key_len, start, end, buf, &len, NULL);
+
+    if (value_len != NULL) {
+        *value_len = len;
+    }
+    return ret;
+}
+
+int ictredis_incrby(ictredis_t *db, const char *key, size_t key_len, int64_t delta, int64_t *result) {
+    s64 sum;
+    int ret = store_incr(&db->store, key, key_len, delta, &sum);
+
+    if (ret == 0) {
+        *result = sum;
+    }
+    return ret;
+}
+
+int ictredis_cas(ictredis_t *db, const char *key, size_t key_len, const char *value, size_t value_len,
+                 uint32_t ttl_ms, uint64_t version, uint64_t *new_version) {
+    Element *e = lib_element(db, key, key_len, value, value_len, ttl_ms);
+    u64 stored;
+    int ret;
+
+    if (IS_ERR(e)) {
+        return (int) PTR_ERR(e);
+    }
+    ret = store_cas(&db->store, e, version, NULL, 0, &stored);
+    if (ret < 0) {
+        element_free(e);
+    } else if (new_version != NULL) {
+        *new_version = stored;
+    }
+    return ret;
+}
+
+void ictredis_sweep(ictredis_t *db) {
+    store_sweep(&db->store);
+}
+
+void ictredis_stats(ictredis_t *db, struct ictredis_stats *stats) {
+    unsigned int cpu, op, elements;
+    unsigned long memory;
+
+    memset(stats, 0, sizeof(*stats));
+    for_each_possible_cpu(cpu) {
+        CpuStats *s = per_cpu_ptr(db->store.stats, cpu);
+        for (op = 0; op < NR_OPS; op++) {
+            stats->done[op] += READ_ONCE(s->done[op]);
+            stats->failed[op] += READ_ONCE(s->failed[op]);
+        }
+        stats->evictions += READ_ONCE(s->evictions);
+        stats->expirations += READ_ONCE(s->expirations);
+    }
+    shards_totals(&db->store, &elements, &memory);
+    stats->elements = elements;
+    stats->memory_bytes = memory;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file   ictRedis_lib.h
+ * @brief  libictredis, the ictredis store engine linked into a process. It runs the same code as
+ * the LKM, the sharded RCU tables, eviction, expiry, versions and compression, on memory of the
+ * process, so every call is a function call and no system call: GET takes no lock at all, the
+ * writers only the lock of one shard.
+ *
+ * Every function may be called from any number of threads at once, except that a store must not
+ * be used while or after it is closed. Keys and values are byte strings with a length, they need
+ * no terminating NUL. The functions return 0 or a length on success and a negative errno as the
+ * device does: -ENOENT for a missing key, -EEXIST for a PUSH of an existing one, -ESTALE for a
+ * failed CAS, -E2BIG for a key or value over the configured limits, -ENOMEM.
+ */
+#ifndef ICTREDIS_LIB_H
+#define ICTREDIS_LIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// What every store of the process shares, the module parameters of the same names. 0 leaves
+/// the default.
+struct ictredis_options {
+    unsigned int max_key_len;       ///< Longest key, 250 bytes by default
+    unsigned int max_value_len;     ///< Longest value, 4096 bytes by default
+    unsigned int nr_shards;         ///< Shards of each store, the number of CPUs by default
+    unsigned int compress_min_len;  ///< Values at least this long are stored LZ4 compressed when that saves memory
+};
+
+/// The counters of one store, summed up when read
+struct ictredis_stats {
+    uint64_t elements;              ///< Keys stored
+    uint64_t memory_bytes;          ///< Bytes they take
+    uint64_t done[4];               ///< Successful PUSH, GET, EDIT and DELETE, by mode
+    uint64_t failed[4];             ///< and failed ones
+    uint64_t evictions;
+    uint64_t expirations;
+};
+
+typedef struct ictredis ictredis_t;
+
+/** @brief Set up the engine before the first store is opened. Without it ictredis_open() sets it
+ *  up with the defaults.
+ *  @param options NULL for the defaults
+ *  @return 0, -EBUSY if it was already set up, -EOPNOTSUPP for compression without liblz4, -ENOMEM
+ */
+int ictredis_init(const struct ictredis_options *options);
+
+/** @brief Free what ictredis_init() set up, once every store is closed */
+void ictredis_exit(void);
+
+/** @brief A new empty store
+ *  @param max_memory bytes its elements may take before the least recently used are evicted, 0 for no limit
+ *  @return the store, NULL with errno set on failure
+ */
+ictredis_t *ictredis_open(unsigned long max_memory);
+
+/** @brief Free a store and every key in it */
+void ictredis_close(ictredis_t *store);
+
+/// Store a new key, -EEXIST if it exists. The key expires ttl_ms from now, never if 0.
+int ictredis_push(ictredis_t *store, const char *key, size_t key_len, const char *value, size_t value_len,
+                  uint32_t ttl_ms);
+
+/// Replace the value of an existing key, -ENOENT if there is none
+int ictredis_edit(ictredis_t *store, const char *key, size_t key_len, const char *value, size_t value_len,
+                  uint32_t ttl_ms);
+
+int ictredis_delete(ictredis_t *store, const char *key, size_t key_len);
+
+/** @brief Copy the value of a key into the size bytes at value, followed by a NUL if there is room
+ *  @return the length of the value, which is only copied if it fits, or -ENOENT
+ */
+ssize_t ictredis_get(ictredis_t *store, const char *key, size_t key_len, char *value, size_t size);
+
+/// ictredis_get() that also sets the version of the value, for ictredis_cas()
+ssize_t ictredis_gets(ictredis_t *store, const char *key, size_t key_len, char *value, size_t size,
+                      uint64_t *version);
+
+/** @brief Copy the bytes start to end of the value of a key, both included, negative positions
+ *  counting from the end of the value. At most end - start + 1 bytes are written to buf, and
+ *  none past the end of the value.
+ *  @param buf NULL to only learn the length of the value
+ *  @param value_len set to the length of the whole value if not NULL
+ *  @return the number of bytes copied or -ENOENT
+ */
+ssize_t ictredis_getrange(ictredis_t *store, const char *key, size_t key_len, int64_t start, int64_t end, char *buf,
+                          uint64_t *value_len);
+
+/// Add delta to the decimal integer value of a key, a missing key counting as 0, and set result to the sum
+int ictredis_incrby(ictredis_t *store, const char *key, size_t key_len, int64_t delta, int64_t *result);
+
+/// Store the value only if the key still has the given version, 0 for a key that must not exist yet,
+/// and set new_version to the version it was stored with
+int ictredis_cas(ictredis_t *store, const char *key, size_t key_len, const char *value, size_t value_len,
+                 uint32_t ttl_ms, uint64_t version, uint64_t *new_version);
+
+/// Drop expired keys nobody looked up, a few buckets of every shard per call. Lookups already
+/// drop the ones they run into, the LKM does this every second.
+void ictredis_sweep(ictredis_t *store);
+
+void ictredis_stats(ictredis_t *store, struct ictredis_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ICTREDIS_LIB_H
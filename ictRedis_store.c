@@ -0,0 +1,1175 @@
+/**
+ * @file   ictRedis_store.c
+ * @brief  The store engine, see ictRedis_store.h. Not built on its own: ictRedis.c includes it
+ * into the LKM and ictRedis_lib.c into libictredis, each after defining store_changed().
+ */
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/printk.h>
+#include <linux/err.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/overflow.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/jiffies.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/bitmap.h>
+#include <linux/lz4.h>
+
+#include "ictRedis_trace.h"
+#endif
+
+#include "ictRedis_store.h"
+
+static unsigned int max_key_len = 250;
+module_param(max_key_len, uint, 0444);
+MODULE_PARM_DESC(max_key_len, "The longest key accepted, in bytes (default 250)");
+
+static unsigned int max_value_len = 4096;
+module_param(max_value_len, uint, 0444);
+MODULE_PARM_DESC(max_value_len, "The longest value accepted, in bytes (default 4096)");
+
+/// Elements are allocated from the smallest of these caches that fits them. The classes are a
+/// quarter of a power of two apart, so at most a fifth of an element is padding. The smallest
+/// one holds the header and a short key and value.
+static const unsigned int element_sizes[] = {
+        112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 896,
+        1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+};
+
+static unsigned int compress_min_len;
+module_param(compress_min_len, uint, 0444);
+MODULE_PARM_DESC(compress_min_len, "Values of at least this many bytes are stored LZ4 compressed when that makes "
+                                   "them take less memory, 0 to never compress (default 0)");
+
+static unsigned int nr_shards;
+module_param(nr_shards, uint, 0444);
+MODULE_PARM_DESC(nr_shards, "Number of independently locked shards of the keyspace (default the number of CPUs)");
+
+#define NR_SIZE_CLASSES ARRAY_SIZE(element_sizes)
+
+static struct kmem_cache *element_caches[NR_SIZE_CLASSES];
+static char element_cache_names[NR_SIZE_CLASSES][24];
+
+static Compressor __percpu *compressors; ///< NULL unless compress_min_len is set
+static u32 hash_seed;                    ///< Random seed so that bucket placement is not predictable
+
+/// Operations are only timed while this is on or the ictredis_op tracepoint is enabled
+static DEFINE_STATIC_KEY_FALSE(latency_enabled);
+
+
+// Set up what every store shares: the hash seed, the shard count, the element caches and the
+// compressors. The tunables above must be set by then.
+static int engine_init(void) {
+    get_random_bytes(&hash_seed, sizeof(hash_seed));
+    if (nr_shards == 0) {
+        nr_shards = num_online_cpus();
+    }
+    if (element_caches_init() < 0) {
+        printk(KERN_ALERT "ICTRedis failed to create the element caches\n");
+        return -ENOMEM;
+    }
+    if (compressors_init() < 0) {
+        element_caches_destroy();
+        printk(KERN_ALERT "ICTRedis failed to allocate the compressors\n");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// once every store is destroyed
+static void engine_destroy(void) {
+    compressors_destroy();
+    element_caches_destroy();
+}
+
+// An empty store whose elements may take max_memory bytes, 0 for no limit
+static int store_init(Store *store, unsigned long max_memory) {
+    store->maxMemory = max_memory;
+    mutex_init(&store->txnMutex);
+    store->stats = alloc_percpu(CpuStats);
+    if (store->stats == NULL) {
+        return -ENOMEM;
+    }
+    return shards_init(store);
+}
+
+// Free every stored element, and what store_init() set up even if it stopped half way. Nobody
+// may be using the store any more.
+static void store_destroy(Store *store) {
+    shards_destroy(store);
+    free_percpu(store->stats);
+    store->stats = NULL;
+}
+
+// One run of the expiry sweep over the shards of a store. Lookups already drop the expired keys
+// they run into, this catches the ones nobody asks for. It looks at SWEEP_BUCKETS buckets of every
+// shard, taking its lock for SWEEP_BATCH of them at a time, so foreground operations wait for a
+// few buckets at most and a big table is covered over several runs.
+static void store_sweep(Store *store) {
+    unsigned int i, done;
+
+    for (i = 0; i < nr_shards; i++) {
+        Shard *s = &store->shards[i];
+        for (done = 0; done < SWEEP_BUCKETS && READ_ONCE(s->nr_expiring) != 0; done += SWEEP_BATCH) {
+            mutex_lock(&s->lock);
+            s->sweep_cursor = table_expire(s, s->sweep_cursor, SWEEP_BATCH);
+            mutex_unlock(&s->lock);
+            cond_resched();
+        }
+    }
+}
+
+// order two keys the way the ordered index does: bytewise, a prefix before the longer key
+static int key_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int ret = memcmp(a, b, min(a_len, b_len));
+    return ret != 0 ? ret : (a_len > b_len) - (a_len < b_len);
+}
+
+// add e to the ordered index of s, called with the shard lock held
+static void order_insert(Shard *s, Element *e) {
+    struct rb_node **link = &s->order.rb_node, *parent = NULL;
+
+    while (*link != NULL) {
+        Element *other = rb_entry(*link, Element, order);
+        parent = *link;
+        if (key_cmp(element_key(e), e->key_len, element_key(other), other->key_len) < 0) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+    rb_link_node(&e->order, parent, link);
+    rb_insert_color(&e->order, &s->order);
+}
+
+// the first element of s whose key comes after from, or is from unless exclusive
+static struct rb_node *order_lower_bound(Shard *s, const char *from, size_t from_len, bool exclusive) {
+    struct rb_node *node = s->order.rb_node, *found = NULL;
+
+    while (node != NULL) {
+        Element *e = rb_entry(node, Element, order);
+        int cmp = key_cmp(element_key(e), e->key_len, from, from_len);
+        if (cmp > 0 || (cmp == 0 && !exclusive)) {
+            found = node;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    return found;
+}
+
+// make e expire ttl_ms from now, or never if it is 0
+static void element_set_ttl(Element *e, u32 ttl_ms) {
+    e->expires = ttl_ms ? get_jiffies_64() + msecs_to_jiffies(ttl_ms) : 0;
+}
+
+static bool element_expired(Element *e) {
+    return e->expires != 0 && time_after_eq64(get_jiffies_64(), e->expires);
+}
+
+// the time e has left to live, at least 1 ms, or 0 if it does not expire
+static u32 element_ttl_ms(Element *e) {
+    u64 now = get_jiffies_64();
+
+    if (e->expires == 0) {
+        return 0;
+    }
+    return time_after_eq64(now, e->expires) ? 1 : max(jiffies_to_msecs(e->expires - now), 1U);
+}
+
+static char *element_key(Element *e) {
+    return e->data;
+}
+
+// the stored_len bytes of the value, compressed or not
+static char *element_value(Element *e) {
+    return e->data + e->key_len + 1;
+}
+
+static bool element_compressed(Element *e) {
+    return e->stored_len < e->value_len;
+}
+
+// the bytes an element of the given lengths takes, including the padding of its size class
+static size_t element_bytes(size_t key_len, size_t stored_len) {
+    size_t size = offsetof(Element, data) + key_len + 1 + stored_len + 1;
+    unsigned int size_class = 0;
+
+    while (size_class < NR_SIZE_CLASSES && element_sizes[size_class] < size) {
+        size_class++;
+    }
+    return size_class < NR_SIZE_CLASSES ? element_sizes[size_class] : size;
+}
+
+// the bytes an element really takes, including the padding of its size class
+static size_t element_footprint(Element *e) {
+    if (e->size_class < NR_SIZE_CLASSES) {
+        return element_sizes[e->size_class];
+    }
+    return offsetof(Element, data) + e->key_len + 1 + e->stored_len + 1;
+}
+
+// allocate an element from the smallest size class that fits it, ERR_PTR() on failure.
+// Only the header is filled in, the caller copies the key and value and sets the hash.
+static Element *element_new(size_t key_len, size_t value_len) {
+    size_t size = offsetof(Element, data) + key_len + 1 + value_len + 1;
+    unsigned int size_class = 0;
+    Element *e;
+
+    if (key_len > max_key_len || value_len > max_value_len) {
+        return ERR_PTR(-E2BIG);
+    }
+
+    while (size_class < NR_SIZE_CLASSES && element_sizes[size_class] < size) {
+        size_class++;
+    }
+    if (size_class < NR_SIZE_CLASSES) {
+        e = (Element *) kmem_cache_alloc(element_caches[size_class], GFP_KERNEL);
+    } else {
+        e = (Element *) kvmalloc(size, GFP_KERNEL);
+    }
+    if (e == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    INIT_HLIST_NODE(&e->node[0]);
+    INIT_HLIST_NODE(&e->node[1]);
+    e->expires = 0;
+    e->key_len = key_len;
+    e->value_len = value_len;
+    e->stored_len = value_len;
+    e->size_class = size_class;
+    element_key(e)[key_len] = '\0';
+    element_value(e)[value_len] = '\0';
+    return e;
+}
+
+static Element *element_alloc(Store *store, const char *key, size_t key_len, const char *value, size_t value_len) {
+    Element *e = element_new(key_len, value_len);
+    if (IS_ERR(e)) {
+        return e;
+    }
+    memcpy(element_key(e), key, key_len);
+    memcpy(element_value(e), value, value_len);
+    e->hash = hash_key(element_key(e), key_len);     // hash the copy, the source may be shared with user space
+    return element_compress(store, e);               // and compress it for the same reason
+}
+
+// Lock the compressor of the current CPU. The task that held it last may have been preempted
+// or have moved away, it is still only a short wait.
+static Compressor *compressor_get(void) {
+    Compressor *c = raw_cpu_ptr(compressors);
+
+    mutex_lock(&c->lock);
+    return c;
+}
+
+static void compressor_put(Compressor *c) {
+    mutex_unlock(&c->lock);
+}
+
+// Return an element holding the value of e LZ4 compressed, and free e, if the value is at least
+// compress_min_len bytes long and compressing it moves the element to a smaller size class.
+// Otherwise e is returned as it is. Called on new elements before the store takes any lock.
+static Element *element_compress(Store *store, Element *e) {
+    Element *packed = NULL;
+    Compressor *c;
+    u64 start;
+    int len;
+
+    if (compressors == NULL || e->value_len == 0 || e->value_len < compress_min_len) {
+        return e;
+    }
+    c = compressor_get();
+    start = ktime_get_ns();
+    len = LZ4_compress_default(element_value(e), c->buf, e->value_len, e->value_len - 1, c->wrkmem);
+    if (len > 0 && element_bytes(e->key_len, len) < element_footprint(e)) {
+        packed = element_new(e->key_len, len);
+    }
+    if (!IS_ERR_OR_NULL(packed)) {
+        memcpy(element_key(packed), element_key(e), e->key_len);
+        memcpy(element_value(packed), c->buf, len);
+        packed->value_len = e->value_len;
+        packed->hash = e->hash;
+    }
+    this_cpu_add(store->stats->compress_ns, ktime_get_ns() - start);
+    compressor_put(c);
+    if (IS_ERR_OR_NULL(packed)) {
+        this_cpu_inc(store->stats->incompressible);  // out of memory for the smaller copy too, e does fine
+        return e;
+    }
+    this_cpu_inc(store->stats->compressed);
+    this_cpu_add(store->stats->compress_in, e->value_len);
+    this_cpu_add(store->stats->compress_out, len);
+    element_free(e);
+    return packed;
+}
+
+// Copy the first count bytes of the value of e to buf, expanding it if it is compressed. LZ4
+// does not sleep, so this works under rcu_read_lock() as well as under the shard lock.
+static void element_read_value(Store *store, Element *e, char *buf, size_t count) {
+    u64 start;
+    int len;
+
+    if (!element_compressed(e)) {
+        memcpy(buf, element_value(e), count);
+        return;
+    }
+    if (count == 0) {
+        return;
+    }
+    start = ktime_get_ns();
+    if (count == e->value_len) {
+        len = LZ4_decompress_safe(element_value(e), buf, e->stored_len, count);
+    } else {
+        len = LZ4_decompress_safe_partial(element_value(e), buf, e->stored_len, count, count);
+    }
+    WARN_ON_ONCE(len < (int) count);            // the store compressed it, it can't be corrupt
+    this_cpu_inc(store->stats->decompressed);
+    this_cpu_add(store->stats->decompress_ns, ktime_get_ns() - start);
+}
+
+// whether the value of e is the len bytes at value, called with the shard lock held
+static bool element_value_equals(Store *store, Element *e, const char *value, size_t len) {
+    Compressor *c;
+    bool equal;
+
+    if (e->value_len != len) {
+        return false;
+    }
+    if (!element_compressed(e)) {
+        return memcmp(element_value(e), value, len) == 0;
+    }
+    c = compressor_get();
+    element_read_value(store, e, c->buf, len);
+    equal = memcmp(c->buf, value, len) == 0;
+    compressor_put(c);
+    return equal;
+}
+
+// The scratch space of compression, only allocated if compress_min_len is set
+static int compressors_init(void) {
+    unsigned int cpu;
+
+    if (compress_min_len == 0) {
+        return 0;
+    }
+    compressors = alloc_percpu(Compressor);
+    if (compressors == NULL) {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        Compressor *c = per_cpu_ptr(compressors, cpu);
+        mutex_init(&c->lock);
+        c->wrkmem = kvmalloc_node(LZ4_MEM_COMPRESS, GFP_KERNEL, cpu_to_node(cpu));
+        c->buf = (char *) kvmalloc_node(max_t(size_t, max_value_len, 1), GFP_KERNEL, cpu_to_node(cpu));
+        if (c->wrkmem == NULL || c->buf == NULL) {
+            compressors_destroy();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void compressors_destroy(void) {
+    unsigned int cpu;
+
+    if (compressors == NULL) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        kvfree(per_cpu_ptr(compressors, cpu)->wrkmem);
+        kvfree(per_cpu_ptr(compressors, cpu)->buf);
+    }
+    free_percpu(compressors);
+    compressors = NULL;
+}
+
+static void element_free(Element *e) {
+    if (e->size_class < NR_SIZE_CLASSES) {
+        kmem_cache_free(element_caches[e->size_class], e);
+    } else {
+        kvfree(e);
+    }
+}
+
+static void element_free_rcu(struct rcu_head *head) {
+    element_free(container_of(head, Element, rcu));
+}
+
+static int element_caches_init(void) {
+    unsigned int i;
+
+    BUILD_BUG_ON(offsetof(Element, data) + 2 > 112);
+    for (i = 0; i < NR_SIZE_CLASSES; i++) {
+        snprintf(element_cache_names[i], sizeof(element_cache_names[i]), "ictredis_element_%u",
+                 element_sizes[i]);
+        element_caches[i] = kmem_cache_create(element_cache_names[i], element_sizes[i], 0, 0, NULL);
+        if (element_caches[i] == NULL) {
+            element_caches_destroy();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void element_caches_destroy(void) {
+    unsigned int i;
+
+    for (i = 0; i < NR_SIZE_CLASSES; i++) {
+        kmem_cache_destroy(element_caches[i]);      // NULL is fine
+        element_caches[i] = NULL;
+    }
+}
+
+// hash of a key, the low bits select the bucket
+static u32 hash_key(const char *key, size_t key_len) {
+    return jhash(key, key_len, hash_seed);
+}
+
+// the bucket a hash falls into in table t
+static struct hlist_head *bucket_of(Table *t, u32 hash) {
+    return &t->buckets[hash & ((1U << t->bits) - 1)];
+}
+
+// the element owning a bucket link of table t
+static Element *link_to_element(struct hlist_node *pos, Table *t) {
+    return container_of(pos - t->link, Element, node[0]);
+}
+
+// the shard owning a hash. The high bits pick the shard, the low ones pick the bucket inside it
+static Shard *shard_of(Store *store, u32 hash) {
+    return &store->shards[reciprocal_scale(hash, nr_shards)];
+}
+
+// Called either under rcu_read_lock() or with the shard lock held. The returned
+// element is only valid until the read-side critical section or the lock ends.
+static Element *findKey(Shard *s, const char *key, size_t key_len, u32 hash) {
+    Table *t;
+    struct hlist_node *pos;
+    Element *e;
+    if (key == NULL) {
+        return NULL;
+    }
+
+    t = table_dereference(s, s->table);
+    for (pos = table_dereference(s, hlist_first_rcu(bucket_of(t, hash)));
+         pos != NULL;
+         pos = table_dereference(s, hlist_next_rcu(pos))) {
+        e = link_to_element(pos, t);
+        if (e->hash == hash && e->key_len == key_len && memcmp(element_key(e), key, key_len) == 0) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+// allocate an empty table of (1 << bits) buckets for s chained through element link `link`
+static Table *table_alloc(Shard *s, unsigned int bits, int link) {
+    Table *t = kvzalloc(struct_size(t, buckets, 1U << bits), GFP_KERNEL);
+    if (t == NULL) {
+        return NULL;
+    }
+    t->bits = bits;
+    t->link = link;
+    t->shard = s;
+    return t;
+}
+
+static int table_init(Shard *s, unsigned int bits) {
+    Table *t = table_alloc(s, bits, 0);
+    if (t == NULL) {
+        return -ENOMEM;
+    }
+    mutex_init(&s->lock);
+    RCU_INIT_POINTER(s->table, t);
+    s->order = RB_ROOT;
+    s->nr_elements = 0;
+    s->nr_expiring = 0;
+    s->memory_used = 0;
+    s->clock_hand = 0;
+    s->sweep_cursor = 0;
+    s->retiring = false;
+    return 0;
+}
+
+// publish a new element, called with the shard lock held
+static void table_insert(Shard *s, Element *e) {
+    Table *t = table_dereference(s, s->table);
+
+    e->referenced = 0;                  // it has to be read before the hand comes around to be kept
+    e->version = ++s->version;
+    hlist_add_head_rcu(&e->node[t->link], bucket_of(t, e->hash));
+    order_insert(s, e);
+    s->nr_elements++;
+    s->nr_expiring += e->expires != 0;
+    s->memory_used += element_footprint(e);
+    table_evict(s, e);
+    if (s->nr_elements > (1U << t->bits)) {
+        // keep the load factor at or below one element per bucket, catching up at once
+        // on the inserts made while a resize had to wait
+        table_reserve(s, s->nr_elements);
+    }
+}
+
+// swap e in for old, which has the same key, called with the shard lock held.
+// Readers see either the old or the new element, never a half-written value.
+static void table_replace(Shard *s, Element *old, Element *e) {
+    Table *t = table_dereference(s, s->table);
+
+    e->referenced = READ_ONCE(old->referenced);
+    e->version = ++s->version;
+    hlist_replace_rcu(&old->node[t->link], &e->node[t->link]);
+    rb_replace_node(&old->order, &e->order, &s->order);
+    s->nr_expiring += (e->expires != 0) - (old->expires != 0);
+    s->memory_used += element_footprint(e);
+    s->memory_used -= element_footprint(old);
+    call_rcu(&old->rcu, element_free_rcu);
+    table_evict(s, e);
+}
+
+// CLOCK eviction, called with the shard lock held. The hand sweeps the buckets: a
+// referenced element gets its bit cleared and a second chance, an unreferenced one is
+// removed, until the elements fit in the shard's part of max_memory again. keep, the
+// element just stored, is never evicted, even if it alone is over the budget.
+// GET only sets the bit, so it stays lockless. The sweep ends: after one lap every
+// bit it passed is clear.
+static void table_evict(Shard *s, Element *keep) {
+    Table *t = table_dereference(s, s->table);
+    unsigned long limit = READ_ONCE(s->store->maxMemory) / nr_shards;
+    struct hlist_node *pos, *next;
+    Element *e;
+
+    while (limit != 0 && s->memory_used > limit && s->nr_elements > 1) {
+        struct hlist_head *bucket = &t->buckets[s->clock_hand & ((1UL << t->bits) - 1)];
+        for (pos = table_dereference(s, hlist_first_rcu(bucket)); pos != NULL; pos = next) {
+            next = table_dereference(s, hlist_next_rcu(pos));
+            e = link_to_element(pos, t);
+            if (e == keep) {
+                continue;
+            }
+            if (element_expired(e)) {
+                table_drop(s, e, true);
+            } else if (READ_ONCE(e->referenced)) {
+                WRITE_ONCE(e->referenced, 0);
+                continue;
+            } else {
+                table_drop(s, e, false);
+            }
+            if (s->memory_used <= limit) {
+                return;                 // the rest of the bucket is looked at next time
+            }
+        }
+        s->clock_hand++;
+    }
+}
+
+// unlink and free an element, called with the shard lock held.
+// Unlinking from the bucket leaves every other element where it is.
+static void table_remove(Shard *s, Element *e) {
+    Table *t = table_dereference(s, s->table);
+
+    hlist_del_rcu(&e->node[t->link]);
+    rb_erase(&e->order, &s->order);
+    s->nr_elements--;
+    s->nr_expiring -= e->expires != 0;
+    s->memory_used -= element_footprint(e);
+    call_rcu(&e->rcu, element_free_rcu);
+}
+
+// Remove an element the store lets go of by itself, expired or evicted, called with the shard
+// lock held. The log and the watchers see it as a DELETE of its key.
+static void table_drop(Shard *s, Element *e, bool expired) {
+    store_changed(s->store, DELETE, element_key(e), e->key_len, NULL);
+    table_remove(s, e);
+    if (expired) {
+        this_cpu_inc(s->store->stats->expirations);
+    } else {
+        this_cpu_inc(s->store->stats->evictions);
+    }
+}
+
+// Remove the expired elements of the buckets [from, from + count), called with
+// the shard lock held. Returns the bucket to continue from.
+static unsigned long table_expire(Shard *s, unsigned long from, unsigned int count) {
+    Table *t = table_dereference(s, s->table);
+    unsigned long mask = (1UL << t->bits) - 1;
+    struct hlist_node *pos, *next;
+    Element *e;
+
+    for (; count > 0; count--, from++) {
+        for (pos = table_dereference(s, hlist_first_rcu(&t->buckets[from & mask])); pos != NULL; pos = next) {
+            next = table_dereference(s, hlist_next_rcu(pos));
+            e = link_to_element(pos, t);
+            if (element_expired(e)) {
+                table_drop(s, e, true);
+            }
+        }
+    }
+    return from & mask;
+}
+
+// Make the table of s big enough for count elements in one step, called with the shard lock held
+static void table_reserve(Shard *s, unsigned long count) {
+    Table *t = table_dereference(s, s->table);
+    unsigned int bits = t->bits;
+
+    while (bits < TABLE_MAX_BITS && (1UL << bits) < count) {
+        bits++;
+    }
+    if (bits > t->bits) {
+        table_grow(s, bits);
+    }
+}
+
+// Give the table (1 << bits) buckets, called with the shard lock held. Every element is
+// chained into the new table through its other link, so readers still walking the
+// old table are not disturbed. The old table is freed by call_rcu() once they are all
+// done, which also makes its links free for the next resize: until then the shard
+// keeps the table it has and a later insert grows it.
+// If the bigger table can't be allocated the old one stays in use: lookups are
+// still correct, the chains just get longer.
+static void table_grow(Shard *s, unsigned int bits) {
+    Table *old_table = table_dereference(s, s->table);
+    Table *new_table;
+    struct hlist_node *pos;
+    unsigned int i;
+
+    if (smp_load_acquire(&s->retiring)) {
+        return;
+    }
+    new_table = table_alloc(s, bits, !old_table->link);
+    if (new_table == NULL) {
+        printk(KERN_ALERT "ICTRedis: failed to grow a shard to %u buckets\n", 1U << bits);
+        return;
+    }
+
+    for (i = 0; i < (1U << old_table->bits); i++) {
+        for (pos = table_dereference(s, hlist_first_rcu(&old_table->buckets[i]));
+             pos != NULL;
+             pos = table_dereference(s, hlist_next_rcu(pos))) {
+            Element *e = link_to_element(pos, old_table);
+            hlist_add_head_rcu(&e->node[new_table->link], bucket_of(new_table, e->hash));
+        }
+    }
+    rcu_assign_pointer(s->table, new_table);
+    s->retiring = true;
+    call_rcu(&old_table->rcu, table_free_rcu);
+}
+
+// free a table replaced by table_grow() and let its shard resize again
+static void table_free_rcu(struct rcu_head *head) {
+    Table *t = container_of(head, Table, rcu);
+
+    smp_store_release(&t->shard->retiring, false);
+    kvfree(t);
+}
+
+// free every element and the buckets, no reader or writer can be left
+static void table_destroy(Shard *s) {
+    Table *t = rcu_dereference_protected(s->table, 1);
+    struct hlist_node *pos, *next;
+    unsigned int i;
+
+    if (t == NULL) {
+        return;
+    }
+    for (i = 0; i < (1U << t->bits); i++) {
+        for (pos = t->buckets[i].first; pos != NULL; pos = next) {
+            next = pos->next;
+            element_free(link_to_element(pos, t));
+        }
+    }
+    kvfree(t);
+    RCU_INIT_POINTER(s->table, NULL);
+    mutex_destroy(&s->lock);
+    s->nr_elements = 0;
+    s->nr_expiring = 0;
+    s->memory_used = 0;
+}
+
+// Allocate the nr_shards shards of a store, each with a small table of its own. The shard
+// count is fixed once the engine is set up, a key always hashes to the same shard.
+static int shards_init(Store *store) {
+    unsigned int i;
+
+    store->shards = (Shard *) kcalloc(nr_shards, sizeof(Shard), GFP_KERNEL);
+    if (store->shards == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < nr_shards; i++) {
+        store->shards[i].store = store;
+        if (table_init(&store->shards[i], INITIAL_TABLE_BITS) < 0) {
+            shards_destroy(store);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void shards_destroy(Store *store) {
+    unsigned int i;
+
+    if (store->shards == NULL) {
+        return;
+    }
+    for (i = 0; i < nr_shards; i++) {
+        table_destroy(&store->shards[i]);   // shards past a failed table_init() have none
+    }
+    rcu_barrier();                          // wait for the call_rcu() frees of edited and deleted elements
+                                            // and of replaced tables, which still write to their shard
+    kfree(store->shards);
+    store->shards = NULL;
+}
+
+// sum of the shard counters, read without the locks so it may be a moment old
+static void shards_totals(Store *store, unsigned int *elements, unsigned long *memory) {
+    unsigned int i;
+
+    *elements = 0;
+    *memory = 0;
+    for (i = 0; i < nr_shards; i++) {
+        *elements += READ_ONCE(store->shards[i].nr_elements);
+        *memory += READ_ONCE(store->shards[i].memory_used);
+    }
+}
+
+// start timing an operation, 0 when nobody is looking
+static u64 stats_start(void) {
+    if (static_branch_unlikely(&latency_enabled) || trace_ictredis_op_enabled()) {
+        return ktime_get_ns();
+    }
+    return 0;
+}
+
+// count an operation, and if it was timed add it to the histogram and the trace
+static void stats_end(Store *store, ModeWrite op, const char *key, size_t key_len, long result, u64 start) {
+    u64 duration;
+
+    if (result < 0) {
+        this_cpu_inc(store->stats->failed[op]);
+    } else {
+        this_cpu_inc(store->stats->done[op]);
+    }
+    if (start == 0) {
+        return;
+    }
+    duration = ktime_get_ns() - start;
+    if (static_branch_unlikely(&latency_enabled)) {
+        this_cpu_inc(store->stats->latency[op][min_t(u64, duration ? ilog2(duration) : 0, NR_LATENCY_BUCKETS - 1)]);
+    }
+    trace_ictredis_op(op, key, key_len, result, duration);
+}
+
+// findKey() for writers, called with the shard lock held. An expired element found on the
+// way is removed, as if it had already been swept.
+static Element *findUnexpired(Shard *s, const char *key, size_t key_len, u32 hash) {
+    Element *e = findKey(s, key, key_len, hash);
+
+    if (e != NULL && element_expired(e)) {
+        table_drop(s, e, true);
+        return NULL;
+    }
+    return e;
+}
+
+// Add e unless its key exists, -EEXIST then and the caller still owns e.
+// Once e is in the table it can be deleted and freed as soon as the lock is dropped,
+// so it is accounted for before that.
+static int store_push(Store *store, Element *e) {
+    u64 start = stats_start();
+    Shard *s = shard_of(store, e->hash);
+
+    mutex_lock(&s->lock);
+    if (findUnexpired(s, element_key(e), e->key_len, e->hash) != NULL) {
+        mutex_unlock(&s->lock);
+        stats_end(store, PUSH, element_key(e), e->key_len, -EEXIST, start);
+        return -EEXIST;
+    }
+    table_insert(s, e);
+    store_changed(store, PUSH, element_key(e), e->key_len, e);
+    stats_end(store, PUSH, element_key(e), e->key_len, 0, start);
+    mutex_unlock(&s->lock);
+    return 0;
+}
+
+// replace the element with the key of e, -ENOENT if there is none and the caller still owns e
+static int store_edit(Store *store, Element *e) {
+    u64 start = stats_start();
+    Shard *s = shard_of(store, e->hash);
+    Element *found;
+
+    mutex_lock(&s->lock);
+    found = findUnexpired(s, element_key(e), e->key_len, e->hash);
+    if (found == NULL) {
+        mutex_unlock(&s->lock);
+        stats_end(store, EDIT, element_key(e), e->key_len, -ENOENT, start);
+        return -ENOENT;
+    }
+    table_replace(s, found, e);
+    store_changed(store, EDIT, element_key(e), e->key_len, e);
+    stats_end(store, EDIT, element_key(e), e->key_len, 0, start);
+    mutex_unlock(&s->lock);
+    return 0;
+}
+
+// store e whether its key exists or not, the caller no longer owns e
+static int store_set(Store *store, Element *e) {
+    u64 start = stats_start();
+    Shard *s = shard_of(store, e->hash);
+    Element *found;
+    ModeWrite op;
+
+    mutex_lock(&s->lock);
+    found = findUnexpired(s, element_key(e), e->key_len, e->hash);
+    op = found != NULL ? EDIT : PUSH;
+    if (found != NULL) {
+        table_replace(s, found, e);
+    } else {
+        table_insert(s, e);
+    }
+    store_changed(store, op, element_key(e), e->key_len, e);
+    stats_end(store, op, element_key(e), e->key_len, 0, start);
+    mutex_unlock(&s->lock);
+    return 0;
+}
+
+static int store_delete(Store *store, const char *key, size_t key_len) {
+    u64 start = stats_start();
+    u32 hash = hash_key(key, key_len);
+    Shard *s = shard_of(store, hash);
+    Element *found;
+    int ret = 0;
+
+    mutex_lock(&s->lock);
+    found = findUnexpired(s, key, key_len, hash);
+    if (found == NULL) {
+        ret = -ENOENT;
+    } else {
+        table_remove(s, found);
+        store_changed(store, DELETE, key, key_len, NULL);
+    }
+    mutex_unlock(&s->lock);
+    stats_end(store, DELETE, key, key_len, ret, start);
+    return ret;
+}
+
+// Add delta to the decimal integer held by key, a missing key counting as 0, and store the sum
+// in result. The key keeps its TTL. -EINVAL if the value is not an integer, -ERANGE if the sum
+// overflows.
+static int store_incr(Store *store, const char *key, size_t key_len, s64 delta, s64 *result) {
+    u64 start = stats_start();
+    u32 hash = hash_key(key, key_len);
+    Shard *s = shard_of(store, hash);
+    Element *found, *e = NULL;
+    char number[24];
+    const char *digits = NULL;
+    s64 old = 0;
+    int ret = 0;
+
+    mutex_lock(&s->lock);
+    found = findUnexpired(s, key, key_len, hash);
+    if (found != NULL && !element_compressed(found)) {
+        digits = element_value(found);
+    } else if (found != NULL && found->value_len < sizeof(number)) {
+        // only a long run of the same digits compresses, expanded it still has to be parsed
+        element_read_value(store, found, number, found->value_len);
+        number[found->value_len] = '\0';
+        digits = number;
+    }
+    if (found != NULL && (digits == NULL || kstrtos64(digits, 10, &old) < 0)) {
+        ret = -EINVAL;
+    } else if (check_add_overflow(old, delta, result)) {
+        ret = -ERANGE;
+    } else {
+        e = element_alloc(store, key, key_len, number, scnprintf(number, sizeof(number), "%lld", *result));
+        ret = PTR_ERR_OR_ZERO(e);
+    }
+    if (ret == 0) {
+        e->expires = found != NULL ? found->expires : 0;
+        if (found != NULL) {
+            table_replace(s, found, e);
+        } else {
+            table_insert(s, e);
+        }
+        store_changed(store, found != NULL ? EDIT : PUSH, key, key_len, e);
+    }
+    mutex_unlock(&s->lock);
+    stats_end(store, found != NULL ? EDIT : PUSH, key, key_len, ret, start);
+    return ret;
+}
+
+// Store e only if its key still has the given version, 0 standing for a missing key, or, if
+// expected is set, still holds the expected_len bytes at expected. The version e was stored
+// with is set in new_version. -ESTALE if the key changed, -ENOENT if it is missing or -EEXIST
+// if it was created, the caller then still owns e.
+static int store_cas(Store *store, Element *e, u64 version, const char *expected, size_t expected_len, u64 *new_version) {
+    u64 start = stats_start();
+    Shard *s = shard_of(store, e->hash);
+    Element *found;
+    int ret = 0;
+
+    mutex_lock(&s->lock);
+    found = findUnexpired(s, element_key(e), e->key_len, e->hash);
+    if (found == NULL) {
+        ret = expected == NULL && version == 0 ? 0 : -ENOENT;
+    } else if (expected != NULL) {
+        if (!element_value_equals(store, found, expected, expected_len)) {
+            ret = -ESTALE;
+        }
+    } else if (found->version != version) {
+        ret = version == 0 ? -EEXIST : -ESTALE;
+    }
+    if (ret == 0) {
+        if (found != NULL) {
+            table_replace(s, found, e);
+        } else {
+            table_insert(s, e);
+        }
+        store_changed(store, found != NULL ? EDIT : PUSH, element_key(e), e->key_len, e);
+        *new_version = e->version;
+    }
+    stats_end(store, found != NULL ? EDIT : PUSH, element_key(e), e->key_len, ret, start);
+    mutex_unlock(&s->lock);
+    return ret;
+}
+
+// whether the key of cmds[j] exists just before cmds[j] runs: the last earlier command on the
+// same key decides, otherwise the store does. Called with the shard lock of the key held.
+static bool txn_key_exists(Store *store, TxnCmd *cmds, unsigned int j) {
+    Element *e = cmds[j].e;
+    unsigned int i;
+
+    for (i = j; i-- > 0;) {
+        Element *other = cmds[i].e;
+        if (other->hash == e->hash && other->key_len == e->key_len &&
+            memcmp(element_key(other), element_key(e), e->key_len) == 0) {
+            return cmds[i].op != DELETE;
+        }
+    }
+    return findUnexpired(shard_of(store, e->hash), element_key(e), e->key_len, e->hash) != NULL;
+}
+
+// apply one checked command with the shard lock of its key held, the element is consumed
+static void txn_apply(Store *store, TxnCmd *cmd, u64 start) {
+    Element *e = cmd->e;
+    Shard *s = shard_of(store, e->hash);
+    Element *found = findUnexpired(s, element_key(e), e->key_len, e->hash);
+    ModeWrite op;
+
+    cmd->e = NULL;
+    if (cmd->op == DELETE) {
+        if (found != NULL) {
+            table_remove(s, found);
+            store_changed(store, DELETE, element_key(e), e->key_len, NULL);
+        }
+        stats_end(store, DELETE, element_key(e), e->key_len, 0, start);
+        element_free(e);
+        return;
+    }
+    // found can only be missing for EDIT if an earlier command of the transaction evicted it
+    op = found != NULL ? EDIT : PUSH;
+    if (found != NULL) {
+        table_replace(s, found, e);
+    } else {
+        table_insert(s, e);
+    }
+    store_changed(store, op, element_key(e), e->key_len, e);
+    stats_end(store, op, element_key(e), e->key_len, 0, start);
+}
+
+// count a command of a transaction that was not applied, an MSET as an EDIT
+static void txn_failed(Store *store, TxnCmd *cmd, u64 start) {
+    ModeWrite op = cmd->op == PUSH || cmd->op == DELETE ? cmd->op : EDIT;
+
+    stats_end(store, op, element_key(cmd->e), cmd->e->key_len, cmd->result, start);
+}
+
+// Run n commands all-or-nothing: the locks of every shard they touch are held together while
+// each is checked against the store and the commands before it, and only if none fails are
+// they applied. Each command's result is left in its result, -ECANCELED for those that would
+// have succeeded in a failed transaction. Lockless GETs may see some of the changes before
+// the others while they are applied.
+// Shard locks are only ever taken several at a time under txnMutex and in increasing order,
+// so transactions can't deadlock with each other or with single-key writers.
+static int store_exec(Store *store, TxnCmd *cmds, unsigned int n) {
+    unsigned long *locked = bitmap_zalloc(nr_shards, GFP_KERNEL);
+    u64 start = stats_start();
+    unsigned int i, j;
+    bool failed = false;
+
+    if (locked == NULL) {
+        for (j = 0; j < n; j++) {
+            cmds[j].result = -ENOMEM;
+            txn_failed(store, &cmds[j], start);
+        }
+        return -ENOMEM;
+    }
+    for (j = 0; j < n; j++) {
+        set_bit(reciprocal_scale(cmds[j].e->hash, nr_shards), locked);
+    }
+    mutex_lock(&store->txnMutex);
+    for_each_set_bit(i, locked, nr_shards) {
+        mutex_lock_nest_lock(&store->shards[i].lock, &store->txnMutex);
+    }
+
+    for (j = 0; j < n; j++) {
+        bool exists = txn_key_exists(store, cmds, j);
+        if (cmds[j].op == PUSH) {
+            cmds[j].result = exists ? -EEXIST : 0;
+        } else if (cmds[j].op == EDIT || cmds[j].op == DELETE) {
+            cmds[j].result = exists ? 0 : -ENOENT;
+        } else {
+            cmds[j].result = 0;         // MSET sets the key either way
+        }
+        failed |= cmds[j].result < 0;
+    }
+    if (!failed) {
+        for (j = 0; j < n; j++) {
+            txn_apply(store, &cmds[j], start);
+        }
+    }
+
+    for_each_set_bit(i, locked, nr_shards) {
+        mutex_unlock(&store->shards[i].lock);
+    }
+    mutex_unlock(&store->txnMutex);
+    bitmap_free(locked);
+
+    if (failed) {
+        for (j = 0; j < n; j++) {
+            if (cmds[j].result == 0) {
+                cmds[j].result = -ECANCELED;
+            }
+            txn_failed(store, &cmds[j], start);
+        }
+        return -ECANCELED;
+    }
+    return 0;
+}
+
+// Copy the value of key into the size bytes at value, followed by a NUL if there is room.
+// Nothing is copied if the value does not fit. The copy is made inside the read-side critical
+// section, copying to user space may fault and sleep so it has to happen afterwards.
+// Returns the value length or -ENOENT. An expired key is a miss, and since it was found it is
+// removed right away instead of waiting for the sweep.
+static ssize_t store_get(Store *store, const char *key, size_t key_len, char *value, size_t size) {
+    return store_gets(store, key, key_len, value, size, NULL);
+}
+
+// store_get() that also returns the version of the element read, if version is set
+static ssize_t store_gets(Store *store, const char *key, size_t key_len, char *value, size_t size, u64 *version) {
+    u64 start = stats_start();
+    u32 hash = hash_key(key, key_len);
+    Shard *s = shard_of(store, hash);
+    Element *found;
+    ssize_t value_len = -ENOENT;
+    bool expired = false;
+
+    rcu_read_lock();
+    found = findKey(s, key, key_len, hash);
+    if (found != NULL && element_expired(found)) {
+        expired = true;
+    } else if (found != NULL) {
+        if (!READ_ONCE(found->referenced)) {
+            WRITE_ONCE(found->referenced, 1);   // skip the store when it is set, the line stays shared
+        }
+        value_len = found->value_len;
+        if (version != NULL) {
+            *version = found->version;
+        }
+        if (value_len <= size) {
+            element_read_value(store, found, value, value_len);
+        }
+        if (value_len < size) {
+            value[value_len] = '\0';
+        }
+    }
+    rcu_read_unlock();
+    if (expired) {
+        mutex_lock(&s->lock);
+        findUnexpired(s, key, key_len, hash);
+        mutex_unlock(&s->lock);
+    }
+    stats_end(store, GET, key, key_len, value_len, start);
+    return value_len;
+}
+
+// Copy the bytes start to end, both included, of the value of key to buf, and set value_len to
+// the length of the whole value if it is given. Negative positions count from the end of the
+// value. Returns the number of bytes copied, or none and -ENOENT if the key does not exist.
+// With buf NULL nothing is copied. Only the range is copied, however long the value is. LZ4
+// can only expand a value from its start, so a range of a compressed value that does not start
+// at 0 is expanded whole into cache, unless it is there already, or without a cache up to the
+// end of the range in the buffer of a compressor, and then copied.
+static ssize_t store_getrange(Store *store, const char *key, size_t key_len, s64 start, s64 end, char *buf, u64 *value_len,
+                              RangeCache *cache) {
+    u64 begin = stats_start();
+    u32 hash = hash_key(key, key_len);
+    Shard *s = shard_of(store, hash);
+    Compressor *c = NULL;
+    Element *found;
+    ssize_t count = -ENOENT;
+    bool expired = false;
+    s64 len;
+
+    if (buf != NULL && start != 0 && compress_min_len != 0 && cache == NULL) {
+        c = compressor_get();           // it sleeps, so before rcu_read_lock()
+    }
+    rcu_read_lock();
+    found = findKey(s, key, key_len, hash);
+    if (found != NULL && element_expired(found)) {
+        expired = true;
+    } else if (found != NULL) {
+        if (!READ_ONCE(found->referenced)) {
+            WRITE_ONCE(found->referenced, 1);
+        }
+        len = found->value_len;
+        if (value_len != NULL) {
+            *value_len = len;
+        }
+        start = start < 0 ? max_t(s64, start + len, 0) : start;
+        end = end < 0 ? end + len : min_t(s64, end, len - 1);
+        count = start <= end ? end - start + 1 : 0;
+        if (count > 0 && buf != NULL && element_compressed(found) && start == 0) {
+            element_read_value(store, found, buf, count);
+        } else if (count > 0 && buf != NULL && element_compressed(found) && cache != NULL) {
+            if (cache->shard != s || cache->version != found->version) {
+                element_read_value(store, found, cache->buf, len);
+                cache->shard = s;
+                cache->version = found->version;
+            }
+            memcpy(buf, cache->buf + start, count);
+        } else if (count > 0 && buf != NULL && element_compressed(found)) {
+            element_read_value(store, found, c->buf, end + 1);
+            memcpy(buf, c->buf + start, count);
+        } else if (count > 0 && buf != NULL) {
+            memcpy(buf, element_value(found) + start, count);
+        }
+    }
+    rcu_read_unlock();
+    if (c != NULL) {
+        compressor_put(c);
+    }
+    if (expired) {
+        mutex_lock(&s->lock);
+        findUnexpired(s, key, key_len, hash);
+        mutex_unlock(&s->lock);
+    }
+    stats_end(store, GET, key, key_len, count, begin);
+    return count;
+}
+
@@ -0,0 +1,270 @@
+/**
+ * @file   ictRedis_store.h
+ * @brief  The store engine of ictredis: sharded RCU hash tables of elements with an ordered
+ * index, CLOCK eviction, expiry, versions, compression and transactions. It knows nothing of
+ * devices or files, so the same code runs in the LKM, which includes ictRedis_store.c into
+ * ictRedis.c, and in user space, where ictRedis_lib.c builds it over ictRedis_compat.h into
+ * libictredis.
+ *
+ * Every function is static to the file including the engine. That file also defines
+ * store_changed(), which the engine calls for every change it makes.
+ */
+#ifndef ICTREDIS_STORE_H
+#define ICTREDIS_STORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
+#include <linux/rbtree.h>
+#include <linux/cache.h>
+#include <linux/percpu.h>
+#else
+#include "ictRedis_compat.h"
+#endif
+
+#include "ictRedis.h"
+
+#define INITIAL_TABLE_BITS 4     ///< The hash table starts with 16 buckets and doubles as it fills
+#define TABLE_MAX_BITS 30        ///< A snapshot load does not presize a table past this
+#define NR_OPS 4                 ///< PUSH, GET, EDIT and DELETE are counted separately
+#define NR_LATENCY_BUCKETS 32    ///< Bucket n of a latency histogram counts durations of [2^n, 2^(n+1)) ns
+#define SWEEP_BUCKETS 1024       ///< Buckets the sweep looks at per run
+#define SWEEP_BATCH 64           ///< Buckets it looks at per hold of the lock
+
+typedef enum mode_write_e ModeWrite;
+
+/// Elements are never modified once they are visible to readers: EDIT publishes a new
+/// element in place of the old one and frees the old one after an RCU grace period.
+/// The key and value are stored right after the header, so an element is only as big as its data
+/// rounded up to the nearest size class. A long value is stored LZ4 compressed when that puts the
+/// element in a smaller size class.
+struct element_t {
+    struct hlist_node node[2];   ///< Bucket links, a resize chains the element into the new table with the other one
+    struct rcu_head rcu;         ///< Defers the free until lockless readers are done with the element
+    u64 expires;                 ///< jiffies64 at which the key expires, 0 if it never does
+    u64 version;                 ///< Given by the shard when the element is stored, CAS compares it
+    struct rb_node order;        ///< Place in the ordered index of its shard, only used under the shard lock
+    u32 hash;                    ///< hash_key() of the key, saves rehashing it on lookups and resizes
+    u32 key_len;                 ///< Length of the key without its terminating NUL
+    u32 value_len;               ///< Length of the value without its terminating NUL
+    u32 stored_len;              ///< Bytes the value takes in data, less than value_len if it is compressed
+    u8 size_class;               ///< The cache it was allocated from, NR_SIZE_CLASSES if it is too big for any
+    u8 referenced;               ///< Set by GET, cleared by the eviction clock hand as it passes
+    char data[];                 ///< The NUL-terminated key immediately followed by the NUL-terminated value,
+                                 ///< or the compressed value without a NUL
+};
+
+
+typedef struct element_t Element;
+
+typedef struct shard_t Shard;
+
+/// The bucket array, replaced as a whole when it grows so readers always see a matching size
+struct table_t {
+    unsigned int bits;           ///< The table has (1 << bits) buckets
+    int link;                    ///< Which of the element node[] links chains this table
+    Shard *shard;                ///< The shard it belongs to
+    struct rcu_head rcu;         ///< Frees it once a resize replaced it and its readers are done
+    struct hlist_head buckets[];
+};
+
+typedef struct table_t Table;
+
+typedef struct store_t Store;
+
+/// A slice of the keyspace selected by key hash, with its own lock, table and accounting, so
+/// writers of different shards never touch the same lock or cache lines
+struct shard_t {
+    struct mutex lock;           ///< Serializes the writers of this shard, GET only takes rcu_read_lock()
+    Table __rcu *table;          ///< The hash buckets holding the elements of this shard
+    struct rb_root order;        ///< The same elements sorted by key, for SCAN
+    unsigned int nr_elements;    ///< The number of elements currently stored
+    unsigned int nr_expiring;    ///< Elements with a TTL, the sweep skips the shard while there are none
+    unsigned long memory_used;   ///< Bytes allocated for the stored elements
+    unsigned long clock_hand;    ///< The bucket eviction looks at next
+    unsigned long sweep_cursor;  ///< The bucket the expiry sweep looks at next
+    bool retiring;               ///< The table the last resize replaced is not freed yet, readers may still
+                                 ///< follow its link, so the shard can't resize again
+    u64 version;                 ///< The last version given to an element, versions start at 1
+    Store *store;                ///< The store the shard belongs to
+} ____cacheline_aligned_in_smp;
+
+/// The counters of one CPU, summed up when they are read
+struct cpu_stats_t {
+    u64 done[NR_OPS];            ///< Operations that succeeded, hits for GET
+    u64 failed[NR_OPS];          ///< Operations that found the key missing, or existing for PUSH
+    u64 latency[NR_OPS][NR_LATENCY_BUCKETS];
+    u64 evictions;               ///< Elements dropped to stay within max_memory
+    u64 expirations;             ///< Elements dropped because their TTL ran out
+    u64 compressed;              ///< Values stored compressed
+    u64 incompressible;          ///< Values long enough to compress that were stored as they are
+    u64 compress_in;             ///< Bytes of the compressed values before compression
+    u64 compress_out;            ///< and after
+    u64 compress_ns;             ///< Time spent compressing, values that did not shrink included
+    u64 decompressed;            ///< Reads that expanded a compressed value
+    u64 decompress_ns;
+};
+
+typedef struct cpu_stats_t CpuStats;
+
+/// The scratch space of LZ4, one per CPU. Its user holds the mutex, so it may sleep or move to
+/// another CPU while using it.
+struct compressor_t {
+    struct mutex lock;
+    void *wrkmem;                ///< LZ4_MEM_COMPRESS bytes of match table
+    char *buf;                   ///< max_value_len bytes, for a compressed value or an expanded one
+};
+
+typedef struct compressor_t Compressor;
+
+/// A compressed value expanded whole by store_getrange() for one reader, so that reading a long
+/// value a range at a time expands it once rather than once per range
+struct range_cache_t {
+    char *buf;                   ///< max_value_len bytes
+    Shard *shard;                ///< The shard and version of the value in buf, NULL while there is none
+    u64 version;                 ///< A shard never gives two values the same version
+};
+
+typedef struct range_cache_t RangeCache;
+
+/// One keyspace: its shards, the lock for holding several of them, its memory budget and its
+/// statistics. A database of the LKM embeds one, so does a handle of libictredis.
+struct store_t {
+    Shard *shards;               ///< nr_shards shards, each holding the keys that hash to it
+    struct mutex txnMutex;       ///< Held by whoever holds more than one shard lock of the store
+    unsigned long maxMemory;     ///< Bytes its elements may take before they are evicted, 0 for no limit
+    CpuStats __percpu *stats;    ///< Per-CPU operation counters and latency histograms
+};
+
+/// One command of a MULTI ... EXEC transaction or one key of an MSET, waiting to be applied
+struct txn_cmd_t {
+    int op;                      ///< PUSH, EDIT, DELETE, or MSET to set the key whether it exists or not
+    int result;                  ///< Set by store_exec()
+    Element *e;                  ///< The new element, for DELETE only holding the key. NULL once applied
+};
+
+typedef struct txn_cmd_t TxnCmd;
+
+/// Dereference the table of shard s or a bucket link either as a lockless reader or as the writer.
+/// Each shard lock is only held for the duration of a single operation on that shard, so any
+/// number of processes can keep the device open and write to different shards at the same time.
+#define table_dereference(s, p) rcu_dereference_check(p, lockdep_is_held(&(s)->lock))
+
+// Defined by the includer: publish a change made with the shard lock of the key held. e is the
+// element stored, NULL for DELETE.
+static void store_changed(Store *store, ModeWrite op, const char *key, size_t key_len, Element *e);
+
+static int engine_init(void);
+
+static void engine_destroy(void);
+
+static int store_init(Store *store, unsigned long max_memory);
+
+static void store_destroy(Store *store);
+
+static void store_sweep(Store *store);
+
+static int key_cmp(const char *a, size_t a_len, const char *b, size_t b_len);
+
+static void order_insert(Shard *s, Element *e);
+
+static struct rb_node *order_lower_bound(Shard *s, const char *from, size_t from_len, bool exclusive);
+
+static void element_set_ttl(Element *e, u32 ttl_ms);
+
+static bool element_expired(Element *e);
+
+static u32 element_ttl_ms(Element *e);
+
+static Element *element_new(size_t key_len, size_t value_len);
+
+static Element *element_alloc(Store *store, const char *key, size_t key_len, const char *value, size_t value_len);
+
+static Element *element_compress(Store *store, Element *e);
+
+static bool element_compressed(Element *e);
+
+static void element_read_value(Store *store, Element *e, char *buf, size_t count);
+
+static bool element_value_equals(Store *store, Element *e, const char *value, size_t len);
+
+static Compressor *compressor_get(void);
+
+static void compressor_put(Compressor *c);
+
+static int compressors_init(void);
+
+static void compressors_destroy(void);
+
+static void element_free(Element *e);
+
+static char *element_key(Element *e);
+
+static char *element_value(Element *e);
+
+static int element_caches_init(void);
+
+static void element_caches_destroy(void);
+
+static Element *findKey(Shard *s, const char *key, size_t key_len, u32 hash);
+
+static u32 hash_key(const char *key, size_t key_len);
+
+static Shard *shard_of(Store *store, u32 hash);
+
+static Element *link_to_element(struct hlist_node *pos, Table *t);
+
+static int table_init(Shard *s, unsigned int bits);
+
+static void table_insert(Shard *s, Element *e);
+
+static void table_replace(Shard *s, Element *old, Element *e);
+
+static void table_remove(Shard *s, Element *e);
+
+static void table_drop(Shard *s, Element *e, bool expired);
+
+static unsigned long table_expire(Shard *s, unsigned long from, unsigned int count);
+
+static void table_grow(Shard *s, unsigned int bits);
+
+static void table_free_rcu(struct rcu_head *head);
+
+static void table_reserve(Shard *s, unsigned long count);
+
+static void table_evict(Shard *s, Element *keep);
+
+static Element *findUnexpired(Shard *s, const char *key, size_t key_len, u32 hash);
+
+static void table_destroy(Shard *s);
+
+static int shards_init(Store *store);
+
+static void shards_destroy(Store *store);
+
+static void shards_totals(Store *store, unsigned int *elements, unsigned long *memory);
+
+static int store_push(Store *store, Element *e);
+
+static int store_edit(Store *store, Element *e);
+
+static int store_set(Store *store, Element *e);
+
+static int store_delete(Store *store, const char *key, size_t key_len);
+
+static ssize_t store_get(Store *store, const char *key, size_t key_len, char *value, size_t size);
+
+static ssize_t store_gets(Store *store, const char *key, size_t key_len, char *value, size_t size, u64 *version);
+
+static int store_incr(Store *store, const char *key, size_t key_len, s64 delta, s64 *result);
+
+static ssize_t store_getrange(Store *store, const char *key, size_t key_len, s64 start, s64 end, char *buf,
+                              u64 *value_len, RangeCache *cache);
+
+static int store_cas(Store *store, Element *e, u64 version, const char *expected, size_t expected_len,
+                     u64 *new_version);
+
+static int store_exec(Store *store, TxnCmd *cmds, unsigned int n);
+
+#endif //ICTREDIS_STORE_H
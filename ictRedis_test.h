@@ -0,0 +1,68 @@
+/**
+ * @file   ictRedis_test.h
+ * @brief  What the tests run by ctest share: the CHECK macro, the exit status of a skipped test,
+ * the prefix that names the keys of a run and the check for the device.
+ *
+ * The tests work on keys of their own, named after the test and the process and deleted again,
+ * so they can run against a module that is in use. Tests that need the loaded module are skipped,
+ * not failed, when the device cannot be opened.
+ */
+#ifndef ICTREDIS_TEST_H
+#define ICTREDIS_TEST_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+#include <atomic>
+#endif
+
+#define DEVICE_PATH "/dev/ictredis"
+#define SKIPPED 77                          ///< The exit status ctest counts as a skipped test
+
+static char prefix[32];                     ///< In front of every key, tells the keys of this run apart
+
+#ifdef __cplusplus
+static std::atomic<int> failures(0);        ///< Failed checks, of any thread
+#else
+static int failures;                        ///< Failed checks
+#endif
+
+// report a failed check of what is under test, NULL if it goes without saying; the tests go on
+#define CHECK_IN(what, cond)                                                              \
+    do {                                                                                  \
+        if (!(cond)) {                                                                    \
+            test_failed(__FILE__, __LINE__, (what), #cond);                               \
+        }                                                                                 \
+    } while (0)
+
+#define CHECK(cond) CHECK_IN(NULL, cond)
+
+static inline void test_failed(const char *file, int line, const char *what, const char *cond) {
+    if (what != NULL) {
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", file, line, what, cond);
+    } else {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+    }
+    failures++;
+}
+
+// "<test>:<pid>:" in front of the keys of this run
+static inline void test_prefix(const char *test) {
+    snprintf(prefix, sizeof(prefix), "%s:%ld:", test, (long) getpid());
+}
+
+// Open the device, or say why its tests are skipped and return -1
+static inline int test_open_device(const char *device) {
+    int fd = open(device, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0) {
+        printf("%s: skipped, %s\n", device, strerror(errno));
+    }
+    return fd;
+}
+
+#endif //ICTREDIS_TEST_H
@@ -0,0 +1,48 @@
+/**
+ * @file   ictRedis_trace.h
+ * @brief  Tracepoints of the ictredis LKM. They cost a patched-out branch until enabled with
+ * echo 1 > /sys/kernel/tracing/events/ictredis/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ictredis
+
+#if !defined(_ICTREDIS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ICTREDIS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/// One PUSH, GET, EDIT or DELETE, from whichever interface it came
+TRACE_EVENT(ictredis_op,
+
+        TP_PROTO(int op, const char *key, size_t key_len, long result, u64 duration_ns),
+
+        TP_ARGS(op, key, key_len, result, duration_ns),
+
+        TP_STRUCT__entry(
+                __field(int, op)
+                __dynamic_array(char, key, key_len + 1)
+                __field(long, result)
+                __field(u64, duration_ns)
+        ),
+
+        TP_fast_assign(
+                __entry->op = op;
+                memcpy(__get_dynamic_array(key), key, key_len);
+                ((char *) __get_dynamic_array(key))[key_len] = '\0';
+                __entry->result = result;
+                __entry->duration_ns = duration_ns;
+        ),
+
+        TP_printk("op=%s key=%s result=%ld duration_ns=%llu",
+                  __print_symbolic(__entry->op, { 0, "PUSH" }, { 1, "GET" }, { 2, "EDIT" }, { 3, "DELETE" }),
+                  __get_str(key), __entry->result, __entry->duration_ns)
+);
+
+#endif /* _ICTREDIS_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ictRedis_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,1119 @@
+/**
+ * @file   server.c
+ * @brief  ictredis_server, a Redis protocol (RESP) front end of the ictredis LKM, so that Redis
+ * clients and tools such as redis-benchmark work with the store unchanged. It serves GET, SET
+ * (with EX, PX, NX and XX), SETNX, SETEX, PSETEX, MGET, MSET, DEL, UNLINK, EXISTS, STRLEN, INCR,
+ * DECR, INCRBY, DECRBY, PING, ECHO, SELECT 0 and QUIT, sent as RESP arrays or inline. COMMAND
+ * and CONFIG answer an empty array, which is all redis-benchmark and redis-cli need of them.
+ *
+ * Usage: ictredis_server [-p port] [-b address] [-s unix_socket] [-w workers] [-D device]
+ *
+ * It listens on 127.0.0.1:6379 by default, -p 0 turns TCP off when -s gives a Unix socket.
+ * There is one worker thread per CPU, each with its own epoll loop, descriptor of the device and
+ * submission ring, and every connection stays with the worker that accepted it. A worker reads
+ * every connection that is ready, parses every whole command in what it read, pipelined or not,
+ * and queues their keys in its ring, so one ICTREDIS_IOC_RING_ENTER runs the commands of all of
+ * them. The replies go back in the order of the commands of each connection. INCR and the other
+ * commands the rings don't carry are an ioctl() each.
+ */
+#define _GNU_SOURCE                         // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ictRedis.h"
+
+#define DEVICE_PATH "/dev/ictredis"
+#define PARAMETERS_PATH "/sys/module/ictRedis/parameters/"
+#define DEFAULT_PORT 6379
+#define RING_ENTRIES 1024                  ///< Submission ring of each worker, the most keys one ring enter runs
+#define RING_MIN_DATA (4 * 1024 * 1024)    ///< Data area of each ring, at least if the module allows it
+#define MAX_ITEMS (2 * RING_ENTRIES)       ///< Replies waiting for one ring enter, MGET array headers included
+#define MAX_EVENTS 256
+#define MAX_ARGS 4096                      ///< Most arguments of one command
+#define MAX_INLINE (64 * 1024)             ///< Longest inline command
+#define MAX_REQUEST (64 * 1024 * 1024)     ///< Most bytes of one command
+#define READ_CHUNK 16384
+#define OUT_LIMIT (4 * 1024 * 1024)        ///< Replies a client has not read before it is no longer read from
+
+/// How the part of a reply that waits for a ring entry is written once the entry ran
+enum reply_e {
+    R_GET,                                 ///< A bulk string or nil, for GET and each key of MGET
+    R_ARRAY,                               ///< The header of an MGET array, no entry
+    R_SET,                                 ///< +OK if a SET stored the value, nil if NX or XX refused it
+    R_SETNX,                               ///< :1 or :0 for the PUSH of a SETNX
+    R_MSET,                                ///< +OK once the chain of an MSET stored every key
+    R_COUNT,                               ///< The number of keys found, for DEL
+    R_EXISTS,                              ///< The number of keys found by a GET into no buffer
+    R_STRLEN,                              ///< The length of the value found by a GET into no buffer
+};
+
+#define ITEM_FIRST 1                       ///< The first item of a reply made of several entries
+#define ITEM_LAST 2                        ///< and the last one, which writes the reply
+
+struct buf_t {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/// A client connection, or a listening socket
+struct conn_t {
+    int fd;
+    int listener;                          ///< A listening socket, accepted from rather than read
+    struct buf_t in;                       ///< Bytes read and not yet run as a command
+    size_t parsed;                         ///< Bytes of in run while reading, dropped after
+    struct buf_t out;                      ///< Replies not yet written
+    size_t sent;                           ///< Bytes of out already written
+    unsigned int queued;                   ///< Items of its replies waiting for the ring
+    uint32_t events;                       ///< What epoll waits for
+    int closing;                           ///< Closed once the ring has run and the replies are written
+    int quit;                              ///< QUIT, a protocol error or the end of the input, nothing more is read
+    int dirty;                             ///< On the dirty list of its worker
+    int accErr;                            ///< Accumulated over the entries of a reply made of several
+    long long accCount;
+    struct conn_t *nextDirty;
+};
+
+/// A part of a reply waiting for the ring
+struct item_t {
+    struct conn_t *conn;
+    uint8_t reply;                         ///< enum reply_e
+    uint8_t flags;                         ///< ITEM_FIRST, ITEM_LAST
+    int sqe;                               ///< The entry it waits for, -1 for none
+    long arg;                              ///< The length of an R_ARRAY
+};
+
+struct arg_t {
+    const char *p;
+    size_t len;
+};
+
+struct worker_t {
+    pthread_t thread;
+    int epfd;
+    int fd;                                ///< Descriptor of the device, with the rings
+    struct ictredis_ring *ring;
+    struct ictredis_sqe *sqes;
+    struct ictredis_cqe *cqes;
+    char *data;                            ///< Data area of the rings
+    uint32_t sqEntries;
+    uint32_t cqMask;
+    size_t dataSize;
+    uint32_t sqTail;
+    uint32_t cqHead;
+    uint32_t nsqes;                        ///< Entries queued since the last ring enter
+    size_t used;                           ///< Bytes of the data area they take
+    unsigned int nitems;
+    struct conn_t *dirty;                  ///< Connections with replies to write or to close
+    struct ictredis_cqe results[RING_ENTRIES]; ///< The completions of the queued entries, by entry
+    uint64_t valueOff[RING_ENTRIES];       ///< Where the value of each GET entry is in the data area
+    struct item_t items[MAX_ITEMS];
+    struct arg_t argv[MAX_ARGS];
+};
+
+static const char *device = DEVICE_PATH;
+static unsigned int maxKeyLen = 250;       ///< The limits of the loaded module, checked before queueing
+static unsigned int maxValueLen = 4096;
+static unsigned int ringMaxData = RING_MIN_DATA; ///< The largest data area the module allows
+static struct conn_t listeners[2];
+static int nrListeners;
+
+static void ring_flush(struct worker_t *w);
+
+static void run_command(struct worker_t *w, struct conn_t *c, struct arg_t *argv, int argc);
+
+// read a module parameter, def if the module is not loaded
+static unsigned int module_parameter(const char *name, unsigned int def) {
+    char path[128];
+    unsigned int value = def;
+    FILE *f;
+
+    snprintf(path, sizeof(path), PARAMETERS_PATH "%s", name);
+    f = fopen(path, "re");
+    if (f != NULL) {
+        if (fscanf(f, "%u", &value) != 1) {
+            value = def;
+        }
+        fclose(f);
+    }
+    return value;
+}
+
+static int buf_reserve(struct buf_t *b, size_t more) {
+    size_t cap = b->cap ? b->cap : READ_CHUNK;
+    char *data;
+
+    if (b->len + more <= b->cap) {
+        return 0;
+    }
+    while (cap < b->len + more) {
+        cap *= 2;
+    }
+    data = realloc(b->data, cap);
+    if (data == NULL) {
+        return -1;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static void conn_dirty(struct worker_t *w, struct conn_t *c) {
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->nextDirty = w->dirty;
+        w->dirty = c;
+    }
+}
+
+// Append to the replies of c. A client whose replies can't be buffered is closed.
+static void reply_raw(struct worker_t *w, struct conn_t *c, const char *s, size_t len) {
+    if (buf_reserve(&c->out, len) < 0) {
+        c->closing = 1;
+    } else {
+        memcpy(c->out.data + c->out.len, s, len);
+        c->out.len += len;
+    }
+    conn_dirty(w, c);
+}
+
+static void reply_str(struct worker_t *w, struct conn_t *c, const char *s) {
+    reply_raw(w, c, s, strlen(s));
+}
+
+static void reply_int(struct worker_t *w, struct conn_t *c, long long n) {
+    char line[32];
+
+    reply_raw(w, c, line, snprintf(line, sizeof(line), ":%lld\r\n", n));
+}
+
+static void reply_bulk(struct worker_t *w, struct conn_t *c, const char *p, size_t len) {
+    char line[32];
+
+    reply_raw(w, c, line, snprintf(line, sizeof(line), "$%zu\r\n", len));
+    reply_raw(w, c, p, len);
+    reply_raw(w, c, "\r\n", 2);
+}
+
+// the error reply for a negative errno of the device
+static void reply_errno(struct worker_t *w, struct conn_t *c, int err) {
+    char line[128];
+
+    switch (-err) {
+        case E2BIG:
+            reply_str(w, c, "-ERR key or value too long\r\n");
+            break;
+        case ENOMEM:
+            reply_str(w, c, "-OOM command not allowed when used memory > 'max_memory'\r\n");
+            break;
+        default:
+            reply_raw(w, c, line, snprintf(line, sizeof(line), "-ERR %s\r\n", strerror(-err)));
+    }
+}
+
+// the error reply of an INCR, whose EINVAL and ERANGE mean the value or the sum is no integer
+static void reply_incr_errno(struct worker_t *w, struct conn_t *c, int err) {
+    if (err == -EINVAL || err == -ERANGE) {
+        reply_str(w, c, "-ERR value is not an integer or out of range\r\n");
+    } else {
+        reply_errno(w, c, err);
+    }
+}
+
+static void reply_arity(struct worker_t *w, struct conn_t *c, const struct arg_t *name) {
+    char line[128];
+
+    reply_raw(w, c, line, snprintf(line, sizeof(line), "-ERR wrong number of arguments for '%.*s' command\r\n",
+                                   (int) (name->len > 32 ? 32 : name->len), name->p));
+}
+
+// Run what is queued for c before replying to it directly, so its replies stay in order
+static void conn_sync(struct worker_t *w, struct conn_t *c) {
+    if (c->queued > 0) {
+        ring_flush(w);
+    }
+}
+
+// Make room for entries more entries, bytes more bytes of data and items more items, running the
+// ring if they don't fit
+static void ring_room(struct worker_t *w, uint32_t entries, size_t bytes, unsigned int items) {
+    if (w->nsqes + entries > w->sqEntries || w->used + bytes > w->dataSize || w->nitems + items > MAX_ITEMS) {
+        ring_flush(w);
+    }
+}
+
+// copy len bytes into the data area, returning where they are
+static uint64_t ring_copy(struct worker_t *w, const char *p, size_t len) {
+    uint64_t off = w->used;
+
+    memcpy(w->data + off, p, len);
+    w->used += len;
+    return off;
+}
+
+// Queue an entry, room for it was made. Returns its index in results.
+static int ring_queue(struct worker_t *w, uint8_t opcode, uint8_t flags, uint64_t key_off, uint32_t key_len,
+                      uint64_t value_off, uint32_t value_len, uint32_t ttl_ms) {
+    struct ictredis_sqe *sqe = &w->sqes[w->sqTail & (w->sqEntries - 1)];
+    int index = (int) w->nsqes++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->key_off = key_off;
+    sqe->key_len = key_len;
+    sqe->value_off = value_off;
+    sqe->value_len = value_len;
+    sqe->ttl_ms = ttl_ms;
+    sqe->user_data = index;
+    w->valueOff[index] = value_off;
+    w->sqTail++;
+    return index;
+}
+
+static void item_queue(struct worker_t *w, struct conn_t *c, int reply, int flags, int sqe, long arg) {
+    struct item_t *it = &w->items[w->nitems++];
+
+    it->conn = c;
+    it->reply = (uint8_t) reply;
+    it->flags = (uint8_t) flags;
+    it->sqe = sqe;
+    it->arg = arg;
+    c->queued++;
+}
+
+// queue a GET of key into get_len bytes of the data area, answered by reply
+static void queue_get(struct worker_t *w, struct conn_t *c, const struct arg_t *key, uint32_t get_len, int reply,
+                      int flags) {
+    uint64_t key_off;
+    int sqe;
+
+    ring_room(w, 1, key->len + get_len, 1);
+    key_off = ring_copy(w, key->p, key->len);
+    sqe = ring_queue(w, GET, 0, key_off, (uint32_t) key->len, w->used, get_len, 0);
+    w->used += get_len;
+    item_queue(w, c, reply, flags, sqe, 0);
+}
+
+// Queue the entry of a SET: MSET to store the value either way, PUSH for NX or EDIT for XX.
+// sqe_flags links the keys of an MSET.
+static void queue_set(struct worker_t *w, struct conn_t *c, const struct arg_t *key, const struct arg_t *value,
+                      uint32_t ttl_ms, uint8_t opcode, uint8_t sqe_flags, int reply, int flags) {
+    uint64_t key_off, value_off;
+    int sqe;
+
+    ring_room(w, 1, key->len + value->len, 1);
+    key_off = ring_copy(w, key->p, key->len);
+    value_off = ring_copy(w, value->p, value->len);
+    sqe = ring_queue(w, opcode, sqe_flags, key_off, (uint32_t) key->len, value_off, (uint32_t) value->len, ttl_ms);
+    item_queue(w, c, reply, flags, sqe, 0);
+}
+
+// Queue the keys of an MSET as one chain, which the module stores all at once. The whole chain
+// has to go into one ring enter.
+static void queue_mset(struct worker_t *w, struct conn_t *c, const struct arg_t *argv, int argc) {
+    size_t bytes = 0;
+    int i, n = (argc - 1) / 2;
+
+    for (i = 1; i < argc; i++) {
+        bytes += argv[i].len;
+    }
+    if (n > ICTREDIS_CHAIN_MAX || bytes > w->dataSize) {
+        conn_sync(w, c);
+        reply_str(w, c, "-ERR too many keys or bytes for one MSET\r\n");
+        return;
+    }
+    ring_room(w, (uint32_t) n, bytes, (unsigned int) n);
+    for (i = 1; i < argc; i += 2) {
+        queue_set(w, c, &argv[i], &argv[i + 1], 0, MSET, i < argc - 2 ? ICTREDIS_SQE_LINK : 0, R_MSET,
+                  (i == 1 ? ITEM_FIRST : 0) | (i == argc - 2 ? ITEM_LAST : 0));
+    }
+}
+
+static void queue_delete(struct worker_t *w, struct conn_t *c, const struct arg_t *key, int flags) {
+    uint64_t key_off;
+    int sqe;
+
+    ring_room(w, 1, key->len, 1);
+    key_off = ring_copy(w, key->p, key->len);
+    sqe = ring_queue(w, DELETE, 0, key_off, (uint32_t) key->len, 0, 0, 0);
+    item_queue(w, c, R_COUNT, flags, sqe, 0);
+}
+
+// Write the part of a reply an item stands for, in the order the items were queued
+static void render(struct worker_t *w, struct item_t *it) {
+    struct conn_t *c = it->conn;
+    const struct ictredis_cqe *cqe = it->sqe >= 0 ? &w->results[it->sqe] : NULL;
+    int res = cqe != NULL ? cqe->res : 0;
+
+    c->queued--;
+    if (it->flags & ITEM_FIRST) {
+        c->accErr = 0;
+        c->accCount = 0;
+    }
+    switch (it->reply) {
+        case R_ARRAY: {
+            char line[32];
+            reply_raw(w, c, line, snprintf(line, sizeof(line), "*%ld\r\n", it->arg));
+            return;
+        }
+        case R_GET:
+            if (res == 0) {
+                reply_bulk(w, c, w->data + w->valueOff[it->sqe], cqe->value_len);
+            } else if (res == -ENOENT) {
+                reply_str(w, c, "$-1\r\n");
+            } else {
+                reply_errno(w, c, res);
+            }
+            return;
+        case R_STRLEN:
+            if (res == 0 || res == -ERANGE) {
+                reply_int(w, c, cqe->value_len);
+            } else if (res == -ENOENT) {
+                reply_int(w, c, 0);
+            } else {
+                reply_errno(w, c, res);
+            }
+            return;
+        case R_COUNT:
+        case R_EXISTS:
+            if (res == 0 || (res == -ERANGE && it->reply == R_EXISTS)) {
+                c->accCount++;
+            } else if (res != -ENOENT && c->accErr == 0) {
+                c->accErr = res;
+            }
+            break;
+        case R_SET:
+        case R_SETNX:
+            // only NX finds the key present and only XX finds it missing
+            if (res == 0) {
+                reply_str(w, c, it->reply == R_SET ? "+OK\r\n" : ":1\r\n");
+            } else if (res == -EEXIST || res == -ENOENT) {
+                reply_str(w, c, it->reply == R_SET ? "$-1\r\n" : ":0\r\n");
+            } else {
+                reply_errno(w, c, res);
+            }
+            return;
+        default:
+            // the key that failed an MSET says why, the others were only canceled
+            if (res != 0 && (c->accErr == 0 || c->accErr == -ECANCELED)) {
+                c->accErr = res;
+            }
+            break;
+    }
+    if (!(it->flags & ITEM_LAST)) {
+        return;
+    }
+    if (c->accErr != 0) {
+        reply_errno(w, c, c->accErr);
+    } else if (it->reply == R_COUNT || it->reply == R_EXISTS) {
+        reply_int(w, c, c->accCount);
+    } else {
+        reply_str(w, c, "+OK\r\n");
+    }
+}
+
+// Run the queued entries with one ring enter and write the replies waiting for them
+static void ring_flush(struct worker_t *w) {
+    const struct ictredis_cqe *cqe;
+    uint32_t done = 0, tail;
+    unsigned int i;
+
+    if (w->nsqes > 0) {
+        __atomic_store_n(&w->ring->sq_tail, w->sqTail, __ATOMIC_RELEASE);   // the entries before the tail
+        while (done < w->nsqes) {
+            if (ioctl(w->fd, ICTREDIS_IOC_RING_ENTER) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Failed to run the ring");
+                exit(1);
+            }
+            tail = __atomic_load_n(&w->ring->cq_tail, __ATOMIC_ACQUIRE);
+            for (; w->cqHead != tail; w->cqHead++, done++) {
+                cqe = &w->cqes[w->cqHead & w->cqMask];
+                w->results[cqe->user_data] = *cqe;
+            }
+            __atomic_store_n(&w->ring->cq_head, w->cqHead, __ATOMIC_RELEASE);
+        }
+    }
+    for (i = 0; i < w->nitems; i++) {
+        render(w, &w->items[i]);
+    }
+    w->nitems = 0;
+    w->nsqes = 0;
+    w->used = 0;
+}
+
+static int arg_is(const struct arg_t *a, const char *name) {
+    return a->len == strlen(name) && strncasecmp(a->p, name, a->len) == 0;
+}
+
+// a decimal integer argument
+static int arg_long(const struct arg_t *a, long long *value) {
+    char buf[32], *end;
+
+    if (a->len == 0 || a->len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, a->p, a->len);
+    buf[a->len] = '\0';
+    errno = 0;
+    *value = strtoll(buf, &end, 10);
+    return errno != 0 || *end != '\0' ? -1 : 0;
+}
+
+// whether the keys and values fit the limits of the module, replying with an error if not
+static int args_fit(struct worker_t *w, struct conn_t *c, const struct arg_t *argv, int from, int argc, int step) {
+    int i;
+
+    for (i = from; i < argc; i += step) {
+        if (argv[i].len > maxKeyLen || (step == 2 && argv[i + 1].len > maxValueLen)) {
+            conn_sync(w, c);
+            reply_errno(w, c, -E2BIG);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// SET key value [EX seconds|PX milliseconds] [NX|XX], SETEX, PSETEX and SETNX
+static void cmd_set(struct worker_t *w, struct conn_t *c, struct arg_t *argv, int argc) {
+    struct arg_t *key = &argv[1], *value = &argv[2];
+    long long ttl = 0, n;
+    int edit = 1, push = 1, reply = R_SET, i;
+    uint8_t opcode;
+
+    if (arg_is(&argv[0], "SETEX") || arg_is(&argv[0], "PSETEX")) {
+        if (argc != 4) {
+            conn_sync(w, c);
+            reply_arity(w, c, &argv[0]);
+            return;
+        }
+        if (arg_long(&argv[2], &n) < 0 || n <= 0 || n > UINT32_MAX / (argv[0].len == 5 ? 1000 : 1)) {
+            conn_sync(w, c);
+            reply_str(w, c, "-ERR invalid expire time\r\n");
+            return;
+        }
+        ttl = argv[0].len == 5 ? n * 1000 : n;
+        value = &argv[3];
+    } else if (arg_is(&argv[0], "SETNX")) {
+        if (argc != 3) {
+            conn_sync(w, c);
+            reply_arity(w, c, &argv[0]);
+            return;
+        }
+        edit = 0;
+        reply = R_SETNX;
+    } else {
+        if (argc < 3) {
+            conn_sync(w, c);
+            reply_arity(w, c, &argv[0]);
+            return;
+        }
+        for (i = 3; i < argc; i++) {
+            if (arg_is(&argv[i], "NX")) {
+                edit = 0;
+            } else if (arg_is(&argv[i], "XX")) {
+                push = 0;
+            } else if ((arg_is(&argv[i], "EX") || arg_is(&argv[i], "PX")) && i + 1 < argc) {
+                if (arg_long(&argv[i + 1], &n) < 0 || n <= 0 ||
+                    n > UINT32_MAX / (toupper((unsigned char) argv[i].p[0]) == 'E' ? 1000 : 1)) {
+                    conn_sync(w, c);
+                    reply_str(w, c, "-ERR invalid expire time in 'set' command\r\n");
+                    return;
+                }
+                ttl = toupper((unsigned char) argv[i].p[0]) == 'E' ? n * 1000 : n;
+                i++;
+            } else {
+                conn_sync(w, c);
+                reply_str(w, c, "-ERR syntax error\r\n");
+                return;
+            }
+        }
+        if (!edit && !push) {
+            conn_sync(w, c);
+            reply_str(w, c, "-ERR syntax error\r\n");
+            return;
+        }
+    }
+    if (key->len > maxKeyLen || value->len > maxValueLen) {
+        conn_sync(w, c);
+        reply_errno(w, c, -E2BIG);
+        return;
+    }
+    opcode = !edit ? PUSH : !push ? EDIT : MSET;
+    queue_set(w, c, key, value, (uint32_t) ttl, opcode, 0, reply, ITEM_FIRST | ITEM_LAST);
+}
+
+// INCR, DECR, INCRBY and DECRBY, an ioctl() of their own
+static void cmd_incr(struct worker_t *w, struct conn_t *c, struct arg_t *argv, int argc) {
+    struct ictredis_incr incr;
+    long long delta = 1;
+    int by = argv[0].len > 4;
+
+    conn_sync(w, c);
+    if (argc != (by ? 3 : 2)) {
+        reply_arity(w, c, &argv[0]);
+        return;
+    }
+    if (by && arg_long(&argv[2], &delta) < 0) {
+        reply_incr_errno(w, c, -EINVAL);
+        return;
+    }
+    if (toupper((unsigned char) argv[0].p[0]) == 'D') {
+        if (delta == LLONG_MIN) {
+            reply_incr_errno(w, c, -ERANGE);
+            return;
+        }
+        delta = -delta;
+    }
+    if (argv[1].len > maxKeyLen) {
+        reply_errno(w, c, -E2BIG);
+        return;
+    }
+    memset(&incr, 0, sizeof(incr));
+    incr.key = (uintptr_t) argv[1].p;
+    incr.key_len = (uint32_t) argv[1].len;
+    incr.delta = delta;
+    if (ioctl(w->fd, ICTREDIS_IOC_INCRBY, &incr) < 0) {
+        reply_incr_errno(w, c, -errno);
+    } else {
+        reply_int(w, c, incr.result);
+    }
+}
+
+static void run_command(struct worker_t *w, struct conn_t *c, struct arg_t *argv, int argc) {
+    const struct arg_t *name = &argv[0];
+    char line[128];
+    int i;
+
+    if (arg_is(name, "GET")) {
+        if (argc != 2) {
+            conn_sync(w, c);
+            reply_arity(w, c, name);
+        } else if (args_fit(w, c, argv, 1, argc, 1)) {
+            queue_get(w, c, &argv[1], maxValueLen, R_GET, ITEM_FIRST | ITEM_LAST);
+        }
+    } else if (arg_is(name, "SET") || arg_is(name, "SETNX") || arg_is(name, "SETEX") || arg_is(name, "PSETEX")) {
+        cmd_set(w, c, argv, argc);
+    } else if (arg_is(name, "MGET")) {
+        if (argc < 2) {
+            conn_sync(w, c);
+            reply_arity(w, c, name);
+        } else if (args_fit(w, c, argv, 1, argc, 1)) {
+            ring_room(w, 0, 0, 1);
+            item_queue(w, c, R_ARRAY, 0, -1, argc - 1);
+            for (i = 1; i < argc; i++) {
+                queue_get(w, c, &argv[i], maxValueLen, R_GET, ITEM_FIRST | ITEM_LAST);
+            }
+        }
+    } else if (arg_is(name, "MSET")) {
+        if (argc < 3 || argc % 2 == 0) {
+            conn_sync(w, c);
+            reply_arity(w, c, name);
+        } else if (args_fit(w, c, argv, 1, argc, 2)) {
+            queue_mset(w, c, argv, argc);
+        }
+    } else if (arg_is(name, "DEL") || arg_is(name, "UNLINK") || arg_is(name, "EXISTS")) {
+        if (argc < 2) {
+            conn_sync(w, c);
+            reply_arity(w, c, name);
+        } else if (args_fit(w, c, argv, 1, argc, 1)) {
+            for (i = 1; i < argc; i++) {
+                int flags = (i == 1 ? ITEM_FIRST : 0) | (i == argc - 1 ? ITEM_LAST : 0);
+                if (arg_is(name, "EXISTS")) {
+                    queue_get(w, c, &argv[i], 0, R_EXISTS, flags);     // no buffer, only whether it is there
+                } else {
+                    queue_delete(w, c, &argv[i], flags);
+                }
+            }
+        }
+    } else if (arg_is(name, "STRLEN")) {
+        if (argc != 2) {
+            conn_sync(w, c);
+            reply_arity(w, c, name);
+        } else if (args_fit(w, c, argv, 1, argc, 1)) {
+            queue_get(w, c, &argv[1], 0, R_STRLEN, ITEM_FIRST | ITEM_LAST);
+        }
+    } else if (arg_is(name, "INCR") || arg_is(name, "DECR") || arg_is(name, "INCRBY") || arg_is(name, "DECRBY")) {
+        cmd_incr(w, c, argv, argc);
+    } else {
+        conn_sync(w, c);
+        if (arg_is(name, "PING")) {
+            if (argc == 1) {
+                reply_str(w, c, "+PONG\r\n");
+            } else {
+                reply_bulk(w, c, argv[1].p, argv[1].len);
+            }
+        } else if (arg_is(name, "ECHO")) {
+            if (argc != 2) {
+                reply_arity(w, c, name);
+            } else {
+                reply_bulk(w, c, argv[1].p, argv[1].len);
+            }
+        } else if (arg_is(name, "SELECT")) {
+            reply_str(w, c, argc == 2 && arg_is(&argv[1], "0") ? "+OK\r\n" : "-ERR DB index is out of range\r\n");
+        } else if (arg_is(name, "COMMAND") || arg_is(name, "CONFIG")) {
+            reply_str(w, c, "*0\r\n");
+        } else if (arg_is(name, "QUIT")) {
+            reply_str(w, c, "+OK\r\n");
+            c->quit = 1;
+        } else {
+            reply_raw(w, c, line, snprintf(line, sizeof(line), "-ERR unknown command '%.*s'\r\n",
+                                           (int) (name->len > 32 ? 32 : name->len), name->p));
+        }
+    }
+}
+
+// the number on a line of RESP, from p up to the \r
+static int parse_number(const char *p, const char *end, long *value) {
+    long n = 0;
+    int negative = 0;
+
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    if (p == end || *end != '\r') {
+        return -1;
+    }
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9' || n > MAX_REQUEST) {
+            return -1;
+        }
+        n = n * 10 + (*p - '0');
+    }
+    *value = negative ? -n : n;
+    return 0;
+}
+
+// Parse the command at the start of what c has not run yet into the arguments of w, 1 if there
+// is a whole one, 0 if more has to be read, -1 if it is not RESP or has more than MAX_ARGS
+// arguments
+static int parse_command(struct worker_t *w, struct conn_t *c, int *argc) {
+    char *p = c->in.data + c->parsed, *end = c->in.data + c->in.len, *nl, *line_end;
+    long n, len;
+    int i;
+
+    *argc = 0;
+    if (p == end) {
+        return 0;
+    }
+    nl = memchr(p, '\n', end - p);
+    if (nl == NULL) {
+        return end - p > MAX_INLINE && *p != '*' ? -1 : 0;
+    }
+    if (*p != '*') {
+        // an inline command, arguments separated by spaces
+        line_end = nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+        while (p < line_end) {
+            while (p < line_end && *p == ' ') {
+                p++;
+            }
+            if (p == line_end) {
+                break;
+            }
+            if (*argc == MAX_ARGS) {
+                return -1;
+            }
+            w->argv[*argc].p = p;
+            while (p < line_end && *p != ' ') {
+                p++;
+            }
+            w->argv[*argc].len = p - w->argv[*argc].p;
+            (*argc)++;
+        }
+        c->parsed = nl + 1 - c->in.data;
+        return 1;
+    }
+    if (nl == p || parse_number(p + 1, nl - 1, &n) < 0 || n > MAX_ARGS) {
+        return -1;
+    }
+    p = nl + 1;
+    for (i = 0; i < n; i++) {
+        if (p == end) {
+            return 0;
+        }
+        nl = memchr(p, '\n', end - p);
+        if (*p != '$') {
+            return -1;
+        }
+        if (nl == NULL) {
+            return 0;
+        }
+        if (parse_number(p + 1, nl - 1, &len) < 0 || len < 0) {
+            return -1;
+        }
+        p = nl + 1;
+        if (end - p < len + 2) {
+            return 0;
+        }
+        if (p[len] != '\r' || p[len + 1] != '\n') {
+            return -1;
+        }
+        w->argv[i].p = p;
+        w->argv[i].len = len;
+        p += len + 2;
+    }
+    *argc = n > 0 ? (int) n : 0;
+    c->parsed = p - c->in.data;
+    return 1;
+}
+
+// Read what a client sent and run every whole command in it
+static void conn_read(struct worker_t *w, struct conn_t *c) {
+    ssize_t n;
+    int ret, argc;
+
+    if (buf_reserve(&c->in, READ_CHUNK) < 0) {
+        c->closing = 1;
+        conn_dirty(w, c);
+        return;
+    }
+    n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        // the client may only have shut down its side, the replies to what it sent still go out
+        if (n < 0) {
+            c->closing = 1;
+        }
+        c->quit = 1;
+        conn_dirty(w, c);
+        return;
+    }
+    c->in.len += n;
+    while (!c->quit && (ret = parse_command(w, c, &argc)) == 1) {
+        if (argc > 0) {
+            run_command(w, c, w->argv, argc);
+        }
+    }
+    if (!c->quit && (ret < 0 || c->in.len - c->parsed > MAX_REQUEST)) {
+        conn_sync(w, c);
+        reply_str(w, c, "-ERR Protocol error\r\n");
+        c->quit = 1;
+    }
+    // the ring holds copies of the keys and values, what was run can go
+    memmove(c->in.data, c->in.data + c->parsed, c->in.len - c->parsed);
+    c->in.len -= c->parsed;
+    c->parsed = 0;
+}
+
+static void conn_close(struct worker_t *w, struct conn_t *c) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+// Write the replies of a client and wait for it to be writable if they don't all fit, and
+// stop reading from it while too many are left
+static void conn_write(struct worker_t *w, struct conn_t *c) {
+    struct epoll_event ev;
+    ssize_t n;
+
+    while (!c->closing && c->sent < c->out.len) {
+        n = write(c->fd, c->out.data + c->sent, c->out.len - c->sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                c->closing = 1;
+            }
+            break;
+        }
+        c->sent += n;
+    }
+    if (c->sent == c->out.len) {
+        c->sent = 0;
+        c->out.len = 0;
+    }
+    if (c->closing || (c->quit && c->out.len == 0)) {
+        conn_close(w, c);
+        return;
+    }
+    ev.events = (c->quit || c->out.len - c->sent > OUT_LIMIT ? 0 : EPOLLIN) | (c->out.len > 0 ? EPOLLOUT : 0);
+    if (ev.events != c->events) {
+        ev.data.ptr = c;
+        c->events = ev.events;
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+}
+
+static void worker_accept(struct worker_t *w, int lfd) {
+    struct epoll_event ev;
+    struct conn_t *c;
+    int fd, one = 1;
+
+    for (;;) {
+        fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;                         // EAGAIN, another worker took it, or out of descriptors
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // fails harmlessly on a Unix socket
+        c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+static void *worker_run(void *arg) {
+    struct worker_t *w = (struct worker_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct conn_t *c, *next;
+    int n, i;
+
+    for (;;) {
+        n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+        for (i = 0; i < n; i++) {
+            c = (struct conn_t *) events[i].data.ptr;
+            if (c->listener) {
+                worker_accept(w, c->fd);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                conn_read(w, c);
+            }
+            if (events[i].events & EPOLLOUT) {
+                conn_dirty(w, c);
+            }
+        }
+        // one ring enter for the commands of every connection read above
+        ring_flush(w);
+        for (c = w->dirty, w->dirty = NULL; c != NULL; c = next) {
+            next = c->nextDirty;
+            c->dirty = 0;
+            conn_write(w, c);
+        }
+    }
+    return NULL;
+}
+
+// open the device for a worker, set its rings up and listen on every socket
+static int worker_init(struct worker_t *w) {
+    struct ictredis_ring_params params;
+    struct epoll_event ev;
+    char *mem;
+    int i;
+
+    w->fd = open(device, O_RDWR | O_CLOEXEC);
+    if (w->fd < 0) {
+        perror("Failed to open the device");
+        return -1;
+    }
+    memset(&params, 0, sizeof(params));
+    params.sq_entries = RING_ENTRIES;
+    params.cq_entries = RING_ENTRIES;
+    // room for a whole SET of the longest key and value, and a GET of it, at the least
+    params.data_size = RING_MIN_DATA < ringMaxData ? RING_MIN_DATA : ringMaxData;
+    while (params.data_size < 4 * ((size_t) maxKeyLen + maxValueLen) && params.data_size < ringMaxData) {
+        params.data_size = 2 * params.data_size < ringMaxData ? 2 * params.data_size : ringMaxData;
+    }
+    if (2 * ((size_t) maxKeyLen + maxValueLen) > params.data_size) {
+        fprintf(stderr, "max_value_len %u is too long for the rings\n", maxValueLen);
+        return -1;
+    }
+    if (ioctl(w->fd, ICTREDIS_IOC_RING_SETUP, &params) < 0) {
+        perror("Failed to set the rings up");
+        return -1;
+    }
+    mem = mmap(NULL, params.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("Failed to map the rings");
+        return -1;
+    }
+    w->ring = (struct ictredis_ring *) mem;
+    w->sqes = (struct ictredis_sqe *) (mem + params.sqes_off);
+    w->cqes = (struct ictredis_cqe *) (mem + params.cqes_off);
+    w->data = mem + params.data_off;
+    w->sqEntries = params.sq_entries < RING_ENTRIES ? params.sq_entries : RING_ENTRIES;
+    w->cqMask = params.cq_entries - 1;
+    w->dataSize = params.data_size;
+
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0) {
+        perror("Failed to create an epoll instance");
+        return -1;
+    }
+    for (i = 0; i < nrListeners; i++) {
+        // only one of the workers waiting is woken for a new connection
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &listeners[i];
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listeners[i].fd, &ev) < 0) {
+            perror("Failed to watch the listening socket");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int listen_tcp(const char *address, int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s\n", address);
+        return -1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create the socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("Failed to listen on TCP");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create the socket");
+        return -1;
+    }
+    unlink(path);                           // left over from an earlier run
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("Failed to listen on the Unix socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    const char *address = "127.0.0.1", *socket_path = NULL;
+    struct worker_t *workers;
+    long nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int port = DEFAULT_PORT, opt, fd, i;
+
+    while ((opt = getopt(argc, argv, "p:b:s:w:D:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'b':
+                address = optarg;
+                break;
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'w':
+                nr_workers = atol(optarg);
+                break;
+            case 'D':
+                device = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-b address] [-s unix_socket] [-w workers] [-D device]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (nr_workers < 1 || port < 0 || port > 65535 || (port == 0 && socket_path == NULL)) {
+        fprintf(stderr, "Need at least one worker and a port or a Unix socket\n");
+        return 1;
+    }
+    maxKeyLen = module_parameter("max_key_len", maxKeyLen);
+    maxValueLen = module_parameter("max_value_len", maxValueLen);
+    ringMaxData = module_parameter("ring_max_data", ringMaxData);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (port != 0) {
+        fd = listen_tcp(address, port);
+        if (fd < 0) {
+            return 1;
+        }
+        listeners[nrListeners].fd = fd;
+        listeners[nrListeners++].listener = 1;
+    }
+    if (socket_path != NULL) {
+        fd = listen_unix(socket_path);
+        if (fd < 0) {
+            return 1;
+        }
+        listeners[nrListeners].fd = fd;
+        listeners[nrListeners++].listener = 1;
+    }
+
+    workers = calloc(nr_workers, sizeof(*workers));
+    if (workers == NULL) {
+        perror("Failed to allocate the workers");
+        return 1;
+    }
+    for (i = 0; i < nr_workers; i++) {
+        if (worker_init(&workers[i]) < 0) {
+            return 1;
+        }
+    }
+    for (i = 0; i < nr_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            perror("Failed to start a worker");
+            return 1;
+        }
+    }
+    printf("Serving %s on", device);
+    if (port != 0) {
+        printf(" %s:%d", address, port);
+    }
+    if (socket_path != NULL) {
+        printf(" %s", socket_path);
+    }
+    printf(" with %ld workers\n", nr_workers);
+    fflush(stdout);
+    for (i = 0; i < nr_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    return 0;
+}
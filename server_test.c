@@ -0,0 +1,470 @@
+/**
+ * @file   server_test.c
+ * @brief  Tests of ictredis_server, run by ctest. It starts the server on a Unix socket of its
+ * own and runs a script of Redis commands against it, checking each reply byte for byte: GET,
+ * SET and its NX, XX and EX options, SETNX, MGET, MSET, DEL, EXISTS, INCR and the errors of
+ * each, inline and pipelined commands, a client that shuts down its side before reading the
+ * replies, and SETs that keep succeeding while another client deletes and creates the same key.
+ *
+ * Usage: ictredis_server_test -S server [-D device]
+ *
+ * The server needs the loaded module, without the device the test is skipped, not failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "ictRedis.h"
+#include "ictRedis_test.h"
+
+#define KEY_SIZE 64
+#define KEY_SLOTS 8                         ///< Keys one command can name with key()
+#define MAX_ARGS 16                         ///< Most arguments of a command passed to run()
+#define SERVER_MAX_ARGS 4096                ///< Most arguments the server takes in one command
+#define REPLY_TIMEOUT_MS 5000
+#define START_TIMEOUT_MS 5000
+#define HALF_CLOSE_VALUE 4000               ///< Bytes of the value a half closed client reads
+#define HALF_CLOSE_GETS 500                 ///< Times it reads it, far more than a socket holds
+#define RACE_ROUNDS 200                     ///< Pipelines of SETs racing the DELs and SETNXs of other clients
+#define RACE_BATCH 100                      ///< Commands of each pipeline
+#define RACE_OTHERS 3                       ///< Clients deleting and creating the key meanwhile
+
+static char socketPath[108];
+
+// the key called name in this run, valid until KEY_SLOTS more keys were made
+static const char *key(const char *name) {
+    static char keys[KEY_SLOTS][KEY_SIZE];
+    static unsigned int next;
+    char *k = keys[next++ % KEY_SLOTS];
+
+    snprintf(k, KEY_SIZE, "%s%s", prefix, name);
+    return k;
+}
+
+static int conn_open(void) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *p, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Append a command to buf as a RESP array of its arguments. Returns the new length of buf,
+// which grows as needed.
+static size_t command_argv(char **buf, size_t len, int argc, const char **argv) {
+    size_t need = 16;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        need += strlen(argv[i]) + 32;
+    }
+    *buf = realloc(*buf, len + need);
+    if (*buf == NULL) {
+        perror("Failed to allocate a command");
+        exit(1);
+    }
+    len += sprintf(*buf + len, "*%d\r\n", argc);
+    for (i = 0; i < argc; i++) {
+        len += sprintf(*buf + len, "$%zu\r\n%s\r\n", strlen(argv[i]), argv[i]);
+    }
+    return len;
+}
+
+static size_t command_va(char **buf, size_t len, va_list ap) {
+    const char *argv[MAX_ARGS], *arg;
+    int argc = 0;
+
+    while ((arg = va_arg(ap, const char *)) != NULL && argc < MAX_ARGS) {
+        argv[argc++] = arg;
+    }
+    return command_argv(buf, len, argc, argv);
+}
+
+// command_argv() with the arguments following, up to a NULL
+static size_t command(char **buf, size_t len, ...) {
+    va_list ap;
+
+    va_start(ap, len);
+    len = command_va(buf, len, ap);
+    va_end(ap);
+    return len;
+}
+
+// Read until len bytes came or the server closed the connection, 0 only if they all came
+static int read_exact(int fd, char *buf, size_t len, size_t *got) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    ssize_t n;
+
+    *got = 0;
+    while (*got < len) {
+        if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0) {
+            return -1;
+        }
+        n = read(fd, buf + *got, len - *got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        *got += n;
+    }
+    return 0;
+}
+
+// whether the next bytes the server sends are exactly reply
+static int expect(int fd, const char *reply) {
+    size_t len = strlen(reply), got;
+    char *buf = malloc(len + 1);
+    int ok;
+
+    if (buf == NULL) {
+        return 0;
+    }
+    ok = read_exact(fd, buf, len, &got) == 0 && memcmp(buf, reply, len) == 0;
+    if (!ok) {
+        buf[got] = '\0';
+        fprintf(stderr, "expected \"%.200s\", got \"%.200s\"\n", reply, buf);
+    }
+    free(buf);
+    return ok;
+}
+
+// Send one command, its NULL-terminated arguments following, and check its reply
+static int run(int fd, const char *reply, ...) {
+    char *buf = NULL;
+    size_t len;
+    va_list ap;
+    int ok;
+
+    va_start(ap, reply);
+    len = command_va(&buf, 0, ap);
+    va_end(ap);
+    ok = send_all(fd, buf, len) == 0 && expect(fd, reply);
+    free(buf);
+    return ok;
+}
+
+// whether the server closes the connection without sending anything more
+static int expect_closed(int fd) {
+    char c;
+    size_t got;
+
+    return read_exact(fd, &c, 1, &got) < 0 && got == 0;
+}
+
+static void test_strings(int fd) {
+    CHECK(run(fd, "+PONG\r\n", "PING", NULL));
+    CHECK(run(fd, "+OK\r\n", "SET", key("a"), "1", NULL));
+    CHECK(run(fd, "$1\r\n1\r\n", "GET", key("a"), NULL));
+    CHECK(run(fd, "+OK\r\n", "SET", key("a"), "hello", NULL));
+    CHECK(run(fd, "$5\r\nhello\r\n", "GET", key("a"), NULL));
+    CHECK(run(fd, "$-1\r\n", "GET", key("missing"), NULL));
+    CHECK(run(fd, "$-1\r\n", "SET", key("a"), "x", "NX", NULL));
+    CHECK(run(fd, "$-1\r\n", "SET", key("b"), "x", "XX", NULL));
+    CHECK(run(fd, "+OK\r\n", "SET", key("b"), "x", "NX", NULL));
+    CHECK(run(fd, "+OK\r\n", "SET", key("b"), "y", "XX", NULL));
+    CHECK(run(fd, ":0\r\n", "SETNX", key("b"), "z", NULL));
+    CHECK(run(fd, ":1\r\n", "SETNX", key("c"), "z", NULL));
+    CHECK(run(fd, ":3\r\n", "EXISTS", key("a"), key("b"), key("c"), key("missing"), NULL));
+    CHECK(run(fd, ":5\r\n", "STRLEN", key("a"), NULL));
+    CHECK(run(fd, "+OK\r\n", "SET", key("t"), "v", "PX", "100", NULL));
+    CHECK(run(fd, "$1\r\nv\r\n", "GET", key("t"), NULL));
+    usleep(200 * 1000);
+    CHECK(run(fd, "$-1\r\n", "GET", key("t"), NULL));
+    CHECK(run(fd, "-ERR invalid expire time in 'set' command\r\n", "SET", key("t"), "v", "EX", "0", NULL));
+    CHECK(run(fd, "-ERR syntax error\r\n", "SET", key("t"), "v", "NX", "XX", NULL));
+    CHECK(run(fd, "-ERR wrong number of arguments for 'GET' command\r\n", "GET", NULL));
+    CHECK(run(fd, ":3\r\n", "DEL", key("a"), key("b"), key("c"), key("missing"), NULL));
+}
+
+static void test_multi(int fd) {
+    static char keys[ICTREDIS_CHAIN_MAX + 1][KEY_SIZE];
+    const char *argv[2 * (ICTREDIS_CHAIN_MAX + 1) + 1];
+    char *buf = NULL;
+    size_t len;
+    int i;
+
+    CHECK(run(fd, "+OK\r\n", "MSET", key("m1"), "v1", key("m2"), "v2", NULL));
+    CHECK(run(fd, "*3\r\n$2\r\nv1\r\n$-1\r\n$2\r\nv2\r\n", "MGET", key("m1"), key("missing"), key("m2"), NULL));
+    CHECK(run(fd, "+OK\r\n", "MSET", key("m1"), "w1", key("m3"), "w3", NULL));
+    CHECK(run(fd, "*2\r\n$2\r\nw1\r\n$2\r\nw3\r\n", "MGET", key("m1"), key("m3"), NULL));
+    CHECK(run(fd, ":3\r\n", "DEL", key("m1"), key("m2"), key("m3"), NULL));
+
+    // one key more than a chain holds is refused as a whole
+    argv[0] = "MSET";
+    for (i = 0; i <= ICTREDIS_CHAIN_MAX; i++) {
+        snprintf(keys[i], KEY_SIZE, "%sbig:%d", prefix, i);
+        argv[2 * i + 1] = keys[i];
+        argv[2 * i + 2] = "v";
+    }
+    len = command_argv(&buf, 0, 2 * (ICTREDIS_CHAIN_MAX + 1) + 1, argv);
+    CHECK(send_all(fd, buf, len) == 0 && expect(fd, "-ERR too many keys or bytes for one MSET\r\n"));
+    free(buf);
+    CHECK(run(fd, ":0\r\n", "EXISTS", keys[0], NULL));
+}
+
+static void test_incr(int fd) {
+    CHECK(run(fd, ":1\r\n", "INCR", key("n"), NULL));
+    CHECK(run(fd, ":11\r\n", "INCRBY", key("n"), "10", NULL));
+    CHECK(run(fd, ":10\r\n", "DECR", key("n"), NULL));
+    CHECK(run(fd, ":7\r\n", "DECRBY", key("n"), "3", NULL));
+    CHECK(run(fd, "-ERR value is not an integer or out of range\r\n", "INCRBY", key("n"), "x", NULL));
+    CHECK(run(fd, "+OK\r\n", "SET", key("s"), "abc", NULL));
+    CHECK(run(fd, "-ERR value is not an integer or out of range\r\n", "INCR", key("s"), NULL));
+    CHECK(run(fd, ":2\r\n", "DEL", key("n"), key("s"), NULL));
+}
+
+// commands sent in one write are answered in order, those run by the ring and the others
+static void test_pipeline(int fd) {
+    const char *k = key("p");
+    char *buf = NULL;
+    size_t len = 0;
+
+    len = command(&buf, len, "SET", k, "1", NULL);
+    len = command(&buf, len, "INCR", k, NULL);
+    len = command(&buf, len, "GET", k, NULL);
+    len = command(&buf, len, "PING", NULL);
+    len = command(&buf, len, "DEL", k, NULL);
+    len = command(&buf, len, "GET", k, NULL);
+    CHECK(send_all(fd, buf, len) == 0 && expect(fd, "+OK\r\n:2\r\n$1\r\n2\r\n+PONG\r\n:1\r\n$-1\r\n"));
+    free(buf);
+}
+
+// Commands sent as a line of words. One with more words than the server takes arguments is a
+// protocol error, not a shorter command.
+static void test_inline(void) {
+    char *line = malloc(SERVER_MAX_ARGS * 2 + 16);
+    size_t len;
+    int fd = conn_open(), i;
+
+    CHECK(fd >= 0);
+    if (fd < 0 || line == NULL) {
+        free(line);
+        return;
+    }
+    CHECK(send_all(fd, "PING\r\n", 6) == 0 && expect(fd, "+PONG\r\n"));
+    len = sprintf(line, "EXISTS");
+    for (i = 0; i < SERVER_MAX_ARGS; i++) {
+        len += sprintf(line + len, " k");
+    }
+    len += sprintf(line + len, "\r\n");
+    CHECK(send_all(fd, line, len) == 0 && expect(fd, "-ERR Protocol error\r\n"));
+    CHECK(expect_closed(fd));
+    free(line);
+    close(fd);
+}
+
+// A client that shuts down its side right after its commands still gets every reply, even
+// those that only fit in the socket once it read the first ones
+static void test_half_close(void) {
+    char value[HALF_CLOSE_VALUE + 1], *buf = NULL, *replies;
+    size_t len = 0, off;
+    int fd = conn_open(), i;
+
+    CHECK(fd >= 0);
+    replies = malloc(HALF_CLOSE_GETS * (HALF_CLOSE_VALUE + 16) + 16);
+    if (fd < 0 || replies == NULL) {
+        free(replies);
+        return;
+    }
+    memset(value, 'h', HALF_CLOSE_VALUE);
+    value[HALF_CLOSE_VALUE] = '\0';
+    len = command(&buf, len, "SET", key("h"), value, NULL);
+    off = sprintf(replies, "+OK\r\n");
+    for (i = 0; i < HALF_CLOSE_GETS; i++) {
+        len = command(&buf, len, "GET", key("h"), NULL);
+        off += sprintf(replies + off, "$%d\r\n%s\r\n", HALF_CLOSE_VALUE, value);
+    }
+    len = command(&buf, len, "DEL", key("h"), NULL);
+    strcpy(replies + off, ":1\r\n");
+    CHECK(send_all(fd, buf, len) == 0 && shutdown(fd, SHUT_WR) == 0);
+    CHECK(expect(fd, replies));
+    CHECK(expect_closed(fd));
+    free(replies);
+    free(buf);
+    close(fd);
+}
+
+// Delete the key and create it again over and over on a connection of its own, so a SET that
+// looks for the key and then stores it could find it gone or back in between
+static void *race_other(void *arg) {
+    const char *k = arg;
+    char *buf = NULL, *replies = malloc(8 * RACE_BATCH);
+    size_t len = 0, got;
+    int fd = conn_open(), i;
+
+    for (i = 0; i < RACE_BATCH; i++) {
+        len = command(&buf, len, "DEL", k, NULL);
+        len = command(&buf, len, "SETNX", k, "w", NULL);
+    }
+    for (i = 0; fd >= 0 && replies != NULL && i < RACE_ROUNDS; i++) {
+        // ":0" or ":1" each, four bytes either way
+        if (send_all(fd, buf, len) < 0 || read_exact(fd, replies, 8 * RACE_BATCH, &got) < 0) {
+            break;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(replies);
+    free(buf);
+    return NULL;
+}
+
+// A SET stores the value whatever other clients do to the key at the same time. The server
+// spreads the clients over its workers, so some of them run on other CPUs.
+static void test_set_race(int fd) {
+    char k[KEY_SIZE], *buf = NULL, *replies = NULL;
+    size_t len = 0;
+    pthread_t others[RACE_OTHERS];
+    int i, started, lost = 0;
+
+    snprintf(k, sizeof(k), "%srace", prefix);
+    for (i = 0; i < RACE_BATCH; i++) {
+        len = command(&buf, len, "SET", k, "v", NULL);
+        replies = realloc(replies, 5 * (i + 1) + 1);
+        strcpy(replies + 5 * i, "+OK\r\n");
+    }
+    for (started = 0; started < RACE_OTHERS; started++) {
+        if (pthread_create(&others[started], NULL, race_other, k) != 0) {
+            CHECK(!"failed to start the other clients");
+            break;
+        }
+    }
+    for (i = 0; i < RACE_ROUNDS; i++) {
+        lost += send_all(fd, buf, len) < 0 || !expect(fd, replies);
+    }
+    while (started-- > 0) {
+        pthread_join(others[started], NULL);
+    }
+    CHECK(lost == 0);
+    CHECK(run(fd, "+OK\r\n", "SET", k, "v", NULL));
+    CHECK(run(fd, ":1\r\n", "DEL", k, NULL));
+    free(replies);
+    free(buf);
+}
+
+// Start the server on socketPath and wait until it accepts connections, -1 if it exited first
+static pid_t server_start(const char *server, const char *device) {
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+    int waited, fd, status;
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("Failed to fork");
+        return -1;
+    }
+    if (pid == 0) {
+        execl(server, server, "-p", "0", "-s", socketPath, "-w", "2", "-D", device, (char *) NULL);
+        perror("Failed to run the server");
+        _exit(127);
+    }
+    for (waited = 0; waited < START_TIMEOUT_MS; waited += 10) {
+        fd = conn_open();
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "%s exited before it served %s\n", server, socketPath);
+            return -1;
+        }
+        nanosleep(&pause, NULL);
+    }
+    fprintf(stderr, "%s did not serve %s in time\n", server, socketPath);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    const char *server = NULL, *device = DEVICE_PATH;
+    pid_t pid;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "S:D:")) != -1) {
+        if (opt == 'S') {
+            server = optarg;
+        } else if (opt == 'D') {
+            device = optarg;
+        } else {
+            server = NULL;
+            break;
+        }
+    }
+    if (server == NULL) {
+        fprintf(stderr, "Usage: %s -S server [-D device]\n", argv[0]);
+        return 2;
+    }
+    fd = test_open_device(device);
+    if (fd < 0) {
+        return SKIPPED;
+    }
+    close(fd);
+    test_prefix("server_test");
+    snprintf(socketPath, sizeof(socketPath), "/tmp/ictredis_server_test.%ld.sock", (long) getpid());
+
+    pid = server_start(server, device);
+    if (pid < 0) {
+        return 1;
+    }
+    fd = conn_open();
+    CHECK(fd >= 0);
+    if (fd >= 0) {
+        test_strings(fd);
+        test_multi(fd);
+        test_incr(fd);
+        test_pipeline(fd);
+        test_set_race(fd);
+        CHECK(run(fd, "+OK\r\n", "QUIT", NULL));
+        CHECK(expect_closed(fd));
+        close(fd);
+    }
+    test_inline();
+    test_half_close();
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(socketPath);
+    printf("%s: %s\n", server, failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,442 @@
+/**
+ * @file   store_test.c
+ * @brief  Tests of the ictredis store, run by ctest. The same cases run against an in-process
+ * store of libictredis and, when it can be opened, against the loaded module through
+ * /dev/ictredis: PUSH, GET, EDIT, DELETE, TTL, CAS, INCRBY and GETRANGE, long values that may be
+ * stored compressed, and threads reading keys while others store enough of them to make every
+ * table grow several times. SCAN only exists on the device and is only tested there.
+ *
+ * Usage: ictredis_store_test [-D device]
+ *
+ * Without the device its tests are skipped, not failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "ictRedis.h"
+#include "ictRedis_lib.h"
+#include "ictRedis_test.h"
+
+#define KEY_SIZE 64
+#define LONG_VALUE 3000                 ///< Long enough to be compressed with COMPRESS_MIN_LEN
+#define COMPRESS_MIN_LEN 256
+#define STRESS_WRITERS 2
+#define STRESS_READERS 4
+#define STRESS_KEYS 100000              ///< Stored by each writer, enough for several resizes of every table
+
+/// One store under test, the library or the device behind the same calls
+struct backend_t {
+    const char *name;
+    ictredis_t *store;                  ///< The in-process store, NULL for the device
+    int fd;
+};
+
+static size_t make_key(char *key, const char *name, long n) {
+    return (size_t) snprintf(key, KEY_SIZE, "%s%s:%ld", prefix, name, n);
+}
+
+static int do_store(struct backend_t *b, unsigned long request, const char *key, const char *value, size_t value_len,
+                    uint32_t ttl_ms) {
+    struct ictredis_cmd cmd = {
+            .key = (uintptr_t) key, .value = (uintptr_t) value,
+            .key_len = (uint32_t) strlen(key), .value_len = (uint32_t) value_len, .ttl_ms = ttl_ms,
+    };
+
+    if (b->store != NULL) {
+        return request == ICTREDIS_IOC_SET ? ictredis_push(b->store, key, strlen(key), value, value_len, ttl_ms)
+                                           : ictredis_edit(b->store, key, strlen(key), value, value_len, ttl_ms);
+    }
+    return ioctl(b->fd, request, &cmd) < 0 ? -errno : 0;
+}
+
+static int do_push(struct backend_t *b, const char *key, const char *value, size_t value_len, uint32_t ttl_ms) {
+    return do_store(b, ICTREDIS_IOC_SET, key, value, value_len, ttl_ms);
+}
+
+static int do_edit(struct backend_t *b, const char *key, const char *value, size_t value_len, uint32_t ttl_ms) {
+    return do_store(b, ICTREDIS_IOC_EDIT, key, value, value_len, ttl_ms);
+}
+
+static int do_delete(struct backend_t *b, const char *key) {
+    struct ictredis_cmd cmd = {.key = (uintptr_t) key, .key_len = (uint32_t) strlen(key)};
+
+    if (b->store != NULL) {
+        return ictredis_delete(b->store, key, strlen(key));
+    }
+    return ioctl(b->fd, ICTREDIS_IOC_DEL, &cmd) < 0 ? -errno : 0;
+}
+
+// the length of the value copied to value, or -errno
+static ssize_t do_gets(struct backend_t *b, const char *key, char *value, size_t size, uint64_t *version) {
+    struct ictredis_cas c = {.key = (uintptr_t) key, .value = (uintptr_t) value, .key_len = (uint32_t) strlen(key),
+                             .value_len = (uint32_t) size};
+
+    if (b->store != NULL) {
+        return ictredis_gets(b->store, key, strlen(key), value, size, version);
+    }
+    if (ioctl(b->fd, ICTREDIS_IOC_GETS, &c) < 0) {
+        return -errno;
+    }
+    *version = c.version;
+    return c.value_len;
+}
+
+static ssize_t do_get(struct backend_t *b, const char *key, char *value, size_t size) {
+    uint64_t version;
+
+    return do_gets(b, key, value, size, &version);
+}
+
+static int do_cas(struct backend_t *b, const char *key, const char *value, uint64_t version, uint64_t *new_version) {
+    struct ictredis_cas c = {.key = (uintptr_t) key, .value = (uintptr_t) value, .key_len = (uint32_t) strlen(key),
+                             .value_len = (uint32_t) strlen(value), .version = version};
+
+    if (b->store != NULL) {
+        return ictredis_cas(b->store, key, strlen(key), value, strlen(value), 0, version, new_version);
+    }
+    if (ioctl(b->fd, ICTREDIS_IOC_CAS, &c) < 0) {
+        return -errno;
+    }
+    *new_version = c.version;
+    return 0;
+}
+
+static int do_incrby(struct backend_t *b, const char *key, int64_t delta, int64_t *result) {
+    struct ictredis_incr c = {.key = (uintptr_t) key, .key_len = (uint32_t) strlen(key), .delta = delta};
+
+    if (b->store != NULL) {
+        return ictredis_incrby(b->store, key, strlen(key), delta, result);
+    }
+    if (ioctl(b->fd, ICTREDIS_IOC_INCRBY, &c) < 0) {
+        return -errno;
+    }
+    *result = c.result;
+    return 0;
+}
+
+// the bytes offset to offset + size - 1 of the value, the number copied or -errno
+static ssize_t do_getrange(struct backend_t *b, const char *key, uint64_t offset, char *buf, size_t size,
+                           uint64_t *value_len) {
+    struct ictredis_range r = {.key = (uintptr_t) key, .value = (uintptr_t) buf, .offset = offset,
+                               .key_len = (uint32_t) strlen(key), .value_len = (uint32_t) size};
+
+    if (b->store != NULL) {
+        return ictredis_getrange(b->store, key, strlen(key), (int64_t) offset, (int64_t) (offset + size - 1), buf,
+                                 value_len);
+    }
+    if (ioctl(b->fd, ICTREDIS_IOC_GETRANGE, &r) < 0) {
+        return -errno;
+    }
+    *value_len = r.total_len;
+    return r.value_len;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+
+    nanosleep(&ts, NULL);
+}
+
+static void test_basic(struct backend_t *b) {
+    char key[KEY_SIZE], value[64];
+
+    make_key(key, "basic", 0);
+    CHECK_IN(b->name, do_push(b, key, "one", 3, 0) == 0);
+    CHECK_IN(b->name, do_push(b, key, "two", 3, 0) == -EEXIST);
+    CHECK_IN(b->name, do_get(b, key, value, sizeof(value)) == 3 && memcmp(value, "one", 3) == 0);
+    CHECK_IN(b->name, do_edit(b, key, "three", 5, 0) == 0);
+    CHECK_IN(b->name, do_get(b, key, value, sizeof(value)) == 5 && memcmp(value, "three", 5) == 0);
+    CHECK_IN(b->name, do_push(b, key, "", 0, 0) == -EEXIST);
+    CHECK_IN(b->name, do_delete(b, key) == 0);
+    CHECK_IN(b->name, do_delete(b, key) == -ENOENT);
+    CHECK_IN(b->name, do_get(b, key, value, sizeof(value)) == -ENOENT);
+    CHECK_IN(b->name, do_edit(b, key, "four", 4, 0) == -ENOENT);
+    CHECK_IN(b->name, do_push(b, key, "", 0, 0) == 0);
+    CHECK_IN(b->name, do_get(b, key, value, sizeof(value)) == 0);
+    CHECK_IN(b->name, do_delete(b, key) == 0);
+}
+
+static void test_ttl(struct backend_t *b) {
+    char key[KEY_SIZE], value[64];
+
+    make_key(key, "ttl", 0);
+    CHECK_IN(b->name, do_push(b, key, "soon", 4, 100) == 0);
+    CHECK_IN(b->name, do_get(b, key, value, sizeof(value)) == 4);
+    sleep_ms(250);
+    CHECK_IN(b->name, do_get(b, key, value, sizeof(value)) == -ENOENT);
+    CHECK_IN(b->name, do_push(b, key, "again", 5, 0) == 0);
+    CHECK_IN(b->name, do_edit(b, key, "later", 5, 100) == 0);
+    sleep_ms(250);
+    CHECK_IN(b->name, do_edit(b, key, "late", 4, 0) == -ENOENT);
+    CHECK_IN(b->name, do_delete(b, key) == -ENOENT);
+}
+
+static void test_cas(struct backend_t *b) {
+    char key[KEY_SIZE], value[64];
+    uint64_t version = 0, stored = 0, again = 0;
+
+    make_key(key, "cas", 0);
+    CHECK_IN(b->name, do_cas(b, key, "a", 5, &stored) == -ENOENT);
+    CHECK_IN(b->name, do_cas(b, key, "a", 0, &stored) == 0 && stored != 0);
+    CHECK_IN(b->name, do_cas(b, key, "b", 0, &again) == -EEXIST);
+    CHECK_IN(b->name, do_gets(b, key, value, sizeof(value), &version) == 1 && version == stored);
+    CHECK_IN(b->name, do_cas(b, key, "b", version, &stored) == 0 && stored > version);
+    CHECK_IN(b->name, do_cas(b, key, "c", version, &again) == -ESTALE);
+    CHECK_IN(b->name, do_edit(b, key, "b", 1, 0) == 0);
+    CHECK_IN(b->name, do_cas(b, key, "c", stored, &again) == -ESTALE);   // the same value written again is a change too
+    CHECK_IN(b->name, do_get(b, key, value, sizeof(value)) == 1 && value[0] == 'b');
+    CHECK_IN(b->name, do_delete(b, key) == 0);
+}
+
+static void test_incr(struct backend_t *b) {
+    char key[KEY_SIZE], value[64];
+    int64_t result = 0;
+
+    make_key(key, "incr", 0);
+    CHECK_IN(b->name, do_incrby(b, key, 5, &result) == 0 && result == 5);
+    CHECK_IN(b->name, do_incrby(b, key, -7, &result) == 0 && result == -2);
+    CHECK_IN(b->name, do_get(b, key, value, sizeof(value)) == 2 && memcmp(value, "-2", 2) == 0);
+    CHECK_IN(b->name, do_edit(b, key, "9223372036854775807", 19, 0) == 0);
+    CHECK_IN(b->name, do_incrby(b, key, 1, &result) == -ERANGE);
+    CHECK_IN(b->name, do_edit(b, key, "ten", 3, 0) == 0);
+    CHECK_IN(b->name, do_incrby(b, key, 1, &result) == -EINVAL);
+    CHECK_IN(b->name, do_delete(b, key) == 0);
+}
+
+// ranges of a short and of a long value, which may be stored compressed; nothing past the
+// range may be written to the buffer
+static void test_getrange(struct backend_t *b) {
+    char key[KEY_SIZE], value[LONG_VALUE], buf[LONG_VALUE + 16];
+    uint64_t value_len = 0;
+    ssize_t n;
+    int i;
+
+    make_key(key, "range", 0);
+    CHECK_IN(b->name, do_push(b, key, "0123456789", 10, 0) == 0);
+    memset(buf, '#', sizeof(buf));
+    CHECK_IN(b->name, do_getrange(b, key, 2, buf, 4, &value_len) == 4 && memcmp(buf, "2345#", 5) == 0 &&
+                      value_len == 10);
+    CHECK_IN(b->name, do_getrange(b, key, 8, buf, 10, &value_len) == 2 && memcmp(buf, "89", 2) == 0);
+    CHECK_IN(b->name, do_getrange(b, key, 10, buf, 10, &value_len) == 0);
+    CHECK_IN(b->name, do_delete(b, key) == 0);
+    CHECK_IN(b->name, do_getrange(b, key, 0, buf, 4, &value_len) == -ENOENT);
+
+    for (i = 0; i < LONG_VALUE; i++) {
+        value[i] = "compressible "[i % 13];
+    }
+    CHECK_IN(b->name, do_push(b, key, value, LONG_VALUE, 0) == 0);
+    CHECK_IN(b->name, do_get(b, key, buf, sizeof(buf)) == LONG_VALUE && memcmp(buf, value, LONG_VALUE) == 0);
+    for (i = 0; i < LONG_VALUE; i += 700) {
+        memset(buf, '#', sizeof(buf));
+        n = do_getrange(b, key, i, buf, 100, &value_len);
+        CHECK_IN(b->name, n == 100 && memcmp(buf, value + i, 100) == 0 && buf[100] == '#' && value_len == LONG_VALUE);
+    }
+    // the rest of the value a piece at a time, as a reader of a long value does
+    for (i = 0; i < LONG_VALUE; i += n) {
+        n = do_getrange(b, key, i, buf, 512, &value_len);
+        CHECK_IN(b->name, n > 0 && memcmp(buf, value + i, n) == 0);
+        if (n <= 0) {
+            break;
+        }
+    }
+    CHECK_IN(b->name, do_edit(b, key, value + 1, LONG_VALUE - 1, 0) == 0);
+    CHECK_IN(b->name, do_getrange(b, key, 1000, buf, 10, &value_len) == 10 && memcmp(buf, value + 1001, 10) == 0);
+    CHECK_IN(b->name, do_delete(b, key) == 0);
+}
+
+// negative positions only exist in the library
+static void test_getrange_negative(struct backend_t *b) {
+    char key[KEY_SIZE], buf[16];
+    uint64_t value_len = 0;
+    size_t key_len = make_key(key, "negative", 0);
+
+    CHECK_IN(b->name, ictredis_push(b->store, key, key_len, "0123456789", 10, 0) == 0);
+    CHECK_IN(b->name, ictredis_getrange(b->store, key, key_len, -3, -1, buf, &value_len) == 3 &&
+                      memcmp(buf, "789", 3) == 0);
+    CHECK_IN(b->name, ictredis_getrange(b->store, key, key_len, -100, 1, buf, NULL) == 2 && memcmp(buf, "01", 2) == 0);
+    CHECK_IN(b->name, ictredis_getrange(b->store, key, key_len, 5, 2, buf, NULL) == 0);
+    CHECK_IN(b->name, ictredis_getrange(b->store, key, key_len, 0, -1, NULL, &value_len) == 10 && value_len == 10);
+    CHECK_IN(b->name, ictredis_delete(b->store, key, key_len) == 0);
+}
+
+// "4|prefix|1|": every key with the prefix in order with its value, read in small pieces
+static void test_scan(struct backend_t *b) {
+    char key[KEY_SIZE], value[16], request[KEY_SIZE + 8], out[65536], expect[KEY_SIZE + 32];
+    size_t len = 0;
+    ssize_t n;
+    int i;
+
+    for (i = 4; i >= 0; i--) {
+        make_key(key, "scan", i);
+        snprintf(value, sizeof(value), "v%d", i);
+        CHECK_IN(b->name, do_push(b, key, value, strlen(value), 0) == 0);
+    }
+    make_key(key, "scan", 3);
+    CHECK_IN(b->name, do_delete(b, key) == 0);
+    snprintf(request, sizeof(request), "4|%sscan:|1|", prefix);
+    CHECK_IN(b->name, write(b->fd, request, strlen(request)) == (ssize_t) strlen(request));
+    while (len + 64 < sizeof(out) && (n = read(b->fd, out + len, 64)) > 0) {
+        len += n;
+    }
+    CHECK_IN(b->name, n == 0);
+    out[len] = '\0';
+    for (i = 0; i < 5; i++) {
+        if (i == 3) {
+            continue;
+        }
+        make_key(key, "scan", i);
+        snprintf(expect, sizeof(expect), "%zu|%s|2|v%d\n", strlen(key), key, i);
+        CHECK_IN(b->name, strncmp(out, expect, strlen(expect)) == 0);
+        memmove(out, out + strlen(expect), strlen(out + strlen(expect)) + 1);
+        CHECK_IN(b->name, do_delete(b, key) == 0);
+    }
+    CHECK_IN(b->name, out[0] == '\0');
+}
+
+/// Shared by the threads of the stress test
+struct stress_t {
+    struct backend_t *backend;
+    long stored[STRESS_WRITERS];        ///< Keys each writer has stored so far, readers look below it
+    int stop;
+    int id;
+    long misses;
+};
+
+static void *stress_writer(void *arg) {
+    struct stress_t *st = (struct stress_t *) arg;
+    int id = __atomic_fetch_add(&st->id, 1, __ATOMIC_RELAXED);
+    char key[KEY_SIZE], name[16];
+    long i;
+
+    snprintf(name, sizeof(name), "stress%d", id);
+    for (i = 0; i < STRESS_KEYS; i++) {
+        make_key(key, name, i);
+        if (do_push(st->backend, key, key, strlen(key), 0) < 0) {
+            __atomic_add_fetch(&st->misses, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&st->stored[id], i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// every key a writer has stored has to be found with its value while the tables grow
+static void *stress_reader(void *arg) {
+    struct stress_t *st = (struct stress_t *) arg;
+    char key[KEY_SIZE], name[16], value[KEY_SIZE];
+    uint64_t state = (uintptr_t) &state;
+    long n, i;
+    int w;
+
+    while (!__atomic_load_n(&st->stop, __ATOMIC_ACQUIRE)) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        w = (int) ((state >> 33) % STRESS_WRITERS);
+        n = __atomic_load_n(&st->stored[w], __ATOMIC_ACQUIRE);
+        if (n == 0) {
+            continue;
+        }
+        i = (long) ((state >> 17) % (uint64_t) n);
+        snprintf(name, sizeof(name), "stress%d", w);
+        make_key(key, name, i);
+        if (do_get(st->backend, key, value, sizeof(value)) != (ssize_t) strlen(key) ||
+            memcmp(value, key, strlen(key)) != 0) {
+            __atomic_add_fetch(&st->misses, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static void test_resize_stress(struct backend_t *b) {
+    struct stress_t st = {.backend = b};
+    pthread_t writers[STRESS_WRITERS], readers[STRESS_READERS];
+    char key[KEY_SIZE], name[16];
+    long i;
+    int w;
+
+    for (w = 0; w < STRESS_READERS; w++) {
+        pthread_create(&readers[w], NULL, stress_reader, &st);
+    }
+    for (w = 0; w < STRESS_WRITERS; w++) {
+        pthread_create(&writers[w], NULL, stress_writer, &st);
+    }
+    for (w = 0; w < STRESS_WRITERS; w++) {
+        pthread_join(writers[w], NULL);
+    }
+    __atomic_store_n(&st.stop, 1, __ATOMIC_RELEASE);
+    for (w = 0; w < STRESS_READERS; w++) {
+        pthread_join(readers[w], NULL);
+    }
+    CHECK_IN(b->name, st.misses == 0);
+    for (w = 0; w < STRESS_WRITERS; w++) {
+        snprintf(name, sizeof(name), "stress%d", w);
+        for (i = 0; i < STRESS_KEYS; i++) {
+            make_key(key, name, i);
+            CHECK_IN(b->name, do_delete(b, key) == 0);
+        }
+    }
+}
+
+static void run_tests(struct backend_t *b) {
+    int before = failures;
+
+    test_basic(b);
+    test_ttl(b);
+    test_cas(b);
+    test_incr(b);
+    test_getrange(b);
+    if (b->store != NULL) {
+        test_getrange_negative(b);
+    } else {
+        test_scan(b);
+    }
+    test_resize_stress(b);
+    printf("%s: %s\n", b->name, failures == before ? "passed" : "FAILED");
+}
+
+int main(int argc, char **argv) {
+    struct ictredis_options options = {.nr_shards = 4, .compress_min_len = COMPRESS_MIN_LEN};
+    struct backend_t library = {.name = "libictredis", .fd = -1};
+    struct backend_t device = {.name = DEVICE_PATH, .fd = -1};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "D:")) != -1) {
+        if (opt != 'D') {
+            fprintf(stderr, "Usage: %s [-D device]\n", argv[0]);
+            return 2;
+        }
+        device.name = optarg;
+    }
+    test_prefix("store_test");
+
+    // few shards, so the stress test grows each of them from the smallest table on
+    if (ictredis_init(&options) == -EOPNOTSUPP) {
+        printf("libictredis: built without liblz4, long values are stored as they are\n");
+        options.compress_min_len = 0;
+        if (ictredis_init(&options) < 0) {
+            fprintf(stderr, "libictredis: failed to set the engine up\n");
+            return 1;
+        }
+    }
+    library.store = ictredis_open(0);
+    if (library.store == NULL) {
+        perror("libictredis: failed to open a store");
+        return 1;
+    }
+    run_tests(&library);
+    ictredis_close(library.store);
+    ictredis_exit();
+
+    device.fd = test_open_device(device.name);
+    if (device.fd >= 0) {
+        run_tests(&device);
+        close(device.fd);
+    }
+    return failures == 0 ? 0 : 1;
+}
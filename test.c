@@ -14,12 +14,12 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+
+#include "ictRedis.h"
 
 #define BUFFER_LENGTH 256               ///< The buffer length (crude but fine)
 static char receive[BUFFER_LENGTH];     ///< The receive buffer from the LKM
-enum mode_write_e {
-    PUSH = 0, GET = 1, EDIT = 2, DELETE = 3
-};
 
 int main() {
     int ret, fd, n, result, action;
@@ -37,7 +37,9 @@ int main() {
         printf("| 2. Read a key                                    |\n");
         printf("| 3. Edit a key-value                              |\n");
         printf("| 4. Delete key-value                              |\n");
-        printf("| 5. Exit                                          |\n");
+        printf("| 5. List keys with a prefix                       |\n");
+        printf("| 6. Watch a key for changes                       |\n");
+        printf("| 7. Exit                                          |\n");
         printf("+==================================================+\n");
         printf("Choose an action: ");
         scanf("%d%*c", &action);
@@ -98,10 +100,11 @@ int main() {
                 if (ret == 0) {
                     printf("Key %s not found\n", key);
                 } else {
-                    int rret = read(fd, value, 50);
+                    int rret = read(fd, value, sizeof(value) - 1);
                     if (rret <= 0) {
                         printf("Key %s not found\n", key);
                     } else {
+                        value[rret] = '\0';              // the value comes without a terminating NUL
                         printf("Key %s found with value: %s\n", key, value);
                     }
                 }
@@ -173,6 +176,69 @@ int main() {
                 break;
 
             case 5: {
+                // scan
+                fd = open("/dev/ictredis", O_RDWR);             // Open the device with read/write access
+                if (fd < 0) {
+                    perror("Failed to open the device...");
+                    break;
+                }
+
+                printf("Enter the prefix (empty for every key): ");
+                key[0] = '\0';
+                scanf ("%[^\n]", key);
+                scanf ("%*c");
+                snprintf(buffer, 110, "%d|%s|1", SCAN, key);
+                ret = write(fd, buffer, strlen(buffer));
+                if (ret < 0) {
+                    perror("Failed to write the message to the device.");
+                    close(fd);
+                    break;
+                }
+                // every read returns the next "key_len|key|value_len|value" lines, 0 at the end
+                while ((n = read(fd, receive, BUFFER_LENGTH - 1)) > 0) {
+                    receive[n] = '\0';
+                    printf("%s", receive);
+                }
+                if (n < 0) {
+                    perror("Failed to read the keys.");
+                }
+
+                close(fd);
+            }
+                break;
+
+            case 6: {
+                // watch
+                struct pollfd pfd;
+                fd = open("/dev/ictredis", O_RDWR);             // Open the device with read/write access
+                if (fd < 0) {
+                    perror("Failed to open the device...");
+                    break;
+                }
+
+                printf("Enter the key you want to watch: ");
+                scanf ("%[^\n]%*c", key);
+                snprintf(buffer, 110, "%d|%s", WATCH, key);
+                ret = write(fd, buffer, strlen(buffer));
+                if (ret < 0 || read(fd, receive, BUFFER_LENGTH - 1) <= 0 || atoi(receive) < 0) {
+                    perror("Failed to watch the key.");
+                    close(fd);
+                    break;
+                }
+                // sleep in poll() until the key changes, then print the "mode|key_len|key" lines
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                printf("Waiting for a change of %s...\n", key);
+                if (poll(&pfd, 1, -1) > 0 && (n = read(fd, receive, BUFFER_LENGTH - 1)) > 0) {
+                    receive[n] = '\0';
+                    printf("%s", receive);
+                }
+
+                close(fd);
+            }
+                break;
+
+            case 7: {
                 printf("Exit\n");
                 exit(1);
             }